@@ -50,6 +50,7 @@ type Config struct {
 	RerankTopN     int           // 先取 embedding topN，再用 rerank 重排
 	RerankTimeout  time.Duration // 单次 rerank 请求超时
 	RerankMinBatch int           // 少于这个数量不 rerank（节省开销）
+	RerankPriority string        // interactive | batch (X-Rerank-Priority); applies to every rerank call this process makes
 
 	// ---- Web ----
 	HTTPAddr                 string
@@ -105,6 +106,7 @@ func defaultConfig() Config {
 		RerankTopN:     20,               // ✅ 推荐：SearchTopK 的 4x 左右
 		RerankTimeout:  15 * time.Second, // ✅ 你本地跑，一般够了
 		RerankMinBatch: 2,
+		RerankPriority: "interactive",
 
 		HTTPAddr:                 defaultHTTPAddr,
 		HTTPAuthToken:            "",
@@ -209,6 +211,16 @@ func defaultConfig() Config {
 			cfg.RerankMinBatch = n
 		}
 	}
+	if v := os.Getenv("TIMELAYER_RERANK_PRIORITY"); v != "" {
+		// interactive | batch
+		p := strings.ToLower(strings.TrimSpace(v))
+		switch p {
+		case "interactive", "batch":
+			cfg.RerankPriority = p
+		default:
+			// keep default
+		}
+	}
 
 	// ---- Search Intent Gate ENV (only affects rerank gating) ----
 	if v := os.Getenv("TIMELAYER_SEARCH_MIN_STRONG"); v != "" {
@@ -6,6 +6,7 @@ import (
 	"fmt"
 	"io"
 	"net/http"
+	"strconv"
 	"strings"
 	"time"
 )
@@ -47,6 +48,14 @@ func rerankTexts(cfg Config, query string, docs []string) ([]float64, error) {
 		return nil, err
 	}
 	httpReq.Header.Set("Content-Type", "application/json")
+	// rerank_http drops work for requests past this deadline instead of finishing it for nobody.
+	if ms := cfg.RerankTimeout.Milliseconds(); ms > 0 {
+		httpReq.Header.Set("X-Request-Timeout-Ms", strconv.FormatInt(ms, 10))
+	}
+	// batch 优先级的请求只占用空闲算力，不会拖慢 chat 的 rerank。
+	if cfg.RerankPriority != "" {
+		httpReq.Header.Set("X-Rerank-Priority", cfg.RerankPriority)
+	}
 
 	client := &http.Client{
 		Timeout: cfg.RerankTimeout,
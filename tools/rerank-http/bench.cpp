@@ -0,0 +1,366 @@
+// rerank_http/bench.cpp
+// rerank_bench: numbers for comparing builds and tuning knobs.
+//
+//   rerank_bench infer --model model.onnx [--ep cpu|coreml|cuda|tensorrt] [--batch 1,8,32] [--seq 64,128,256]
+//                      [--iters 50] [--warmup 5] [--intra 1] [--inter 1]
+//     Scores random rows in-process through rerank_core at every (B,S) pair and
+//     reports the session.Run latency alone (no HTTP, batching or cache).
+//
+//   rerank_bench http --url http://127.0.0.1:8089/v1/rerank [--batch 8] [--seq 128]
+//                     [--concurrency 8] [--duration 10] [--rate 0] [--body json|tensor]
+//     Load generator against a live server. --rate 0 is closed loop (each
+//     connection sends back to back); --rate R is open loop at R req/s, with
+//     latency counted from the scheduled send time so a stalled server shows up
+//     as latency instead of a lower send rate. Every request carries fresh random
+//     tokens, so the score cache never answers for the model.
+//
+//   Common: --format csv|json (stdout, default csv), --vocab 1000 (token ids are
+//   drawn from [5, vocab)), --seed 1. Progress goes to stderr.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <httplib.h>
+#include <nlohmann/json.hpp>
+
+#include "rerank_core.hpp"
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+/* ===================== CLI ===================== */
+
+static void print_usage(const char* argv0) {
+    std::cerr
+        << "Usage:\n"
+        << "  " << argv0 << " infer --model model.onnx [--ep cpu|coreml|cuda|tensorrt] [--batch 1,8,32] [--seq 64,128,256]\n"
+        << "        [--iters 50] [--warmup 5] [--intra 1] [--inter 1]\n"
+        << "  " << argv0 << " http --url http://127.0.0.1:8089/v1/rerank [--batch 8] [--seq 128]\n"
+        << "        [--concurrency 8] [--duration 10] [--rate 0] [--body json|tensor]\n"
+        << "Common: --format csv|json, --vocab 1000, --seed 1\n";
+}
+
+struct Args {
+    std::string mode;
+    std::map<std::string, std::string> kv;
+
+    std::string str(const char* key, const std::string& defv) const {
+        auto it = kv.find(key);
+        return it == kv.end() ? defv : it->second;
+    }
+    long long num(const char* key, long long defv) const {
+        auto it = kv.find(key);
+        if (it == kv.end()) return defv;
+        try { return std::stoll(it->second); } catch (...) {
+            throw std::runtime_error(std::string("--") + key + ": expected an integer");
+        }
+    }
+    double real(const char* key, double defv) const {
+        auto it = kv.find(key);
+        if (it == kv.end()) return defv;
+        try { return std::stod(it->second); } catch (...) {
+            throw std::runtime_error(std::string("--") + key + ": expected a number");
+        }
+    }
+};
+
+static Args parse_args(int argc, char** argv) {
+    if (argc < 2) throw std::runtime_error("missing mode (infer|http)");
+    Args a;
+    a.mode = argv[1];
+    for (int i = 2; i < argc; i++) {
+        if (std::strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc) {
+            throw std::runtime_error(std::string("unexpected argument: ") + argv[i]);
+        }
+        a.kv[argv[i] + 2] = argv[i + 1];
+        i++;
+    }
+    return a;
+}
+
+/* ===================== Results ===================== */
+
+// One output line: a (B,S) point in infer mode, one load run in http mode.
+struct BenchRow {
+    std::string mode;
+    int64_t B = 0;
+    int64_t S = 0;
+    int64_t concurrency = 1;
+    double rate = 0;      // target req/s, 0 = closed loop
+    int64_t ok = 0;
+    int64_t errors = 0;   // transport failures and non-2xx other than 429
+    int64_t rejected = 0; // 429 (admission control)
+    double wall_sec = 0;
+    double req_per_sec = 0;
+    double rows_per_sec = 0;
+    double mean_ms = 0, p50_ms = 0, p95_ms = 0, p99_ms = 0, max_ms = 0;
+};
+
+// Nearest-rank percentiles over every sample (runs are short enough to keep them all).
+static void summarize(std::vector<double>& ms, BenchRow& r) {
+    if (ms.empty()) return;
+    std::sort(ms.begin(), ms.end());
+    auto pct = [&](double p) {
+        size_t k = (size_t)std::ceil(p / 100.0 * (double)ms.size());
+        return ms[std::min(ms.size() - 1, k > 0 ? k - 1 : 0)];
+    };
+    double sum = 0;
+    for (double v : ms) sum += v;
+    r.mean_ms = sum / (double)ms.size();
+    r.p50_ms = pct(50);
+    r.p95_ms = pct(95);
+    r.p99_ms = pct(99);
+    r.max_ms = ms.back();
+}
+
+static void print_rows(const std::vector<BenchRow>& rows, const std::string& format) {
+    if (format == "json") {
+        json a = json::array();
+        for (auto& r : rows) {
+            a.push_back({
+                {"mode", r.mode}, {"B", r.B}, {"S", r.S}, {"concurrency", r.concurrency}, {"rate", r.rate},
+                {"ok", r.ok}, {"errors", r.errors}, {"rejected", r.rejected}, {"wall_sec", r.wall_sec},
+                {"req_per_sec", r.req_per_sec}, {"rows_per_sec", r.rows_per_sec},
+                {"mean_ms", r.mean_ms}, {"p50_ms", r.p50_ms}, {"p95_ms", r.p95_ms},
+                {"p99_ms", r.p99_ms}, {"max_ms", r.max_ms},
+            });
+        }
+        std::cout << a.dump(2) << "\n";
+        return;
+    }
+    std::cout << "mode,B,S,concurrency,rate,ok,errors,rejected,wall_sec,req_per_sec,rows_per_sec,"
+                 "mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+    for (auto& r : rows) {
+        std::printf("%s,%lld,%lld,%lld,%.1f,%lld,%lld,%lld,%.3f,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                    r.mode.c_str(), (long long)r.B, (long long)r.S, (long long)r.concurrency, r.rate,
+                    (long long)r.ok, (long long)r.errors, (long long)r.rejected, r.wall_sec, r.req_per_sec,
+                    r.rows_per_sec, r.mean_ms, r.p50_ms, r.p95_ms, r.p99_ms, r.max_ms);
+    }
+    std::fflush(stdout);
+}
+
+static void random_tokens(std::mt19937& rng, int64_t vocab, std::vector<token_t>& ids) {
+    std::uniform_int_distribution<token_t> dist(5, (token_t)std::max<int64_t>(6, vocab) - 1);
+    for (auto& t : ids) t = dist(rng);
+}
+
+/* ===================== In-process ===================== */
+
+static std::vector<BenchRow> bench_infer(const Args& a) {
+    const std::string model = a.str("model", "");
+    if (model.empty()) throw std::runtime_error("infer: --model is required");
+    const std::string ep = a.str("ep", "cpu");
+    const auto batches = parse_int_list(a.str("batch", "1,8,32"));
+    const auto seqs = parse_int_list(a.str("seq", "64,128,256"));
+    const int64_t iters = std::max<long long>(1, a.num("iters", 50));
+    const int64_t warmup = std::max<long long>(0, a.num("warmup", 5));
+    const int intra = (int)a.num("intra", 1);
+    const int inter = (int)a.num("inter", 1);
+    const int64_t vocab = a.num("vocab", 1000);
+    std::mt19937 rng((uint32_t)a.num("seed", 1));
+
+    Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "rerank-bench");
+    auto pool = load_session_pool(env, model, 1, [&](int) { return make_session_options(intra, inter, ep); });
+    PooledSession& ps = *pool[0];
+    if (ep_uses_cuda(ep)) ps.scratch.cuda_device = 0; // pinned I/O, as the server stages it
+    const auto input_names = get_input_names(*ps.session);
+    const auto output_names = get_output_names(*ps.session);
+    ModelBinding mb;
+    bind_model(*ps.session, input_names, output_names, mb);
+    std::cerr << "✅ Loaded " << model << " (ep=" << ep << ", intra=" << intra << ", inter=" << inter
+              << ", input_ids=" << dtype_name(mb.in_input_ids_type) << ")\n";
+
+    Ort::RunOptions ro;
+    std::vector<BenchRow> rows;
+    for (int64_t B : batches) {
+        for (int64_t S : seqs) {
+            std::vector<token_t> ids((size_t)(B * S)), mask((size_t)(B * S), 1);
+            random_tokens(rng, vocab, ids);
+            const TokenBatch tb{B, S, ids.data(), mask.data(), nullptr};
+            for (int64_t i = 0; i < warmup; i++) run_pooled(ps, mb, tb, ro);
+
+            std::vector<double> ms;
+            ms.reserve((size_t)iters);
+            const auto t0 = Clock::now();
+            for (int64_t i = 0; i < iters; i++) ms.push_back((double)run_pooled(ps, mb, tb, ro).run_us / 1000.0);
+            BenchRow r;
+            r.mode = "infer";
+            r.B = B;
+            r.S = S;
+            r.ok = iters;
+            r.wall_sec = std::chrono::duration<double>(Clock::now() - t0).count();
+            r.req_per_sec = (double)iters / r.wall_sec;
+            r.rows_per_sec = (double)(iters * B) / r.wall_sec;
+            summarize(ms, r);
+            std::cerr << "  B=" << B << " S=" << S << " p50=" << r.p50_ms << "ms p99=" << r.p99_ms << "ms\n";
+            rows.push_back(r);
+        }
+    }
+    return rows;
+}
+
+/* ===================== HTTP load ===================== */
+
+// {"input_ids": [[...]], "attention_mask": [[1...]]}, written directly: it is
+// rebuilt for every request and should not cost more than the server side.
+static void build_json_body(const std::vector<token_t>& ids, int64_t B, int64_t S, std::string& out) {
+    out.clear();
+    out += "{\"input_ids\":[";
+    for (int64_t i = 0; i < B; i++) {
+        out += i ? ",[" : "[";
+        for (int64_t t = 0; t < S; t++) {
+            if (t) out += ',';
+            out += std::to_string(ids[(size_t)(i * S + t)]);
+        }
+        out += ']';
+    }
+    out += "],\"attention_mask\":[";
+    std::string row = "[";
+    for (int64_t t = 0; t < S; t++) row += t ? ",1" : "1";
+    row += ']';
+    for (int64_t i = 0; i < B; i++) {
+        if (i) out += ',';
+        out += row;
+    }
+    out += "]}";
+}
+
+// application/x-rerank-tensor: "RRT1", dtype=int32, no mask plane (all ones), B, S, ids.
+static void build_tensor_body(const std::vector<token_t>& ids, int64_t B, int64_t S, std::string& out) {
+    out.assign(16, '\0');
+    std::memcpy(&out[0], "RRT1", 4);
+    out[4] = 1;
+    const uint32_t b32 = (uint32_t)B, s32 = (uint32_t)S;
+    std::memcpy(&out[8], &b32, 4);
+    std::memcpy(&out[12], &s32, 4);
+    out.append(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(token_t));
+}
+
+static std::vector<BenchRow> bench_http(const Args& a) {
+    const std::string url = a.str("url", "http://127.0.0.1:8089/v1/rerank");
+    const size_t scheme_end = url.find("://");
+    const size_t path_pos = url.find('/', scheme_end == std::string::npos ? 0 : scheme_end + 3);
+    const std::string origin = path_pos == std::string::npos ? url : url.substr(0, path_pos);
+    const std::string path = path_pos == std::string::npos ? "/v1/rerank" : url.substr(path_pos);
+
+    const int64_t B = std::max<long long>(1, a.num("batch", 8));
+    const int64_t S = std::max<long long>(1, a.num("seq", 128));
+    const int concurrency = (int)std::max<long long>(1, a.num("concurrency", 8));
+    const double duration = std::max(0.1, a.real("duration", 10));
+    const double rate = std::max(0.0, a.real("rate", 0));
+    const bool tensor = a.str("body", "json") == "tensor";
+    const int64_t vocab = a.num("vocab", 1000);
+    const uint32_t seed = (uint32_t)a.num("seed", 1);
+    const char* content_type = tensor ? "application/x-rerank-tensor" : "application/json";
+
+    std::cerr << "🚀 " << (rate > 0 ? "open" : "closed") << " loop against " << origin << path << ": B=" << B
+              << " S=" << S << " concurrency=" << concurrency;
+    if (rate > 0) std::cerr << " rate=" << rate << "/s";
+    std::cerr << " for " << duration << "s\n";
+
+    struct WorkerStats {
+        std::vector<double> ms;
+        int64_t errors = 0;
+        int64_t rejected = 0;
+        Clock::time_point last_done;
+    };
+    std::vector<WorkerStats> stats((size_t)concurrency);
+    std::atomic<int64_t> ticket{0};
+    const auto start = Clock::now();
+    const auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(duration));
+    const double interval_us = rate > 0 ? 1e6 / rate : 0;
+
+    std::vector<std::thread> ts;
+    for (int w = 0; w < concurrency; w++) {
+        ts.emplace_back([&, w] {
+            WorkerStats& st = stats[(size_t)w];
+            st.last_done = start;
+            httplib::Client cli(origin);
+            cli.set_keep_alive(true);
+            cli.set_read_timeout(60, 0);
+            std::mt19937 rng(seed * 7919u + (uint32_t)w);
+            std::vector<token_t> ids((size_t)(B * S));
+            std::string body;
+            for (;;) {
+                Clock::time_point sched;
+                if (rate > 0) {
+                    const int64_t k = ticket.fetch_add(1, std::memory_order_relaxed);
+                    sched = start + std::chrono::microseconds((int64_t)((double)k * interval_us));
+                    if (sched >= end) break;
+                    std::this_thread::sleep_until(sched);
+                } else {
+                    sched = Clock::now();
+                    if (sched >= end) break;
+                }
+                random_tokens(rng, vocab, ids);
+                if (tensor) build_tensor_body(ids, B, S, body);
+                else build_json_body(ids, B, S, body);
+
+                auto res = cli.Post(path, body, content_type);
+                const auto done = Clock::now();
+                st.last_done = done;
+                if (res && res->status / 100 == 2) {
+                    st.ms.push_back(std::chrono::duration<double, std::milli>(done - sched).count());
+                } else if (res && res->status == 429) {
+                    st.rejected++;
+                } else {
+                    st.errors++;
+                }
+            }
+        });
+    }
+    for (auto& t : ts) t.join();
+
+    BenchRow r;
+    r.mode = "http";
+    r.B = B;
+    r.S = S;
+    r.concurrency = concurrency;
+    r.rate = rate;
+    std::vector<double> ms;
+    Clock::time_point last = start;
+    for (auto& st : stats) {
+        ms.insert(ms.end(), st.ms.begin(), st.ms.end());
+        r.errors += st.errors;
+        r.rejected += st.rejected;
+        last = std::max(last, st.last_done);
+    }
+    r.ok = (int64_t)ms.size();
+    r.wall_sec = std::max(1e-9, std::chrono::duration<double>(last - start).count());
+    r.req_per_sec = (double)r.ok / r.wall_sec;
+    r.rows_per_sec = (double)(r.ok * B) / r.wall_sec;
+    summarize(ms, r);
+    return {r};
+}
+
+int main(int argc, char** argv) {
+    try {
+        const Args a = parse_args(argc, argv);
+        std::vector<BenchRow> rows;
+        if (a.mode == "infer") rows = bench_infer(a);
+        else if (a.mode == "http") rows = bench_http(a);
+        else if (a.mode == "-h" || a.mode == "--help") { print_usage(argv[0]); return 0; }
+        else throw std::runtime_error("unknown mode: " + a.mode + " (expected infer|http)");
+        print_rows(rows, a.str("format", "csv"));
+        return 0;
+    } catch (const Ort::Exception& e) {
+        std::cerr << "❌ ORT error: " << e.what() << "\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << "❌ " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 2;
+    }
+}
@@ -6,24 +6,73 @@
 //   {"input_ids": [[...]], "attention_mask": [[...]], "token_type_ids": [[...]] (optional), "shape": [B,S] (optional)}
 //   -> {"scores": [float...]}  (one score per row in batch)
 //
+//   Content-Type: application/x-rerank-tensor sends raw int32/int64 planes instead
+//   (see parse_tensor_request); Accept: application/octet-stream returns float32[B].
+//   {"query_ids": [...], "doc_ids": [[...]]} builds row i as query_ids ++ doc_ids[i].
+//   Optional "top_k" / "min_score" (body or query string) return only
+//   {"results": [{"index": i, "score": s}, ...]}, best first.
+//
+//   POST /v1/rerank_text
+//   {"query": "...", "documents": ["..."], "top_k": N, "max_length": N}
+//   -> {"scores": [...], "ranked_indices": [...], "ranked_documents": [...], "meta": {...}}
+//   (tokenized in-process with tokenizer.hpp)
+//
+//   POST /v1/rerank_stream
+//   same body as /v1/rerank_text (plus "chunk"), up to RERANK_STREAM_MAX_DOCS documents
+//   -> NDJSON: {"offset": i, "scores": [...]} per sub-batch, then {"done": true, ...}
+//
+//   Framed transport: RERANK_FRAME_SOCKET serves the tensor body as length-prefixed
+//   frames on a persistent Unix socket, or reads it in place from a client memfd
+//   region (see FrameServer).
+//
+//   ?model=<name> on either endpoint picks a model from the registry;
+//   /admin/models{,/load,/unload} manage it at runtime.
+//
 // Notes:
-// - Designed to be called by tools/rerank-proxy (text -> tokens -> this service).
+// - /v1/rerank is called by tools/rerank-proxy (text -> tokens -> this service);
+//   /v1/rerank_text replaces that hop when a tokenizer.json is available.
+// - Session setup and run_scores live in rerank_core.{hpp,cpp}, shared with rerank_bench.
 // - ORT 1.23.x compatible APIs.
 
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <exception>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <cctype>
+#include <charconv>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include <httplib.h>
 #include <nlohmann/json.hpp>
@@ -31,21 +80,8 @@
 #include <onnxruntime_cxx_api.h>
 #include <onnxruntime_c_api.h> // GetAvailableProviders
 
-// ---- Optional CoreML EP header (macOS) ----
-#if defined(__APPLE__)
-  #if defined(__has_include)
-    #if __has_include(<coreml_provider_factory.h>)
-      #include <coreml_provider_factory.h>
-      #define RERANK_HAS_COREML_EP 1
-    #else
-      #define RERANK_HAS_COREML_EP 0
-    #endif
-  #else
-    #define RERANK_HAS_COREML_EP 0
-  #endif
-#else
-  #define RERANK_HAS_COREML_EP 0
-#endif
+#include "rerank_core.hpp"
+#include "tokenizer.hpp"
 
 using json = nlohmann::json;
 using Clock = std::chrono::steady_clock;
@@ -72,117 +108,190 @@ static bool getenv_bool_or(const char* key, bool defv) {
     return defv;
 }
 
+// "a, b,c" -> {"a","b","c"}
+static std::vector<std::string> parse_name_list(const std::string& s) {
+    std::vector<std::string> out;
+    size_t i = 0;
+    while (i < s.size()) {
+        size_t j = s.find(',', i);
+        if (j == std::string::npos) j = s.size();
+        std::string item = s.substr(i, j - i);
+        item.erase(0, item.find_first_not_of(' '));
+        item.erase(item.find_last_not_of(' ') + 1);
+        if (!item.empty()) out.push_back(std::move(item));
+        i = j + 1;
+    }
+    return out;
+}
+
 static std::string join_lines(const std::vector<std::string>& xs) {
     std::string out;
     for (auto& s : xs) out += " - " + s + "\n";
     return out;
 }
 
-static std::vector<std::string> get_input_names(Ort::Session& session) {
-    Ort::AllocatorWithDefaultOptions alloc;
-    size_t n = session.GetInputCount();
-    std::vector<std::string> out;
-    out.reserve(n);
-    for (size_t i = 0; i < n; i++) {
-        Ort::AllocatedStringPtr name = session.GetInputNameAllocated(i, alloc);
-        out.emplace_back(name.get() ? name.get() : "");
+// Lock-free log2 histogram: bucket b counts values in [2^(b-1), 2^b - 1]
+// (bucket 0 counts zeros). Values past the last bucket land in it.
+struct LogHistogram {
+    static constexpr int kBuckets = 32;
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+
+    static int bucket_of(uint64_t v) {
+        int b = (v == 0) ? 0 : 64 - __builtin_clzll(v);
+        return b < kBuckets ? b : kBuckets - 1;
     }
-    return out;
-}
-static std::vector<std::string> get_output_names(Ort::Session& session) {
-    Ort::AllocatorWithDefaultOptions alloc;
-    size_t n = session.GetOutputCount();
-    std::vector<std::string> out;
-    out.reserve(n);
-    for (size_t i = 0; i < n; i++) {
-        Ort::AllocatedStringPtr name = session.GetOutputNameAllocated(i, alloc);
-        out.emplace_back(name.get() ? name.get() : "");
+    static uint64_t upper_bound(int b) { return (b >= 63) ? UINT64_MAX : (1ULL << b) - 1; }
+
+    void observe(uint64_t v) {
+        buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+    }
+    void observe_since(Clock::time_point t0) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count();
+        observe(us > 0 ? (uint64_t)us : 0);
     }
-    return out;
-}
-static const char* find_name(const std::vector<std::string>& names, const std::string& want) {
-    for (auto& n : names) if (n == want) return n.c_str();
-    return nullptr;
-}
 
-static void require_2d_array(const json& j, const char* key) {
-    if (!j.contains(key) || !j[key].is_array() || j[key].empty() || !j[key][0].is_array()) {
-        throw std::runtime_error(std::string("missing/invalid '") + key + "': expected 2D array");
+    // Upper bound of the bucket holding quantile q (0..1); 0 when empty.
+    uint64_t quantile(double q) const {
+        uint64_t snap[kBuckets];
+        uint64_t total = 0;
+        for (int b = 0; b < kBuckets; b++) total += (snap[b] = buckets[b].load(std::memory_order_relaxed));
+        if (total == 0) return 0;
+        const uint64_t rank = (uint64_t)std::ceil(q * (double)total);
+        uint64_t acc = 0;
+        for (int b = 0; b < kBuckets; b++) {
+            acc += snap[b];
+            if (acc >= rank) return upper_bound(b);
+        }
+        return upper_bound(kBuckets - 1);
     }
-}
+};
 
-static void infer_BS_from_input_ids(const json& j, int64_t& B, int64_t& S) {
-    require_2d_array(j, "input_ids");
-    B = (int64_t)j["input_ids"].size();
-    if (B <= 0) throw std::runtime_error("input_ids: empty batch");
-    if (!j["input_ids"][0].is_array()) throw std::runtime_error("input_ids: invalid row");
-    S = (int64_t)j["input_ids"][0].size();
-    if (S <= 0) throw std::runtime_error("input_ids: empty sequence");
-}
+// Opt-in span recorder (RERANK_TRACE, POST /admin/trace), exported as Chrome
+// trace JSON. A writer claims a slot with one fetch_add and publishes it with
+// the slot's sequence number, so recording never blocks or allocates; a reader
+// drops slots rewritten while it copied them. Only the newest spans are kept.
+class TraceRing {
+public:
+    struct Span {
+        const char* name = nullptr; // string literal
+        uint32_t tid = 0;
+        uint32_t id = 0;   // request trace id; 0: a batch run, not one request
+        int64_t ts_us = 0; // since the ring was created
+        int64_t dur_us = 0;
+        int64_t B = 0;
+        int64_t S = 0;
+    };
 
-static void validate_BS_exact(const json& j, const char* key, int64_t B, int64_t S) {
-    require_2d_array(j, key);
-    if ((int64_t)j[key].size() != B) {
-        throw std::runtime_error(std::string("'") + key + "': batch mismatch");
-    }
-    for (int64_t i = 0; i < B; i++) {
-        if (!j[key][i].is_array() || (int64_t)j[key][i].size() != S) {
-            throw std::runtime_error(std::string("'") + key + "': seq mismatch");
-        }
+    ~TraceRing() { delete[] slots_.load(); }
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+    size_t capacity() const { return cap_; }
+    uint32_t sample() const { return sample_.load(std::memory_order_relaxed); }
+
+    // The first enable sizes the ring; it is never resized or freed while up.
+    void enable(bool on, size_t capacity, uint32_t sample) {
+        std::call_once(alloc_once_, [&] {
+            cap_ = std::max<size_t>(1024, capacity);
+            slots_.store(new Slot[cap_], std::memory_order_release);
+        });
+        sample_.store(std::max<uint32_t>(1, sample), std::memory_order_relaxed);
+        enabled_.store(on, std::memory_order_relaxed);
     }
-}
 
-static void validate_attention_mask_bits(const json& j, int64_t B, int64_t S) {
-    if (!j.contains("attention_mask")) return;
-    for (int64_t i = 0; i < B; i++) {
-        for (int64_t k = 0; k < S; k++) {
-            auto v = j["attention_mask"][i][k];
-            if (!v.is_number_integer()) throw std::runtime_error("attention_mask: must be int");
-            int64_t x = v.get<int64_t>();
-            if (!(x == 0 || x == 1)) throw std::runtime_error("attention_mask: only 0/1 allowed");
-        }
+    // Trace id for a new request: 0 when tracing is off or the request is not sampled.
+    uint32_t request_id() {
+        if (!enabled()) return 0;
+        const uint32_t n = next_id_.fetch_add(1, std::memory_order_relaxed);
+        return n % sample() == 0 ? n / sample() + 1 : 0;
     }
-}
 
-// Convert float16 (IEEE 754) -> float32
-static float fp16_to_fp32(uint16_t h) {
-    uint16_t h_exp = (h & 0x7C00u);
-    uint16_t h_sig = (h & 0x03FFu);
-    uint32_t f_sgn = ((uint32_t)h & 0x8000u) << 16;
+    void record(const char* name, uint32_t id, Clock::time_point start, Clock::time_point end,
+                int64_t B = 0, int64_t S = 0) {
+        Slot* slots = slots_.load(std::memory_order_acquire);
+        if (!enabled() || !slots) return;
+        const uint64_t seq = head_.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[seq % cap_];
+        slot.seq.store(0, std::memory_order_relaxed); // being written
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.span.name = name;
+        slot.span.tid = thread_id();
+        slot.span.id = id;
+        slot.span.ts_us = std::chrono::duration_cast<std::chrono::microseconds>(start - epoch_).count();
+        slot.span.dur_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        slot.span.B = B;
+        slot.span.S = S;
+        slot.seq.store(seq + 1, std::memory_order_release);
+    }
 
-    if (h_exp == 0x7C00u) { // Inf/NaN
-        uint32_t f_exp = 0x7F800000u;
-        uint32_t f_sig = (uint32_t)h_sig << 13;
-        uint32_t bits = f_sgn | f_exp | f_sig;
-        float out;
-        std::memcpy(&out, &bits, sizeof(out));
+    std::vector<Span> snapshot() const {
+        std::vector<Span> out;
+        Slot* slots = slots_.load(std::memory_order_acquire);
+        if (!slots) return out;
+        out.reserve(cap_);
+        for (size_t i = 0; i < cap_; i++) {
+            const uint64_t before = slots[i].seq.load(std::memory_order_acquire);
+            if (before == 0) continue;
+            Span copy = slots[i].span;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slots[i].seq.load(std::memory_order_relaxed) == before) out.push_back(copy);
+        }
+        std::sort(out.begin(), out.end(), [](const Span& a, const Span& b) { return a.ts_us < b.ts_us; });
         return out;
     }
+    uint64_t recorded() const { return head_.load(std::memory_order_relaxed); }
 
-    if (h_exp == 0) { // Subnormal/zero
-        if (h_sig == 0) {
-            uint32_t f = f_sgn;
-            float out;
-            std::memcpy(&out, &f, sizeof(out));
-            return out;
-        }
-        int shift = 0;
-        while ((h_sig & 0x0400u) == 0) { h_sig <<= 1; shift++; }
-        h_sig &= 0x03FFu;
-        uint32_t f_exp = (uint32_t)(127 - 15 - shift) << 23;
-        uint32_t f_sig2 = (uint32_t)h_sig << 13;
-        uint32_t f = f_sgn | f_exp | f_sig2;
-        float out;
-        std::memcpy(&out, &f, sizeof(out));
-        return out;
+    // Small per-thread ids for the trace's tid; name_thread labels the current one.
+    static uint32_t thread_id() {
+        static std::atomic<uint32_t> next{1};
+        thread_local const uint32_t id = next.fetch_add(1, std::memory_order_relaxed);
+        return id;
+    }
+    void name_thread(const std::string& name) {
+        std::lock_guard<std::mutex> lk(names_mu_);
+        names_[thread_id()] = name;
+    }
+    std::map<uint32_t, std::string> thread_names() const {
+        std::lock_guard<std::mutex> lk(names_mu_);
+        return names_;
     }
 
-    uint32_t f_exp = (uint32_t)(((h_exp >> 10) + (127 - 15)) & 0xFF) << 23;
-    uint32_t f_sig2 = (uint32_t)h_sig << 13;
-    uint32_t f = f_sgn | f_exp | f_sig2;
-    float out;
-    std::memcpy(&out, &f, sizeof(out));
-    return out;
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0}; // 0: empty or being written; else claim number + 1
+        Span span;
+    };
+
+    const Clock::time_point epoch_ = Clock::now();
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint32_t> sample_{1};
+    std::atomic<uint32_t> next_id_{0};
+    std::atomic<uint64_t> head_{0};
+    std::once_flag alloc_once_;
+    size_t cap_ = 0;
+    std::atomic<Slot*> slots_{nullptr};
+    mutable std::mutex names_mu_;
+    std::map<uint32_t, std::string> names_;
+};
+
+// Handler-side spans of one traced request: its decode stages laid end to end
+// from t0, serialization, and the whole request. Queue/build/run come from the batcher.
+static void trace_request(TraceRing& tr, uint32_t id, const char* name, Clock::time_point t0,
+                          std::initializer_list<std::pair<const char*, int64_t>> stages_us,
+                          Clock::time_point t_ser, int64_t B, int64_t S) {
+    if (!id) return;
+    Clock::time_point t = t0;
+    for (auto& st : stages_us) {
+        const auto end = t + std::chrono::microseconds(st.second);
+        tr.record(st.first, id, t, end, B, S);
+        t = end;
+    }
+    const auto now = Clock::now();
+    tr.record("serialize", id, t_ser, now, B, S);
+    tr.record(name, id, t0, now, B, S);
 }
 
 struct Metrics {
@@ -190,399 +299,3836 @@ struct Metrics {
     std::atomic<uint64_t> req_ok{0};
     std::atomic<uint64_t> req_4xx{0};
     std::atomic<uint64_t> req_5xx{0};
+    std::atomic<uint64_t> req_tensor{0};
+    std::atomic<uint64_t> req_text{0};
+    std::atomic<uint64_t> req_embed{0}; // /v1/embed, /v1/embed_text and frame op 4
+    std::atomic<uint64_t> req_stream{0};
+    std::atomic<uint64_t> req_frame{0}; // scoring requests over RERANK_FRAME_SOCKET
+    std::atomic<uint64_t> req_shm{0};   // ... of which read from a shared region (op 3)
+    std::atomic<uint64_t> stream_chunks{0}; // NDJSON lines with scores sent by /v1/rerank_stream
     std::atomic<uint64_t> ort_fail{0};
     std::atomic<uint64_t> slow_req{0};
     std::atomic<uint64_t> bytes_in{0};
     std::atomic<uint64_t> bytes_out{0};
-};
+    std::atomic<uint64_t> batch_runs{0};
+    std::atomic<uint64_t> batch_jobs{0};
+    std::atomic<uint64_t> batch_rows{0};
+    std::atomic<uint64_t> batch_tokens{0}; // B*S actually run, after bucketing/trimming
+    std::atomic<uint64_t> input_tokens{0}; // B*S as received
+    std::atomic<uint64_t> rejected_overload{0}; // 429s from admission control
+    std::atomic<uint64_t> req_deadline{0};      // 504s: deadline passed before scores were ready
+    std::atomic<uint64_t> req_client_gone{0};   // client disconnected while waiting
+    std::atomic<uint64_t> pieces_expired{0};    // queued work dropped at its deadline
+    std::atomic<uint64_t> pieces_cancelled{0};  // queued work dropped by a cancel
+    std::atomic<uint64_t> runs_terminated{0};   // session runs stopped via RunOptions::SetTerminate
+    std::atomic<uint64_t> rejected_memory{0};   // requests with a row over RERANK_MEM_RUN_MB
+    std::atomic<uint64_t> mem_splits{0};        // pieces closed early to stay under RERANK_MEM_RUN_MB
+    std::atomic<uint64_t> arena_shrink_runs{0}; // runs over RERANK_ARENA_SHRINK_MB that shrank the arena
+    std::atomic<int64_t> inflight{0};           // scoring requests inside a handler (gauge)
+    std::atomic<uint64_t> model_loads{0};
+    std::atomic<uint64_t> model_load_fail{0};
 
-/* ===================== CLI / EP helpers ===================== */
-
-static void print_usage(const char* argv0) {
-    std::cerr
-        << "Usage:\n"
-        << "  " << argv0 << " [--ep cpu|coreml] [--model /path/to/model.onnx] [--list-ep]\n\n"
-        << "Env overrides:\n"
-        << "  RERANK_ONNX_PATH, RERANK_HTTP_HOST, RERANK_HTTP_PORT, RERANK_MAX_BATCH, RERANK_MAX_SEQ, ...\n\n"
-        << "Examples:\n"
-        << "  " << argv0 << " --model ./model.onnx\n"
-        << "  " << argv0 << " --ep coreml --model ./model.onnx\n"
-        << "  " << argv0 << " --list-ep\n";
-}
+    // Per-stage latency (microseconds) and per-run shape.
+    LogHistogram parse_us;      // body -> JSON DOM / tensor header
+    LogHistogram tokenize_us;   // /v1/rerank_text: text -> padded token rows
+    LogHistogram validate_us;   // shape/mask checks + copy into flat buffers
+    LogHistogram queue_wait_us; // piece enqueued -> picked up by a session worker
+    LogHistogram queue_wait_interactive_us; // ... per priority class
+    LogHistogram queue_wait_batch_us;
+    LogHistogram build_us;      // bucket packing + tensor creation
+    LogHistogram run_us;        // session.Run
+    LogHistogram serialize_us;  // response body
+    LogHistogram total_us;      // whole /v1/rerank handler
+    LogHistogram run_batch;     // B per session.Run
+    LogHistogram run_seq;       // S per session.Run
 
-static std::string to_lower(std::string s) {
-    for (auto& c : s) c = (char)std::tolower((unsigned char)c);
-    return s;
-}
+    TraceRing trace;
 
-static void print_available_eps() {
-    const OrtApi* api = OrtGetApiBase()->GetApi(ORT_API_VERSION);
+    // 4xx/5xx totals for a failed request; 499 (client gone) counts as neither.
+    void count_failure(int status) {
+        if (status >= 500) req_5xx.fetch_add(1, std::memory_order_relaxed);
+        else if (status != 499) req_4xx.fetch_add(1, std::memory_order_relaxed);
+    }
 
-    char** providers = nullptr;
-    int num = 0;
+    std::vector<std::pair<const char*, uint64_t>> counters() const {
+        return {
+            {"req_total", req_total.load()},
+            {"req_ok", req_ok.load()},
+            {"req_4xx", req_4xx.load()},
+            {"req_5xx", req_5xx.load()},
+            {"req_tensor", req_tensor.load()},
+            {"req_text", req_text.load()},
+            {"req_embed", req_embed.load()},
+            {"req_stream", req_stream.load()},
+            {"req_frame", req_frame.load()},
+            {"req_shm", req_shm.load()},
+            {"stream_chunks", stream_chunks.load()},
+            {"ort_fail", ort_fail.load()},
+            {"slow_req", slow_req.load()},
+            {"bytes_in", bytes_in.load()},
+            {"bytes_out", bytes_out.load()},
+            {"batch_runs", batch_runs.load()},
+            {"batch_jobs", batch_jobs.load()},
+            {"batch_rows", batch_rows.load()},
+            {"batch_tokens", batch_tokens.load()},
+            {"input_tokens", input_tokens.load()},
+            {"rejected_overload", rejected_overload.load()},
+            {"req_deadline", req_deadline.load()},
+            {"req_client_gone", req_client_gone.load()},
+            {"pieces_expired", pieces_expired.load()},
+            {"pieces_cancelled", pieces_cancelled.load()},
+            {"runs_terminated", runs_terminated.load()},
+            {"rejected_memory", rejected_memory.load()},
+            {"mem_splits", mem_splits.load()},
+            {"arena_shrink_runs", arena_shrink_runs.load()},
+            {"model_loads", model_loads.load()},
+            {"model_load_fail", model_load_fail.load()},
+        };
+    }
 
-    OrtStatus* st = api->GetAvailableProviders(&providers, &num);
-    if (st != nullptr) {
-        const char* msg = api->GetErrorMessage(st);
-        std::cerr << "❌ GetAvailableProviders failed: " << (msg ? msg : "(unknown)") << "\n";
-        api->ReleaseStatus(st);
-        return;
+    struct HistRef { const char* name; const LogHistogram* h; bool seconds; };
+    std::vector<HistRef> histograms() const {
+        return {
+            {"parse", &parse_us, true},
+            {"tokenize", &tokenize_us, true},
+            {"validate", &validate_us, true},
+            {"queue_wait", &queue_wait_us, true},
+            {"queue_wait_interactive", &queue_wait_interactive_us, true},
+            {"queue_wait_batch", &queue_wait_batch_us, true},
+            {"build", &build_us, true},
+            {"run", &run_us, true},
+            {"serialize", &serialize_us, true},
+            {"total", &total_us, true},
+            {"run_batch_size", &run_batch, false},
+            {"run_seq_len", &run_seq, false},
+        };
     }
+};
 
-    std::cerr << "Available Execution Providers:\n";
-    for (int i = 0; i < num; i++) {
-        std::cerr << " - " << (providers[i] ? providers[i] : "") << "\n";
+// Prometheus text exposition (0.0.4). Durations are exported in seconds.
+static void append_prometheus_histogram(std::string& out, const std::string& name, const LogHistogram& h, bool seconds) {
+    const double scale = seconds ? 1e-6 : 1.0;
+    out += "# TYPE " + name + " histogram\n";
+    uint64_t acc = 0;
+    char buf[64];
+    for (int b = 0; b < LogHistogram::kBuckets - 1; b++) {
+        acc += h.buckets[b].load(std::memory_order_relaxed);
+        std::snprintf(buf, sizeof(buf), "%.9g", (double)LogHistogram::upper_bound(b) * scale);
+        out += name + "_bucket{le=\"" + buf + "\"} " + std::to_string(acc) + "\n";
     }
+    acc += h.buckets[LogHistogram::kBuckets - 1].load(std::memory_order_relaxed);
+    out += name + "_bucket{le=\"+Inf\"} " + std::to_string(acc) + "\n";
+    std::snprintf(buf, sizeof(buf), "%.9g", (double)h.sum.load(std::memory_order_relaxed) * scale);
+    out += name + "_sum " + buf + "\n";
+    out += name + "_count " + std::to_string(acc) + "\n";
+}
 
-    OrtStatus* st2 = api->ReleaseAvailableProviders(providers, num);
-    if (st2 != nullptr) {
-        api->ReleaseStatus(st2);
+static void append_prometheus_value(std::string& out, const std::string& name, const char* type, uint64_t v) {
+    out += "# TYPE " + name + " " + type + "\n" + name + " " + std::to_string(v) + "\n";
+}
+
+// Resident set size now and at its peak (VmRSS / VmHWM); false where /proc is missing.
+static bool process_memory(int64_t& rss, int64_t& peak) {
+    std::ifstream f("/proc/self/status");
+    if (!f.good()) return false;
+    rss = peak = -1;
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) rss = std::atoll(line.c_str() + 6) << 10;
+        else if (line.compare(0, 6, "VmHWM:") == 0) peak = std::atoll(line.c_str() + 6) << 10;
     }
+    return rss >= 0;
 }
 
-struct CliOpts {
-    std::string ep = "cpu";   // cpu|coreml
-    std::string model;        // model path override
-    bool list_ep = false;
-    bool help = false;
-};
+/* ===================== Response writing ===================== */
 
-static CliOpts parse_cli(int argc, char** argv) {
-    CliOpts o;
-    for (int i = 1; i < argc; i++) {
-        const char* a = argv[i];
-        if (std::strcmp(a, "-h") == 0 || std::strcmp(a, "--help") == 0) {
-            o.help = true;
-            continue;
-        }
-        if (std::strcmp(a, "--list-ep") == 0) {
-            o.list_ep = true;
-            continue;
-        }
-        if (std::strcmp(a, "--ep") == 0) {
-            if (i + 1 >= argc) throw std::runtime_error("--ep requires a value: cpu|coreml");
-            o.ep = to_lower(argv[++i]);
-            continue;
-        }
-        if (std::strcmp(a, "--model") == 0) {
-            if (i + 1 >= argc) throw std::runtime_error("--model requires a value: /path/to/model.onnx");
-            o.model = std::string(argv[++i]);
-            continue;
-        }
-        o.help = true;
+// Hot responses are written straight into their body string instead of going
+// through a json DOM and dump(). Floats use the shortest representation that
+// round-trips (std::to_chars); non-finite values become null, as dump() does.
+static void append_float(std::string& out, float v) {
+    if (!std::isfinite(v)) {
+        out += "null";
+        return;
     }
-    return o;
+    char buf[32];
+#if defined(__cpp_lib_to_chars)
+    out.append(buf, std::to_chars(buf, buf + sizeof(buf), v).ptr);
+#else
+    out.append(buf, (size_t)std::snprintf(buf, sizeof(buf), "%.9g", (double)v)); // float-exact, not shortest
+#endif
 }
 
-static void append_coreml_ep_or_throw(Ort::SessionOptions& so) {
-#if RERANK_HAS_COREML_EP
-    uint32_t flags = 0;
-    #ifdef ORT_COREML_FLAG_ENABLE_ON_SUBGRAPHS
-        flags |= ORT_COREML_FLAG_ENABLE_ON_SUBGRAPHS;
-    #endif
-    Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_CoreML(so, flags));
+static void append_double(std::string& out, double v) {
+    if (!std::isfinite(v)) {
+        out += "null";
+        return;
+    }
+    char buf[32];
+#if defined(__cpp_lib_to_chars)
+    out.append(buf, std::to_chars(buf, buf + sizeof(buf), v).ptr);
 #else
-    (void)so;
-    throw std::runtime_error(
-        "CoreML EP headers not found (onnxruntime/coreml_provider_factory.h).\n"
-        "Fix options:\n"
-        "  1) Install/Build ONNX Runtime with CoreML enabled (macOS), and ensure headers are in include path.\n"
-        "  2) Or run with --ep cpu.\n"
-    );
+    out.append(buf, (size_t)std::snprintf(buf, sizeof(buf), "%.17g", v));
 #endif
 }
 
-static void require_file_exists(const std::string& p) {
-    std::ifstream f(p);
-    if (!f.good()) {
-        throw std::runtime_error("model file not found or not readable: " + p);
+// Input must be valid UTF-8 (every string we echo came through json::parse).
+static void append_json_string(std::string& out, const std::string& s) {
+    static const char* hex = "0123456789abcdef";
+    out += '"';
+    size_t run = 0; // start of the pending unescaped run
+    for (size_t i = 0; i < s.size(); i++) {
+        const unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out.append(s, run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+        }
     }
+    out.append(s, run, std::string::npos);
+    out += '"';
 }
 
-int main(int argc, char** argv) {
-    CliOpts cli;
-    try {
-        cli = parse_cli(argc, argv);
-    } catch (const std::exception& e) {
-        std::cerr << "❌ " << e.what() << "\n";
-        print_usage(argv[0]);
-        return 2;
+// Minimal streaming writer; commas are tracked per nesting level. Keys are
+// string literals and are not escaped.
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out) : out_(out) {}
+
+    JsonWriter& begin_object() { sep(); out_ += '{'; push(); return *this; }
+    JsonWriter& end_object() { out_ += '}'; depth_--; return *this; }
+    JsonWriter& begin_array() { sep(); out_ += '['; push(); return *this; }
+    JsonWriter& end_array() { out_ += ']'; depth_--; return *this; }
+    JsonWriter& key(const std::string& k) { return key(k.c_str()); }
+    JsonWriter& key(const char* k) {
+        sep();
+        out_ += '"';
+        out_ += k;
+        out_ += "\":";
+        after_key_ = true;
+        return *this;
     }
 
-    if (cli.help) {
-        print_usage(argv[0]);
-        return 0;
+    JsonWriter& value(float v) { sep(); append_float(out_, v); return *this; }
+    JsonWriter& value(double v) { sep(); append_double(out_, v); return *this; }
+    JsonWriter& value(const std::string& v) { sep(); append_json_string(out_, v); return *this; }
+    JsonWriter& value(const char* v) { return value(std::string(v)); }
+    template <class T, class = std::enable_if_t<std::is_integral<T>::value>>
+    JsonWriter& value(T v) {
+        sep();
+        if constexpr (std::is_same<T, bool>::value) {
+            out_ += v ? "true" : "false";
+        } else {
+            char buf[24];
+            out_.append(buf, std::to_chars(buf, buf + sizeof(buf), v).ptr);
+        }
+        return *this;
     }
+    // Pre-serialized JSON (a cached fragment or a json::dump()).
+    JsonWriter& raw(const std::string& v) { sep(); out_ += v; return *this; }
 
-    if (cli.list_ep) {
-        print_available_eps();
-        return 0;
+    JsonWriter& floats(const float* v, size_t n) {
+        begin_array();
+        for (size_t i = 0; i < n; i++) {
+            if (i) out_ += ',';
+            append_float(out_, v[i]);
+        }
+        first_[depth_ - 1] = false;
+        return end_array();
+    }
+    template <class It>
+    JsonWriter& values(It begin, It end) {
+        begin_array();
+        for (; begin != end; ++begin) value(*begin);
+        return end_array();
     }
 
-    // Prefer: --model > env RERANK_ONNX_PATH > ./model.onnx
-    const std::string model_path =
-        (!cli.model.empty()) ? cli.model : getenv_or("RERANK_ONNX_PATH", "./model.onnx");
+private:
+    void sep() {
+        if (after_key_) {
+            after_key_ = false;
+        } else if (depth_ > 0) {
+            if (!first_[depth_ - 1]) out_ += ',';
+            first_[depth_ - 1] = false;
+        }
+    }
+    void push() {
+        if (depth_ == kMaxDepth) throw std::logic_error("JsonWriter: nesting too deep");
+        first_[depth_++] = true;
+    }
 
-    const std::string host = getenv_or("RERANK_HTTP_HOST", "127.0.0.1");
-    const int port = getenv_int_or("RERANK_HTTP_PORT", 8089);
+    static constexpr int kMaxDepth = 16;
+    std::string& out_;
+    bool first_[kMaxDepth] = {};
+    int depth_ = 0;
+    bool after_key_ = false;
+};
 
-    const int intra_threads = getenv_int_or("RERANK_INTRA_THREADS", 1);
-    const int inter_threads = getenv_int_or("RERANK_INTER_THREADS", 1);
+static void write_histogram(JsonWriter& w, const LogHistogram& h) {
+    w.begin_object()
+        .key("count").value(h.count.load(std::memory_order_relaxed))
+        .key("sum").value(h.sum.load(std::memory_order_relaxed))
+        .key("p50").value(h.quantile(0.50))
+        .key("p95").value(h.quantile(0.95))
+        .key("p99").value(h.quantile(0.99))
+        .end_object();
+}
 
-    const int64_t max_batch = (int64_t)getenv_ll_or("RERANK_MAX_BATCH", 512);
-    const int64_t max_seq   = (int64_t)getenv_ll_or("RERANK_MAX_SEQ", 8192);
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev): one complete ("X")
+// event per span, plus thread_name metadata so batch workers show by model.
+static void write_chrome_trace(std::string& out, const TraceRing& tr) {
+    const std::vector<TraceRing::Span> spans = tr.snapshot();
+    out.reserve(out.size() + 128 + spans.size() * 120);
+    JsonWriter w(out);
+    w.begin_object().key("displayTimeUnit").value("ms").key("traceEvents").begin_array();
+    for (auto& kv : tr.thread_names()) {
+        w.begin_object()
+            .key("name").value("thread_name").key("ph").value("M").key("pid").value(1).key("tid").value(kv.first)
+            .key("args").begin_object().key("name").value(kv.second).end_object()
+            .end_object();
+    }
+    for (auto& sp : spans) {
+        w.begin_object()
+            .key("name").value(sp.name).key("ph").value("X").key("pid").value(1).key("tid").value(sp.tid)
+            .key("ts").value(sp.ts_us).key("dur").value(sp.dur_us)
+            .key("args").begin_object();
+        if (sp.id) w.key("request").value(sp.id);
+        w.key("B").value(sp.B).key("S").value(sp.S).end_object().end_object();
+    }
+    w.end_array().end_object();
+}
 
-    const int logits_index_default = getenv_int_or("RERANK_LOGITS_INDEX", 0);
-    const int64_t slow_ms = (int64_t)getenv_ll_or("RERANK_SLOW_MS", 300);
+/* ===================== Micro-batching ===================== */
 
-    const bool run_mutex_on = getenv_bool_or("RERANK_RUN_MUTEX", true);
-    const bool allow_fp16_output = getenv_bool_or("RERANK_ALLOW_FP16_OUTPUT", true);
+// Real length of a right-padded row: one past the last mask==1 position.
+static int64_t row_real_length(const token_t* mask, int64_t S) {
+    return last_nonzero_end(mask, S);
+}
 
-    try {
-        require_file_exists(model_path);
+// One request waiting for its rows to be scored. The token buffers belong to
+// the submitting handler and must outlive MicroBatcher::run().
+enum CancelReason : int { kNotCancelled = 0, kCancelDeadline = 1, kCancelClientGone = 2 };
 
-        Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "rerank-http");
-        Ort::SessionOptions so;
-        so.SetIntraOpNumThreads(intra_threads);
-        so.SetInterOpNumThreads(inter_threads);
-        so.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+// Scheduling class: "X-Rerank-Priority: batch" (or body "priority") marks
+// background work such as reindexing, which fills capacity interactive
+// requests leave idle.
+enum Priority : int { kPriorityInteractive = 0, kPriorityBatch = 1 };
+static constexpr int kPriorities = 2;
 
-        if (cli.ep == "coreml") {
-            std::cerr << "⚙️  Execution Provider: CoreML (GPU/ANE)\n";
-            append_coreml_ep_or_throw(so);
-        } else if (cli.ep == "cpu") {
-            std::cerr << "⚙️  Execution Provider: CPU\n";
-        } else {
-            throw std::runtime_error("unknown --ep value: " + cli.ep + " (expected cpu|coreml)");
-        }
+static const char* priority_name(int p) { return p == kPriorityBatch ? "batch" : "interactive"; }
 
-        Ort::Session session(env, model_path.c_str(), so);
+// "" -> interactive; anything but interactive|batch is a client error.
+static Priority parse_priority(const std::string& s) {
+    if (s.empty() || s == "interactive") return kPriorityInteractive;
+    if (s == "batch") return kPriorityBatch;
+    throw std::runtime_error("priority must be \"interactive\" or \"batch\"");
+}
 
-        auto input_names = get_input_names(session);
-        auto output_names = get_output_names(session);
+struct RerankJob {
+    TokenBatch tokens;
+    std::vector<int64_t> row_len; // real length per row, filled by run()
+    ScoreResult result;           // scores in original row order
+    int64_t width = 1;            // floats per row: 1, or the embedding dim
+    std::exception_ptr error;
 
-        std::cerr << "✅ Loaded ONNX model: " << model_path << "\n";
-        std::cerr << "Inputs:\n" << join_lines(input_names);
-        std::cerr << "Outputs:\n" << join_lines(output_names);
+    Clock::time_point deadline = Clock::time_point::max();
+    std::function<bool()> client_gone; // polled while waiting; may be empty
+    Priority priority = kPriorityInteractive;
+    uint32_t trace_id = 0; // see TraceRing::request_id
+    std::atomic<int> cancelled{kNotCancelled};
 
-        const char* in_input_ids = find_name(input_names, "input_ids");
-        const char* in_attention_mask = find_name(input_names, "attention_mask");
-        const char* in_token_type_ids = find_name(input_names, "token_type_ids"); // optional
+    std::mutex mu;
+    std::condition_variable cv;
+    int pending = 0;              // pieces not yet scored
+    bool done = false;
+};
 
-        if (!in_input_ids || !in_attention_mask) {
-            throw std::runtime_error("model must have input_ids and attention_mask");
-        }
+// The rows of one job that fall into one length bucket.
+struct JobPiece {
+    RerankJob* job = nullptr;
+    std::vector<int64_t> rows;
+    int64_t S = 0; // longest real length among rows
+    size_t bucket = 0;
+    Clock::time_point enqueued;
+};
 
-        const char* out_logits = nullptr;
-        for (auto& n : output_names) {
-            if (n == "logits") { out_logits = n.c_str(); break; }
-        }
-        if (!out_logits && !output_names.empty()) out_logits = output_names[0].c_str();
-        if (!out_logits) throw std::runtime_error("model has no outputs");
+// Called on worker thread `worker` (0..workers-1); each worker owns one pooled session.
+using BatchRunFn = std::function<ScoreResult(int worker, const TokenBatch&, const Ort::RunOptions&)>;
 
-        const bool model_has_tti = (in_token_type_ids != nullptr);
+// Admission control failures; handlers answer 429 + Retry-After.
+struct OverloadedError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
 
-        Metrics metrics;
-        std::mutex run_mu;
+// The request's deadline passed before its rows were scored (504).
+struct DeadlineExceeded : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
 
-        httplib::Server app;
+// The client disconnected while its rows were queued or running.
+struct ClientGone : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
 
-        // Basic request logging (off by default)
-        const bool access_log = getenv_bool_or("RERANK_ACCESS_LOG", false);
-        if (access_log) {
-            app.set_logger([](const httplib::Request& req, const httplib::Response& res) {
-                std::cerr << req.method << " " << req.path << " -> " << res.status << "\n";
-            });
-        }
+// What a handler answers for an exception out of parsing or scoring.
+struct RequestError {
+    int status; // 400, 429, 499 (nobody is listening), 500 or 504
+    std::string message;
+};
 
-        app.Get("/health", [&](const httplib::Request&, httplib::Response& res) {
-            json r;
-            r["ok"] = true;
-            r["model_path"] = model_path;
-            r["inputs"] = input_names;
-            r["outputs"] = output_names;
-            r["model_has_token_type_ids"] = model_has_tti;
-            r["limits"] = { {"max_batch", max_batch}, {"max_seq", max_seq} };
-            r["threads"] = { {"intra", intra_threads}, {"inter", inter_threads} };
-            r["run_mutex"] = run_mutex_on;
-            r["ep"] = cli.ep;
-            r["listening"] = std::string("http://") + host + ":" + std::to_string(port);
-            std::string body = r.dump();
-            metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
-            res.set_content(body, "application/json");
-        });
+// Maps the exception being handled to its RequestError and bumps the counter
+// that goes with it. Call only from a catch block. The 4xx/5xx totals are left
+// to Metrics::count_failure, which handlers also use for their own refusals.
+static RequestError current_request_error(Metrics& metrics) {
+    try {
+        throw;
+    } catch (const DeadlineExceeded& e) {
+        metrics.req_deadline.fetch_add(1, std::memory_order_relaxed);
+        return {504, e.what()};
+    } catch (const ClientGone& e) {
+        metrics.req_client_gone.fetch_add(1, std::memory_order_relaxed);
+        return {499, e.what()};
+    } catch (const OverloadedError& e) {
+        metrics.rejected_overload.fetch_add(1, std::memory_order_relaxed);
+        return {429, std::string("overloaded: ") + e.what()};
+    } catch (const Ort::Exception& e) {
+        metrics.ort_fail.fetch_add(1, std::memory_order_relaxed);
+        return {500, std::string("onnxruntime: ") + e.what()};
+    } catch (const std::exception& e) {
+        return {400, e.what()};
+    }
+}
 
-        app.Get("/metrics", [&](const httplib::Request&, httplib::Response& res) {
-            json r;
-            r["req_total"] = metrics.req_total.load();
-            r["req_ok"] = metrics.req_ok.load();
-            r["req_4xx"] = metrics.req_4xx.load();
-            r["req_5xx"] = metrics.req_5xx.load();
-            r["ort_fail"] = metrics.ort_fail.load();
-            r["slow_req"] = metrics.slow_req.load();
-            r["bytes_in"] = metrics.bytes_in.load();
-            r["bytes_out"] = metrics.bytes_out.load();
-            std::string body = r.dump();
-            metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
-            res.set_content(body, "application/json");
-        });
+// Deadline / disconnect hooks a handler passes down to the batcher.
+struct RequestControl {
+    Clock::time_point deadline = Clock::time_point::max();
+    std::function<bool()> client_gone;
+    Priority priority = kPriorityInteractive;
+    uint32_t trace_id = 0;
+};
 
-        app.Post("/v1/rerank", [&](const httplib::Request& req, httplib::Response& res) {
-            metrics.req_total.fetch_add(1, std::memory_order_relaxed);
-            metrics.bytes_in.fetch_add((uint64_t)req.body.size(), std::memory_order_relaxed);
+// Counts a scoring request against RERANK_MAX_INFLIGHT for its lifetime.
+// Refusing extra requests up front keeps HTTP threads free for /health and /metrics.
+class InflightSlot {
+public:
+    InflightSlot(std::atomic<int64_t>& counter, int64_t limit) : counter_(counter) {
+        const int64_t now = counter_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (limit > 0 && now > limit) {
+            counter_.fetch_sub(1, std::memory_order_acq_rel);
+            throw OverloadedError("too many requests in flight");
+        }
+    }
+    ~InflightSlot() { counter_.fetch_sub(1, std::memory_order_acq_rel); }
+    InflightSlot(const InflightSlot&) = delete;
+    InflightSlot& operator=(const InflightSlot&) = delete;
 
-            auto t0 = Clock::now();
+private:
+    std::atomic<int64_t>& counter_;
+};
 
-            try {
-                if (req.body.empty()) throw std::runtime_error("empty body");
-                json j = json::parse(req.body);
-
-                int64_t B = 0, S = 0;
-                infer_BS_from_input_ids(j, B, S);
-                // ✅ Ensure all rows are consistent
-                validate_BS_exact(j, "input_ids", B, S);
-
-                if (j.contains("shape") && j["shape"].is_array() && j["shape"].size() == 2) {
-                    int64_t B2 = j["shape"][0].get<int64_t>();
-                    int64_t S2 = j["shape"][1].get<int64_t>();
-                    if (B2 != B || S2 != S) {
-                        throw std::runtime_error("shape mismatch: shape != actual input_ids dims");
-                    }
-                }
+// Activation memory of one session.Run, estimated from its shape as
+// B*S*(token_bytes + attn_bytes*S): per-token hidden/FFN buffers plus the
+// S×S attention scores. With run_bytes (RERANK_MEM_RUN_MB) the batcher splits
+// pieces and stops merging before a run would exceed it, and refuses a row
+// that cannot fit even alone. Runs estimated at shrink_bytes or more
+// (RERANK_ARENA_SHRINK_MB) hand their arena's free chunks back afterwards.
+struct MemBudget {
+    int64_t run_bytes = 0; // 0: no limit
+    int64_t token_bytes = 32 << 10;
+    int64_t attn_bytes = 128;
+    int64_t shrink_bytes = 0; // 0: never shrink
+    // Per worker: the memory.enable_memory_arena_shrinkage value ("cpu:0", "cpu:0;gpu:1").
+    std::vector<std::string> shrink_arenas;
 
-                if (B <= 0 || S <= 0) throw std::runtime_error("invalid B/S");
-                if (B > max_batch) throw std::runtime_error("batch too large");
-                if (S > max_seq) throw std::runtime_error("seq too large");
+    int64_t estimate(int64_t B, int64_t S) const { return B * S * (token_bytes + attn_bytes * S); }
+    bool fits(int64_t B, int64_t S) const { return run_bytes <= 0 || estimate(B, S) <= run_bytes; }
+};
 
-                validate_BS_exact(j, "attention_mask", B, S);
-                validate_attention_mask_bits(j, B, S);
+// RERANK_TARGET_P95_MS: online batch limits per length bucket. Fixed limits are
+// wrong for somebody: the cost of a batch depends on S and on the EP, and a
+// cap that suits nightly reindexing hurts interactive p95 (and vice versa).
+struct BatchTuning {
+    double target_p95_ms = 0;  // 0: static RERANK_MAX_BATCH / RERANK_BATCH_WINDOW_US
+    int64_t window_max_us = 0; // largest merge window the controller may choose
+    // Fraction of runs the batch priority class gets while interactive work is
+    // also queued (RERANK_BATCH_MIN_SHARE); it cannot starve behind chat.
+    double batch_min_share = 0.1;
+    MemBudget mem;
+};
 
-                const bool req_has_tti = j.contains("token_type_ids") && j["token_type_ids"].is_array();
-                if (req_has_tti) {
-                    validate_BS_exact(j, "token_type_ids", B, S);
-                }
+// Keeps the last session.Run times per (length bucket, log2 batch-size
+// class). Every kAdjustEvery runs of a bucket its row cap is halved if the
+// p95 at the cap misses the target, or grown by a quarter if it is under 60%
+// of the target and batches actually fill the cap (growing an unfilled cap
+// buys nothing). The merge window gets half of the headroom left at the cap.
+// Limits are read lock-free by the batcher and /metrics.
+class BatchController {
+public:
+    BatchController(size_t buckets, int64_t max_rows, int64_t window_us, BatchTuning t)
+        : max_rows_(std::max<int64_t>(1, max_rows)), target_us_(t.target_p95_ms * 1000.0),
+          window_max_us_(t.window_max_us), buckets_(buckets) {
+        for (auto& b : buckets_) {
+            b.cap.store(max_rows_);
+            b.window_us.store(window_us);
+            b.classes.resize((size_t)class_of(max_rows_) + 1);
+        }
+    }
 
-                std::vector<int64_t> input_ids;
-                std::vector<int64_t> attention_mask;
-                std::vector<int64_t> token_type_ids;
+    bool enabled() const { return target_us_ > 0; }
+    int64_t max_rows(size_t b) const { return buckets_[b].cap.load(std::memory_order_relaxed); }
+    int64_t window_us(size_t b) const { return buckets_[b].window_us.load(std::memory_order_relaxed); }
+    // p95 session.Run time (us) at the current cap, as of the last adjustment; 0 before one.
+    int64_t run_p95_us(size_t b) const { return buckets_[b].p95_us.load(std::memory_order_relaxed); }
+    uint64_t adjustments() const { return adjustments_.load(std::memory_order_relaxed); }
 
-                input_ids.reserve((size_t)B * (size_t)S);
-                attention_mask.reserve((size_t)B * (size_t)S);
+    void observe(size_t b, int64_t rows, int64_t run_us) {
+        if (!enabled()) return;
+        Bucket& k = buckets_[b];
+        std::lock_guard<std::mutex> lk(mu_);
+        k.classes[(size_t)class_of(std::min(rows, max_rows_))].push(run_us);
+        const int64_t cap = k.cap.load(std::memory_order_relaxed);
+        k.runs++;
+        if (rows >= cap) k.full++;
+        if (k.runs < kAdjustEvery) return;
 
-                // If model expects token_type_ids but request doesn't send it, supply zeros.
-                const bool supply_tti = model_has_tti;
-                if (supply_tti) token_type_ids.reserve((size_t)B * (size_t)S);
+        // The largest class at or below the cap that has samples: the most
+        // expensive batches the cap currently lets through.
+        double p95 = -1;
+        for (int c = class_of(cap); c >= 0 && p95 < 0; c--) p95 = k.classes[(size_t)c].p95();
+        int64_t next = cap;
+        if (p95 > target_us_) {
+            next = std::max<int64_t>(1, cap / 2);
+        } else if (p95 < 0.6 * target_us_ && 2 * k.full >= k.runs) {
+            next = std::min(max_rows_, cap + std::max<int64_t>(1, cap / 4));
+        }
+        if (next != cap) {
+            k.cap.store(next, std::memory_order_relaxed);
+            adjustments_.fetch_add(1, std::memory_order_relaxed);
+        }
+        const double headroom = std::max(0.0, target_us_ - p95);
+        k.window_us.store(std::min(window_max_us_, (int64_t)(headroom / 2)), std::memory_order_relaxed);
+        k.p95_us.store((int64_t)p95, std::memory_order_relaxed);
+        k.runs = 0;
+        k.full = 0;
+    }
 
-                for (int64_t i = 0; i < B; i++) {
-                    for (int64_t k = 0; k < S; k++) input_ids.push_back(j["input_ids"][i][k].get<int64_t>());
-                    for (int64_t k = 0; k < S; k++) attention_mask.push_back(j["attention_mask"][i][k].get<int64_t>());
-                    if (supply_tti) {
-                        if (req_has_tti) {
-                            for (int64_t k = 0; k < S; k++) token_type_ids.push_back(j["token_type_ids"][i][k].get<int64_t>());
-                        } else {
-                            for (int64_t k = 0; k < S; k++) token_type_ids.push_back(0);
-                        }
-                    }
-                }
+private:
+    static constexpr int kAdjustEvery = 16;
+    static constexpr size_t kSamples = 32;
 
-                Ort::MemoryInfo mem = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
-                std::vector<int64_t> dims = {B, S};
+    struct Samples {
+        int64_t v[kSamples] = {};
+        size_t n = 0, next = 0;
+        void push(int64_t x) {
+            v[next] = x;
+            next = (next + 1) % kSamples;
+            n = std::min(n + 1, kSamples);
+        }
+        double p95() const {
+            if (n == 0) return -1;
+            int64_t s[kSamples];
+            std::copy(v, v + n, s);
+            const size_t k = (size_t)std::ceil(0.95 * (double)n) - 1;
+            std::nth_element(s, s + k, s + n);
+            return (double)s[k];
+        }
+    };
+    struct Bucket {
+        std::atomic<int64_t> cap{0};
+        std::atomic<int64_t> window_us{0};
+        std::atomic<int64_t> p95_us{0};
+        std::vector<Samples> classes; // by log2(rows)
+        int runs = 0, full = 0;       // since the last adjustment
+    };
 
-                std::vector<const char*> ort_in_names;
-                std::vector<Ort::Value> ort_inputs;
-                ort_in_names.reserve(3);
-                ort_inputs.reserve(3);
+    static int class_of(int64_t rows) { return 63 - __builtin_clzll((uint64_t)std::max<int64_t>(1, rows)); }
 
-                ort_in_names.push_back(in_input_ids);
-                ort_inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(
-                    mem, input_ids.data(), input_ids.size(), dims.data(), dims.size()
-                ));
+    const int64_t max_rows_;
+    const double target_us_;
+    const int64_t window_max_us_;
+    std::vector<Bucket> buckets_;
+    std::atomic<uint64_t> adjustments_{0};
+    std::mutex mu_;
+};
 
-                ort_in_names.push_back(in_attention_mask);
-                ort_inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(
-                    mem, attention_mask.data(), attention_mask.size(), dims.data(), dims.size()
-                ));
+// Splits each request's rows into length buckets (by attention_mask), merges
+// pieces of the same bucket across concurrent requests for up to window_us
+// (or until max_rows rows are pending), and runs each merged bucket trimmed to
+// its longest real row. Scores are scattered back in the original row order.
+// Trailing padding is masked out, so each caller's scores are unchanged.
+// With tuning.target_p95_ms the row cap and window are per bucket and set by a
+// BatchController, and pieces larger than the cap are split so that idle
+// sessions can share them.
+// Each priority class has its own queues. Interactive pieces are taken first
+// (so they overtake queued batch work at the next run boundary) and batch
+// pieces of the same bucket fill what is left of the run; while both classes
+// wait, tuning.batch_min_share of the runs are led by the batch class instead.
+class MicroBatcher {
+public:
+    // max_queue_rows bounds rows waiting for a session per priority class
+    // (0: unbounded), so a batch backlog never gets interactive work refused; a
+    // job that would exceed it is refused with OverloadedError instead of queueing.
+    // worker_init(i), if set, runs first on worker thread i (CPU pinning).
+    MicroBatcher(int workers, int64_t max_rows, int64_t window_us, token_t pad_id,
+                 std::vector<int64_t> bucket_edges, int64_t max_queue_rows, Metrics& metrics, BatchRunFn run,
+                 std::function<void(int worker)> worker_init = nullptr, BatchTuning tuning = {})
+        : max_queue_rows_(max_queue_rows), pad_id_(pad_id), edges_(sorted_edges(std::move(bucket_edges))),
+          metrics_(metrics), run_(std::move(run)), worker_init_(std::move(worker_init)),
+          ctl_(edges_.size(), max_rows, window_us, tuning),
+          batch_share_(std::min(1.0, std::max(0.0, tuning.batch_min_share))), mem_(std::move(tuning.mem)) {
+        for (auto& q : queues_) q.resize(edges_.size());
+        if (workers < 1) workers = 1;
+        for (int i = 0; i < workers; i++) {
+            workers_.push_back(std::make_unique<WorkerState>());
+            if (mem_.shrink_bytes <= 0) continue;
+            const std::string arenas = (size_t)i < mem_.shrink_arenas.size() ? mem_.shrink_arenas[(size_t)i] : "cpu:0";
+            workers_.back()->shrink_ro.AddConfigEntry("memory.enable_memory_arena_shrinkage", arenas.c_str());
+        }
+        for (int i = 0; i < workers; i++) threads_.emplace_back([this, i] { worker_loop(i); });
+    }
 
-                if (supply_tti) {
-                    ort_in_names.push_back(in_token_type_ids);
-                    ort_inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(
-                        mem, token_type_ids.data(), token_type_ids.size(), dims.data(), dims.size()
-                    ));
-                }
+    ~MicroBatcher() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
 
-                const char* ort_out_names[] = { out_logits };
-                std::vector<Ort::Value> outputs;
+    MicroBatcher(const MicroBatcher&) = delete;
+    MicroBatcher& operator=(const MicroBatcher&) = delete;
 
-                if (run_mutex_on) {
-                    std::lock_guard<std::mutex> lk(run_mu);
-                    outputs = session.Run(
-                        Ort::RunOptions{nullptr},
-                        ort_in_names.data(), ort_inputs.data(), ort_inputs.size(),
-                        ort_out_names, 1
-                    );
-                } else {
-                    outputs = session.Run(
-                        Ort::RunOptions{nullptr},
-                        ort_in_names.data(), ort_inputs.data(), ort_inputs.size(),
-                        ort_out_names, 1
-                    );
-                }
+    const std::vector<int64_t>& bucket_edges() const { return edges_; }
+    const BatchController& controller() const { return ctl_; }
+    const MemBudget& mem_budget() const { return mem_; }
+    int64_t queued_rows(int cls) const { return queued_rows_[cls].load(std::memory_order_relaxed); }
+    int64_t queued_pieces(int cls) const { return queued_pieces_[cls].load(std::memory_order_relaxed); }
+    int64_t queued_rows() const { return queued_rows(kPriorityInteractive) + queued_rows(kPriorityBatch); }
+    int64_t queued_pieces() const { return queued_pieces(kPriorityInteractive) + queued_pieces(kPriorityBatch); }
 
-                if (outputs.empty()) throw std::runtime_error("no outputs returned");
+    // Blocks until all of the job's rows have been scored (or failed). If the
+    // job's deadline passes or its client goes away first, the job is
+    // cancelled (job.cancelled says why) and run() returns once no worker
+    // still touches its buffers.
+    void run(RerankJob& job) {
+        const TokenBatch& t = job.tokens;
+        if (Clock::now() >= job.deadline) {
+            job.cancelled.store(kCancelDeadline);
+            return;
+        }
+        job.row_len.resize((size_t)t.B);
+        job.result.scores.assign((size_t)(t.B * job.width), 0.0f);
 
-                auto& out = outputs[0];
-                auto info = out.GetTensorTypeAndShapeInfo();
-                auto oshape = info.GetShape();
-                auto et = info.GetElementType();
+        // Current piece per bucket; a piece that reaches the bucket's cap, or
+        // whose next row would take it over the memory budget, is closed.
+        std::vector<JobPiece> open(edges_.size()), pieces;
+        for (int64_t i = 0; i < t.B; i++) {
+            const int64_t len = row_real_length(t.attention_mask + (size_t)i * (size_t)t.S, t.S);
+            job.row_len[(size_t)i] = len;
+            if (!mem_.fits(1, std::max<int64_t>(1, len))) {
+                metrics_.rejected_memory.fetch_add(1, std::memory_order_relaxed);
+                throw std::runtime_error("row " + std::to_string(i) + " (length " + std::to_string(len) + ") needs ~" +
+                                         std::to_string((mem_.estimate(1, len) + (1 << 20) - 1) >> 20) +
+                                         " MiB of activations, over RERANK_MEM_RUN_MB=" + std::to_string(mem_.run_bytes >> 20));
+            }
+            const size_t b = (size_t)(std::lower_bound(edges_.begin(), edges_.end(), len) - edges_.begin());
+            if (!open[b].rows.empty() && !mem_.fits((int64_t)open[b].rows.size() + 1, std::max(open[b].S, len))) {
+                metrics_.mem_splits.fetch_add(1, std::memory_order_relaxed);
+                pieces.push_back(std::move(open[b]));
+                open[b] = JobPiece{};
+            }
+            open[b].bucket = b;
+            open[b].rows.push_back(i);
+            open[b].S = std::max(open[b].S, len);
+            if ((int64_t)open[b].rows.size() >= ctl_.max_rows(b)) {
+                pieces.push_back(std::move(open[b]));
+                open[b] = JobPiece{};
+            }
+        }
+        for (auto& p : open) {
+            if (!p.rows.empty()) pieces.push_back(std::move(p));
+        }
 
-                if (oshape.empty() || oshape[0] != B) {
-                    throw std::runtime_error("unexpected output shape (batch dim mismatch)");
-                }
+        const auto now = Clock::now();
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            // An oversized job is still admitted into an empty queue.
+            const int cls = job.priority;
+            const int64_t queued = queued_rows_[cls].load(std::memory_order_relaxed);
+            if (max_queue_rows_ > 0 && queued > 0 && queued + t.B > max_queue_rows_) {
+                throw OverloadedError("inference queue full");
+            }
+            for (auto& p : pieces) {
+                p.job = &job;
+                p.enqueued = now;
+                job.pending++;
+                queued_pieces_[cls].fetch_add(1, std::memory_order_relaxed);
+                queues_[cls][p.bucket].push_back(std::move(p));
+            }
+            queued_rows_[cls].fetch_add(t.B, std::memory_order_relaxed);
+        }
+        cv_.notify_all();
 
-                int64_t K = 1;
-                if (oshape.size() == 1) {
-                    K = 1;
-                } else if (oshape.size() == 2) {
-                    K = oshape[1];
-                    if (K <= 0) throw std::runtime_error("invalid output K");
-                } else {
-                    throw std::runtime_error("unexpected output rank (expected 1 or 2)");
-                }
+        constexpr auto kClientPoll = std::chrono::milliseconds(10);
+        std::unique_lock<std::mutex> lk(job.mu);
+        bool cancel_sent = false;
+        while (!job.done) {
+            if (cancel_sent || (job.deadline == Clock::time_point::max() && !job.client_gone)) {
+                job.cv.wait(lk, [&] { return job.done; });
+                break;
+            }
+            Clock::time_point until = job.deadline;
+            if (job.client_gone) until = std::min(until, Clock::now() + kClientPoll);
+            job.cv.wait_until(lk, until, [&] { return job.done; });
+            if (job.done) break;
 
-                int pick = logits_index_default;
-                if (K == 2) pick = 1;
-                if (pick < 0 || pick >= (int)K) {
-                    throw std::runtime_error("logits pick index out of range; set RERANK_LOGITS_INDEX properly");
-                }
+            CancelReason why = kNotCancelled;
+            if (Clock::now() >= job.deadline) why = kCancelDeadline;
+            else if (job.client_gone && job.client_gone()) why = kCancelClientGone;
+            if (why == kNotCancelled) continue;
+            lk.unlock();
+            cancel(job, why);
+            lk.lock();
+            cancel_sent = true;
+        }
+    }
 
-                std::vector<double> scores;
-                scores.reserve((size_t)B);
+    // Drops the job's queued pieces and terminates a running batch once every
+    // job in it has been cancelled. Pieces already sharing a run with live jobs
+    // finish normally.
+    void cancel(RerankJob& job, CancelReason why) {
+        int expected = kNotCancelled;
+        job.cancelled.compare_exchange_strong(expected, why);
 
-                if (et == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
-                    const float* p = out.GetTensorData<float>();
-                    if (K == 1) {
-                        for (int64_t i = 0; i < B; i++) scores.push_back((double)p[i]);
-                    } else {
-                        for (int64_t i = 0; i < B; i++) scores.push_back((double)p[i * K + pick]);
-                    }
-                } else if (allow_fp16_output && et == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16) {
-                    const uint16_t* p = out.GetTensorData<uint16_t>();
-                    if (K == 1) {
-                        for (int64_t i = 0; i < B; i++) scores.push_back((double)fp16_to_fp32(p[i]));
+        std::vector<JobPiece> dropped;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            const int cls = job.priority;
+            for (auto& q : queues_[cls]) {
+                for (auto it = q.begin(); it != q.end();) {
+                    if (it->job != &job) { ++it; continue; }
+                    queued_rows_[cls].fetch_sub((int64_t)it->rows.size(), std::memory_order_relaxed);
+                    queued_pieces_[cls].fetch_sub(1, std::memory_order_relaxed);
+                    dropped.push_back(std::move(*it));
+                    it = q.erase(it);
+                }
+            }
+        }
+        metrics_.pieces_cancelled.fetch_add((uint64_t)dropped.size(), std::memory_order_relaxed);
+        for (size_t i = 0; i < dropped.size(); i++) complete_piece(job, nullptr, nullptr);
+
+        for (auto& ws : workers_) {
+            std::lock_guard<std::mutex> lk(ws->mu);
+            if (!ws->batch || ws->terminated) continue;
+            bool mine = false, all_cancelled = true;
+            for (auto& p : *ws->batch) {
+                if (p.job == &job) mine = true;
+                if (p.job->cancelled.load() == kNotCancelled) all_cancelled = false;
+            }
+            if (mine && all_cancelled) {
+                ws->ro.SetTerminate();
+                ws->shrink_ro.SetTerminate();
+                ws->terminated = true;
+                metrics_.runs_terminated.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    // Per-worker run state, shared with cancel(): the batch being run and the
+    // RunOptions to terminate it with (shrink_ro for runs over mem_.shrink_bytes).
+    struct WorkerState {
+        std::mutex mu;
+        Ort::RunOptions ro;
+        Ort::RunOptions shrink_ro;
+        const std::vector<JobPiece>* batch = nullptr;
+        bool terminated = false;
+    };
+
+    // A piece is dead once its job was cancelled or its deadline passed.
+    static bool piece_dead(const JobPiece& p, Clock::time_point now) {
+        RerankJob& job = *p.job;
+        if (job.cancelled.load() != kNotCancelled) return true;
+        if (now < job.deadline) return false;
+        int expected = kNotCancelled;
+        job.cancelled.compare_exchange_strong(expected, kCancelDeadline);
+        return true;
+    }
+
+    bool any_queued(int cls) const {
+        for (auto& q : queues_[cls]) if (!q.empty()) return true;
+        return false;
+    }
+    bool any_queued() const { return any_queued(kPriorityInteractive) || any_queued(kPriorityBatch); }
+
+    // Moves live pieces from the front of q into batch until the next one
+    // would not fit (rows or memory); false once the batch is full. Dead
+    // pieces are completed. S tracks the batch's longest row.
+    bool drain(int cls, std::deque<JobPiece>& q, int64_t max_rows, int64_t& rows, int64_t& S,
+               std::vector<JobPiece>& batch) {
+        LogHistogram& wait = cls == kPriorityBatch ? metrics_.queue_wait_batch_us : metrics_.queue_wait_interactive_us;
+        while (!q.empty()) {
+            const int64_t n = (int64_t)q.front().rows.size();
+            const bool dead = piece_dead(q.front(), Clock::now());
+            if (!dead && !batch.empty() &&
+                (rows + n > max_rows || !mem_.fits(rows + n, std::max(S, q.front().S)))) {
+                return false;
+            }
+            queued_rows_[cls].fetch_sub(n, std::memory_order_relaxed);
+            queued_pieces_[cls].fetch_sub(1, std::memory_order_relaxed);
+            if (dead) {
+                // Expired while queued: never run it.
+                metrics_.pieces_expired.fetch_add(1, std::memory_order_relaxed);
+                RerankJob& job = *q.front().job;
+                q.pop_front();
+                complete_piece(job, nullptr, nullptr);
+                continue;
+            }
+            metrics_.queue_wait_us.observe_since(q.front().enqueued);
+            wait.observe_since(q.front().enqueued);
+            if (q.front().job->trace_id) {
+                metrics_.trace.record("queue", q.front().job->trace_id, q.front().enqueued, Clock::now(), n,
+                                      q.front().S);
+            }
+            S = std::max(S, q.front().S);
+            batch.push_back(std::move(q.front()));
+            q.pop_front();
+            rows += n;
+        }
+        return rows < max_rows;
+    }
+
+    // Picks the leading class, then its bucket whose head has waited longest;
+    // the other class's pieces of that bucket fill the remaining rows.
+    std::vector<JobPiece> take_batch() {
+        std::vector<JobPiece> batch;
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [&] { return stop_ || any_queued(); });
+        if (!any_queued()) return batch;
+
+        int lead = kPriorityInteractive;
+        if (!any_queued(kPriorityInteractive)) {
+            lead = kPriorityBatch;
+        } else if (any_queued(kPriorityBatch)) {
+            batch_credit_ += batch_share_;
+            if (batch_credit_ >= 1.0) {
+                batch_credit_ -= 1.0;
+                lead = kPriorityBatch;
+            }
+        }
+        const int fill = 1 - lead;
+
+        auto& lead_q = queues_[lead];
+        size_t b = 0;
+        bool found = false;
+        for (size_t i = 0; i < lead_q.size(); i++) {
+            if (lead_q[i].empty()) continue;
+            if (!found || lead_q[i].front().enqueued < lead_q[b].front().enqueued) b = i;
+            found = true;
+        }
+
+        int64_t rows = 0, S = 1;
+        const int64_t max_rows = ctl_.max_rows(b);
+        const std::chrono::microseconds window(ctl_.window_us(b));
+        const auto deadline = Clock::now() + window;
+        for (;;) {
+            if (!drain(lead, lead_q[b], max_rows, rows, S, batch)) break;
+            if (!drain(fill, queues_[fill][b], max_rows, rows, S, batch)) break;
+            if (stop_ || window.count() <= 0) break;
+            if (cv_.wait_until(lk, deadline) == std::cv_status::timeout && lead_q[b].empty() &&
+                queues_[fill][b].empty()) {
+                break;
+            }
+        }
+        return batch;
+    }
+
+    static void complete_piece(RerankJob& job, const ScoreResult* r, std::exception_ptr err) {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lk(job.mu);
+            if (r) {
+                job.result.K = r->K;
+                job.result.width = r->width;
+                job.result.dtype = r->dtype;
+            }
+            if (err && !job.error) job.error = err;
+            last = (--job.pending == 0);
+            if (last) job.done = true;
+        }
+        if (last) job.cv.notify_one();
+    }
+
+    void worker_loop(int worker) {
+        if (worker_init_) worker_init_(worker);
+        // Scratch reused across merged batches.
+        std::vector<token_t> ids, mask, tti;
+
+        WorkerState& ws = *workers_[(size_t)worker];
+
+        for (;;) {
+            std::vector<JobPiece> batch = take_batch();
+            if (batch.empty()) {
+                std::lock_guard<std::mutex> lk(mu_);
+                if (stop_) return;
+                continue; // everything taken had expired
+            }
+
+            {
+                // Publish the batch for cancel(); jobs cancelled in between are dropped here.
+                std::lock_guard<std::mutex> lk(ws.mu);
+                ws.ro.UnsetTerminate();
+                ws.shrink_ro.UnsetTerminate();
+                ws.terminated = false;
+                const auto now = Clock::now();
+                size_t keep = 0;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    if (piece_dead(batch[i], now)) {
+                        metrics_.pieces_expired.fetch_add(1, std::memory_order_relaxed);
+                        complete_piece(*batch[i].job, nullptr, nullptr);
                     } else {
-                        for (int64_t i = 0; i < B; i++) scores.push_back((double)fp16_to_fp32(p[i * K + pick]));
+                        if (keep != i) batch[keep] = std::move(batch[i]);
+                        keep++;
+                    }
+                }
+                batch.resize(keep);
+                ws.batch = batch.empty() ? nullptr : &batch;
+            }
+            if (batch.empty()) continue;
+
+            int64_t B = 0, S = 1;
+            bool any_tti = false;
+            for (auto& p : batch) {
+                B += (int64_t)p.rows.size();
+                S = std::max(S, p.S);
+                any_tti = any_tti || (p.job->tokens.token_type_ids != nullptr);
+            }
+
+            const auto t_pack = Clock::now();
+            TokenBatch tb;
+            const TokenBatch& first = batch[0].job->tokens;
+            if (batch.size() == 1 && B == first.B && S == first.S) {
+                tb = first; // whole request, no padding to trim: run in place
+            } else {
+                const size_t n = (size_t)B * (size_t)S;
+                ids.assign(n, pad_id_);
+                mask.assign(n, 0);
+                if (any_tti) tti.assign(n, 0);
+
+                size_t row = 0;
+                for (auto& p : batch) {
+                    const TokenBatch& t = p.job->tokens;
+                    for (int64_t i : p.rows) {
+                        const int64_t len = p.job->row_len[(size_t)i];
+                        const size_t src = (size_t)i * (size_t)t.S;
+                        const size_t dst = row * (size_t)S;
+                        std::copy_n(t.input_ids + src, len, ids.begin() + dst);
+                        std::copy_n(t.attention_mask + src, len, mask.begin() + dst);
+                        if (t.token_type_ids) std::copy_n(t.token_type_ids + src, len, tti.begin() + dst);
+                        row++;
+                    }
+                }
+                tb.B = B;
+                tb.S = S;
+                tb.input_ids = ids.data();
+                tb.attention_mask = mask.data();
+                tb.token_type_ids = any_tti ? tti.data() : nullptr;
+            }
+
+            metrics_.batch_runs.fetch_add(1, std::memory_order_relaxed);
+            metrics_.batch_jobs.fetch_add((uint64_t)batch.size(), std::memory_order_relaxed);
+            metrics_.batch_rows.fetch_add((uint64_t)B, std::memory_order_relaxed);
+            metrics_.batch_tokens.fetch_add((uint64_t)B * (uint64_t)S, std::memory_order_relaxed);
+            metrics_.run_batch.observe((uint64_t)B);
+            metrics_.run_seq.observe((uint64_t)S);
+            const int64_t pack_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t_pack).count();
+
+            // A run this large leaves its arena grown; hand the free chunks back after it.
+            const bool shrink = mem_.shrink_bytes > 0 && mem_.estimate(B, S) >= mem_.shrink_bytes;
+            if (shrink) metrics_.arena_shrink_runs.fetch_add(1, std::memory_order_relaxed);
+
+            ScoreResult r;
+            std::exception_ptr err;
+            const auto t_call = Clock::now();
+            try {
+                r = run_(worker, tb, shrink ? ws.shrink_ro : ws.ro);
+                if (metrics_.trace.enabled()) {
+                    const auto t_run = t_call + std::chrono::microseconds(r.build_us);
+                    metrics_.trace.record("build", 0, t_pack, t_run, B, S);
+                    metrics_.trace.record("run", 0, t_run, t_run + std::chrono::microseconds(r.run_us), B, S);
+                }
+                metrics_.build_us.observe((uint64_t)(pack_us + r.build_us));
+                metrics_.run_us.observe((uint64_t)r.run_us);
+                ctl_.observe(batch[0].bucket, B, r.run_us);
+                const size_t w = (size_t)r.width;
+                size_t k = 0;
+                for (auto& p : batch) {
+                    if (p.job->width != r.width) throw std::runtime_error("model output width does not match request");
+                    for (int64_t i : p.rows) {
+                        std::copy_n(r.scores.data() + k * w, w, p.job->result.scores.data() + (size_t)i * w);
+                        k++;
+                    }
+                }
+            } catch (...) {
+                err = std::current_exception();
+            }
+            {
+                std::lock_guard<std::mutex> lk(ws.mu);
+                ws.batch = nullptr;
+            }
+            for (auto& p : batch) complete_piece(*p.job, err ? nullptr : &r, err);
+        }
+    }
+
+    static std::vector<int64_t> sorted_edges(std::vector<int64_t> e) {
+        std::sort(e.begin(), e.end());
+        e.erase(std::unique(e.begin(), e.end()), e.end());
+        e.push_back(INT64_MAX); // rows longer than the last edge share one bucket
+        return e;
+    }
+
+    const int64_t max_queue_rows_;
+    const token_t pad_id_;
+    const std::vector<int64_t> edges_;
+    Metrics& metrics_;
+    BatchRunFn run_;
+    std::function<void(int)> worker_init_;
+    BatchController ctl_;
+    const double batch_share_;
+    const MemBudget mem_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::vector<std::deque<JobPiece>> queues_[kPriorities]; // per class, one per bucket edge
+    std::atomic<int64_t> queued_rows_[kPriorities] = {};    // written under mu_, read lock-free by /metrics
+    std::atomic<int64_t> queued_pieces_[kPriorities] = {};
+    double batch_credit_ = 0; // under mu_; a batch-led run is due at >= 1
+    bool stop_ = false;
+    std::vector<std::unique_ptr<WorkerState>> workers_;
+    std::vector<std::thread> threads_;
+};
+
+// One entry per length bucket; max_len is null for the open-ended last bucket.
+static void write_batch_limits(JsonWriter& w, const MicroBatcher& mb) {
+    const BatchController& ctl = mb.controller();
+    const auto& edges = mb.bucket_edges();
+    w.begin_object();
+    w.key("adaptive").value(ctl.enabled());
+    w.key("adjustments").value(ctl.adjustments());
+    w.key("buckets").begin_array();
+    for (size_t b = 0; b < edges.size(); b++) {
+        w.begin_object();
+        w.key("max_len");
+        if (edges[b] == INT64_MAX) w.raw("null");
+        else w.value(edges[b]);
+        w.key("max_rows").value(ctl.max_rows(b));
+        w.key("window_us").value(ctl.window_us(b));
+        w.key("run_p95_ms").value(ctl.run_p95_us(b) / 1000.0);
+        w.end_object();
+    }
+    w.end_array();
+    w.end_object();
+}
+
+static std::string batch_bucket_labels(const std::string& model, int64_t max_len) {
+    return "{model=\"" + model + "\",max_len=\"" + (max_len == INT64_MAX ? std::string("+Inf") : std::to_string(max_len)) +
+           "\"}";
+}
+
+/* ===================== Score cache ===================== */
+
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t hash_tokens(const token_t* p, int64_t n, uint64_t h) {
+    h ^= mix64((uint64_t)n);
+    for (int64_t i = 0; i < n; i++) h = mix64(h ^ (uint64_t)p[i]) + 0x9e3779b97f4a7c15ULL;
+    return h;
+}
+
+// Sharded LRU of row -> score. Keys are the row's real-length input_ids and
+// token_type_ids (kept for an exact compare, not just the hash), so trailing
+// padding and batch composition do not affect hits.
+class ScoreCache {
+public:
+    ScoreCache(size_t max_entries, size_t max_bytes)
+        : max_entries_(std::max<size_t>(1, max_entries / kShards)),
+          max_bytes_(std::max<size_t>(1, max_bytes / kShards)) {}
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+
+    static uint64_t key_hash(const token_t* ids, const token_t* tti, int64_t len) {
+        uint64_t h = hash_tokens(ids, len, 0x243f6a8885a308d3ULL);
+        if (tti) h = hash_tokens(tti, len, h);
+        return h;
+    }
+
+    bool get(uint64_t h, const token_t* ids, const token_t* tti, int64_t len, float& score) {
+        Shard& sh = shard(h);
+        std::lock_guard<std::mutex> lk(sh.mu);
+        auto it = sh.index.find(h);
+        if (it == sh.index.end() || !it->second->matches(ids, tti, len)) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+        score = it->second->score;
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void put(uint64_t h, const token_t* ids, const token_t* tti, int64_t len, float score) {
+        Shard& sh = shard(h);
+        std::lock_guard<std::mutex> lk(sh.mu);
+        auto it = sh.index.find(h);
+        if (it != sh.index.end()) {
+            sh.bytes -= it->second->bytes();
+            sh.lru.erase(it->second);
+            sh.index.erase(it);
+        }
+        Entry e;
+        e.hash = h;
+        e.ids.assign(ids, ids + len);
+        if (tti) e.tti.assign(tti, tti + len);
+        e.score = score;
+        sh.bytes += e.bytes();
+        sh.lru.push_front(std::move(e));
+        sh.index[h] = sh.lru.begin();
+
+        while (sh.lru.size() > 1 && (sh.lru.size() > max_entries_ || sh.bytes > max_bytes_)) {
+            sh.bytes -= sh.lru.back().bytes();
+            sh.index.erase(sh.lru.back().hash);
+            sh.lru.pop_back();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void stats(size_t& entries, size_t& bytes) {
+        entries = 0;
+        bytes = 0;
+        for (auto& sh : shards_) {
+            std::lock_guard<std::mutex> lk(sh.mu);
+            entries += sh.lru.size();
+            bytes += sh.bytes;
+        }
+    }
+
+private:
+    static constexpr size_t kShards = 16;
+
+    struct Entry {
+        uint64_t hash = 0;
+        std::vector<token_t> ids;
+        std::vector<token_t> tti;
+        float score = 0;
+
+        size_t bytes() const { return sizeof(Entry) + (ids.size() + tti.size()) * sizeof(token_t) + 32; }
+        bool matches(const token_t* p, const token_t* t, int64_t len) const {
+            if ((int64_t)ids.size() != len || tti.empty() != (t == nullptr)) return false;
+            if (!std::equal(ids.begin(), ids.end(), p)) return false;
+            return !t || std::equal(tti.begin(), tti.end(), t);
+        }
+    };
+
+    struct Shard {
+        std::mutex mu;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    Shard& shard(uint64_t h) { return shards_[(h >> 59) % kShards]; }
+
+    const size_t max_entries_;
+    const size_t max_bytes_;
+    Shard shards_[kShards];
+};
+
+// Scores cached rows directly and sends only the misses through the batcher.
+// Runs the job and turns cancellation into DeadlineExceeded / ClientGone.
+static void run_job(MicroBatcher& batcher, RerankJob& job, const RequestControl& ctl) {
+    job.deadline = ctl.deadline;
+    job.client_gone = ctl.client_gone;
+    job.priority = ctl.priority;
+    job.trace_id = ctl.trace_id;
+    batcher.run(job);
+    switch (job.cancelled.load()) {
+        case kCancelDeadline: throw DeadlineExceeded("deadline exceeded");
+        case kCancelClientGone: throw ClientGone("client disconnected");
+        default: break;
+    }
+    if (job.error) std::rethrow_exception(job.error);
+}
+
+static ScoreResult score_with_cache(MicroBatcher& batcher, ScoreCache* cache, const TokenBatch& tb,
+                                    const RequestControl& ctl) {
+    if (!cache) {
+        RerankJob job;
+        job.tokens = tb;
+        run_job(batcher, job, ctl);
+        return std::move(job.result);
+    }
+
+    const size_t S = (size_t)tb.S;
+    ScoreResult out;
+    out.scores.assign((size_t)tb.B, 0.0f);
+
+    thread_local std::vector<int64_t> miss, miss_len;
+    thread_local std::vector<uint64_t> miss_hash;
+    miss.clear();
+    miss_len.clear();
+    miss_hash.clear();
+    for (int64_t i = 0; i < tb.B; i++) {
+        const token_t* ids = tb.input_ids + (size_t)i * S;
+        const token_t* tti = tb.token_type_ids ? tb.token_type_ids + (size_t)i * S : nullptr;
+        const int64_t len = row_real_length(tb.attention_mask + (size_t)i * S, tb.S);
+        const uint64_t h = ScoreCache::key_hash(ids, tti, len);
+        if (!cache->get(h, ids, tti, len, out.scores[(size_t)i])) {
+            miss.push_back(i);
+            miss_len.push_back(len);
+            miss_hash.push_back(h);
+        }
+    }
+    if (miss.empty()) return out;
+
+    // Compact the misses into a smaller batch unless nothing hit.
+    thread_local std::vector<token_t> ids, mask, tti;
+    RerankJob job;
+    if ((int64_t)miss.size() == tb.B) {
+        job.tokens = tb;
+    } else {
+        const size_t n = miss.size() * S;
+        ids.resize(n);
+        mask.resize(n);
+        if (tb.token_type_ids) tti.resize(n);
+        for (size_t r = 0; r < miss.size(); r++) {
+            const size_t src = (size_t)miss[r] * S;
+            std::copy_n(tb.input_ids + src, S, ids.begin() + r * S);
+            std::copy_n(tb.attention_mask + src, S, mask.begin() + r * S);
+            if (tb.token_type_ids) std::copy_n(tb.token_type_ids + src, S, tti.begin() + r * S);
+        }
+        job.tokens.B = (int64_t)miss.size();
+        job.tokens.S = tb.S;
+        job.tokens.input_ids = ids.data();
+        job.tokens.attention_mask = mask.data();
+        job.tokens.token_type_ids = tb.token_type_ids ? tti.data() : nullptr;
+    }
+
+    run_job(batcher, job, ctl);
+
+    out.K = job.result.K;
+    out.dtype = job.result.dtype;
+    for (size_t r = 0; r < miss.size(); r++) {
+        const int64_t i = miss[r];
+        const float score = job.result.scores[r];
+        out.scores[(size_t)i] = score;
+        const size_t src = (size_t)i * S;
+        cache->put(miss_hash[r], tb.input_ids + src,
+                   tb.token_type_ids ? tb.token_type_ids + src : nullptr, miss_len[r], score);
+    }
+    return out;
+}
+
+// Pooled [B, dim] vectors for an embedding model's rows, in row order.
+static ScoreResult embed_rows(MicroBatcher& batcher, int64_t dim, const TokenBatch& tb, const RequestControl& ctl) {
+    RerankJob job;
+    job.tokens = tb;
+    job.width = dim;
+    run_job(batcher, job, ctl);
+    return std::move(job.result);
+}
+
+// Packed little-endian float32, or IEEE half with fp16 (half the bytes).
+static void append_packed_floats(std::string& out, const float* v, size_t n, bool fp16) {
+    const size_t at = out.size();
+    if (!fp16) {
+        out.resize(at + n * sizeof(float));
+        std::memcpy(&out[at], v, n * sizeof(float));
+        return;
+    }
+    thread_local std::vector<uint16_t> half;
+    half.resize(n);
+    fp32_to_fp16_bulk(v, half.data(), n);
+    out.resize(at + n * sizeof(uint16_t));
+    std::memcpy(&out[at], half.data(), n * sizeof(uint16_t));
+}
+
+/* ===================== Model registry ===================== */
+
+// Everything needed to build one servable model; shared by startup and reloads.
+struct EngineConfig {
+    int sessions = 1;
+    int64_t max_batch = 512;
+    int64_t window_us = 0;
+    int64_t max_queue_rows = 0;
+    BatchTuning tuning;
+    token_t pad_id = 0;
+    std::vector<int64_t> len_buckets;
+    int64_t cache_entries = 0;
+    int64_t cache_mb = 0;
+    int logits_index = 0;
+    bool allow_fp16_output = true;
+    bool embed = false; // bi-encoder: rows become pooled vectors, not scores
+    Pooling pooling = Pooling::kMean;
+    bool normalize = true;
+    std::string ep = "cpu";
+    std::string opt_cache_dir; // empty: no optimized-model cache
+    std::vector<std::pair<int64_t, int64_t>> warmup_shapes; // (B, S)
+    std::vector<CpuList> session_cpus; // session i -> session_cpus[i % size]; empty: unpinned
+    std::vector<int64_t> cuda_devices{0}; // cuda/tensorrt: session i -> cuda_devices[i % size]
+    std::string profile_prefix; // non-empty: ORT profiler on, session i writes <prefix>-s<i>_<time>.json
+    std::function<Ort::SessionOptions(int idx, const std::string& ep)> session_options;
+};
+
+// "1x64,8x256" -> {(1,64), (8,256)}; "" or "0" -> none.
+static std::vector<std::pair<int64_t, int64_t>> parse_shape_list(const std::string& s) {
+    std::vector<std::pair<int64_t, int64_t>> out;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+        const size_t x = item.find_first_of("xX");
+        if (x == std::string::npos) continue;
+        const long long b = std::atoll(item.substr(0, x).c_str());
+        const long long t = std::atoll(item.substr(x + 1).c_str());
+        if (b > 0 && t > 0) out.emplace_back((int64_t)b, (int64_t)t);
+    }
+    return out;
+}
+
+// A loaded model: its session pool, batcher and score cache. Requests hold a
+// shared_ptr for their whole lifetime, so a swapped-out instance keeps serving
+// in-flight work and is torn down by whoever drops the last reference.
+struct ModelInstance {
+    std::string name;
+    std::string path;
+    std::string ep; // see kEpChoices
+    uint64_t generation = 0;
+    Clock::time_point loaded_at;
+    double load_sec = 0;
+    double warmup_sec = 0;
+    std::string opt_cache = "off"; // off | hit | written | failed
+    std::vector<std::string> input_names;
+    std::vector<std::string> output_names;
+    ModelBinding binding; // names point into input_names/output_names
+    bool has_tti = false;
+    bool embed = false;
+    int64_t embed_dim = 0; // floats per row for embedding models
+    std::vector<std::unique_ptr<PooledSession>> pool;
+    std::unique_ptr<ScoreCache> cache;     // per instance: scores are model-specific
+    std::unique_ptr<MicroBatcher> batcher; // declared last, so it stops before the sessions go
+
+    ~ModelInstance() {
+        if (generation > 0) std::cerr << "🗑️  Released model '" << name << "' (gen " << generation << ")\n";
+    }
+};
+
+// Runs every warm-up shape on every session (sessions in parallel) so lazy
+// kernel and allocator setup happens before traffic, not on the first users.
+static void warm_up_sessions(ModelInstance& m, const EngineConfig& cfg) {
+    if (cfg.warmup_shapes.empty()) return;
+    std::vector<std::exception_ptr> errors(m.pool.size());
+    std::vector<std::thread> ts;
+    for (size_t i = 0; i < m.pool.size(); i++) {
+        ts.emplace_back([&, i] {
+            try {
+                pin_current_thread(m.pool[i]->cpus); // scratch is first touched here
+                std::vector<token_t> ids, mask;
+                Ort::RunOptions ro;
+                for (auto& shape : cfg.warmup_shapes) {
+                    const int64_t B = std::min(shape.first, cfg.max_batch);
+                    const int64_t S = shape.second;
+                    ids.assign((size_t)(B * S), cfg.pad_id);
+                    mask.assign((size_t)(B * S), 1);
+                    run_pooled(*m.pool[i], m.binding, TokenBatch{B, S, ids.data(), mask.data(), nullptr}, ro);
+                }
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& t : ts) t.join();
+    for (auto& e : errors) if (e) std::rethrow_exception(e);
+}
+
+// Streaming 64-bit content hash (multi-GB models are fine).
+static uint64_t hash_file(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.good()) throw std::runtime_error("cannot read " + path);
+    std::vector<char> buf(1 << 20);
+    uint64_t h = 0x9E3779B97F4A7C15ull, total = 0;
+    while (f) {
+        f.read(buf.data(), (std::streamsize)buf.size());
+        const size_t n = (size_t)f.gcount();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w;
+            std::memcpy(&w, buf.data() + i, 8);
+            h = mix64(h ^ w);
+        }
+        for (; i < n; i++) h = mix64(h ^ (unsigned char)buf[i]);
+        total += n;
+    }
+    return mix64(h ^ total);
+}
+
+// Where the ORT-optimized copy of a model lives. The key covers the source
+// bytes, the ORT version, the EP and the host CPU model (ORT_ENABLE_ALL may
+// bake in hardware-specific transforms), so any of them changing means a miss.
+// tmp and data are per process, so concurrent starts never write the same files.
+struct OptCachePaths {
+    std::string model;     // <dir>/<stem>-<key>.opt.onnx, present only once complete
+    std::string tmp;       // written by ORT, linked to `model` after a good load
+    std::string data;      // external initializers, referenced by file name
+    std::string data_path; // data, inside the cache dir
+};
+
+static OptCachePaths opt_cache_paths(const EngineConfig& cfg, const std::string& model_path) {
+    std::string tag = std::string(OrtGetApiBase()->GetVersionString()) + "|" + cfg.ep + "|" + cpu_identity() +
+                      "|opt=all|v2";
+    uint64_t h = hash_file(model_path);
+    for (unsigned char c : tag) h = mix64(h ^ c);
+
+    const size_t slash = model_path.find_last_of('/');
+    std::string stem = slash == std::string::npos ? model_path : model_path.substr(slash + 1);
+    if (stem.size() > 5 && stem.compare(stem.size() - 5, 5, ".onnx") == 0) stem.resize(stem.size() - 5);
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+
+    OptCachePaths p;
+    const std::string base = cfg.opt_cache_dir + "/" + stem + "-" + hex;
+    p.model = base + ".opt.onnx";
+    const std::string pid = std::to_string((long long)::getpid());
+    p.tmp = p.model + "." + pid + ".tmp";
+    p.data = stem + "-" + hex + "." + pid + ".opt.data";
+    p.data_path = cfg.opt_cache_dir + "/" + p.data;
+    return p;
+}
+
+static std::shared_ptr<ModelInstance> load_model(Ort::Env& env, const std::string& name, const std::string& path,
+                                                 const EngineConfig& cfg, Metrics& metrics, uint64_t generation) {
+    const auto t0 = Clock::now();
+    auto m = std::make_shared<ModelInstance>();
+    m->name = name;
+    m->path = path;
+    m->ep = cfg.ep;
+
+    // A cached optimized graph skips ORT_ENABLE_ALL on later starts. Only the
+    // CPU EP is cached: other EPs keep node assignments that are not portable.
+    const bool use_opt_cache = !cfg.opt_cache_dir.empty() && cfg.ep == "cpu";
+    OptCachePaths oc;
+    if (use_opt_cache) oc = opt_cache_paths(cfg, path);
+    const bool hit = use_opt_cache && std::ifstream(oc.model).good();
+
+    std::vector<CpuList> cpus;
+    for (int i = 0; i < cfg.sessions && !cfg.session_cpus.empty(); i++) {
+        cpus.push_back(cfg.session_cpus[(size_t)i % cfg.session_cpus.size()]);
+    }
+    auto build_pool = [&](bool from_cache) {
+        return load_session_pool(env, from_cache ? oc.model : path, cfg.sessions, [&](int idx) {
+            Ort::SessionOptions so = cfg.session_options(idx, cfg.ep);
+            if (!cfg.profile_prefix.empty()) so.EnableProfiling((cfg.profile_prefix + "-s" + std::to_string(idx)).c_str());
+            if (from_cache) {
+                so.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_DISABLE_ALL);
+            } else if (use_opt_cache && idx == 0) {
+                so.SetOptimizedModelFilePath(oc.tmp.c_str());
+                so.AddConfigEntry("session.optimized_model_external_initializers_file_name", oc.data.c_str());
+                so.AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes", "1024");
+            }
+            return so;
+        }, cpus);
+    };
+    if (hit) {
+        try {
+            m->pool = build_pool(true);
+            m->opt_cache = "hit";
+        } catch (const std::exception& e) {
+            std::cerr << "⚠️  Optimized model cache unusable (" << e.what() << "); rebuilding " << oc.model << "\n";
+            std::remove(oc.model.c_str());
+        }
+    }
+    if (m->pool.empty()) {
+        // Each pooled session gets its own intra-op thread budget.
+        m->pool = build_pool(false);
+        if (use_opt_cache) {
+            // link() never replaces: when another process published first, its
+            // copy stays and ours (graph and initializers) is dropped.
+            const bool ok = ::link(oc.tmp.c_str(), oc.model.c_str()) == 0;
+            const bool lost = !ok && errno == EEXIST;
+            std::remove(oc.tmp.c_str());
+            if (!ok) std::remove(oc.data_path.c_str());
+            m->opt_cache = ok || lost ? "written" : "failed";
+            if (!ok && !lost) std::cerr << "⚠️  Could not write optimized model cache to " << oc.model << "\n";
+        }
+    }
+    m->input_names = get_input_names(*m->pool[0]->session);
+    m->output_names = get_output_names(*m->pool[0]->session);
+    if (ep_uses_cuda(cfg.ep)) {
+        for (size_t i = 0; i < m->pool.size(); i++) {
+            m->pool[i]->scratch.cuda_device = (int)cfg.cuda_devices[i % cfg.cuda_devices.size()];
+        }
+    }
+
+    ModelBinding& binding = m->binding;
+    binding.logits_index_default = cfg.logits_index;
+    binding.allow_fp16_output = cfg.allow_fp16_output;
+    binding.embed = cfg.embed;
+    binding.pooling = cfg.pooling;
+    binding.normalize = cfg.normalize;
+    bind_model(*m->pool[0]->session, m->input_names, m->output_names, binding);
+    m->has_tti = (binding.in_token_type_ids != nullptr);
+
+    const auto t_warm = Clock::now();
+    warm_up_sessions(*m, cfg);
+    m->warmup_sec = std::chrono::duration<double>(Clock::now() - t_warm).count();
+
+    m->embed = cfg.embed;
+    if (m->embed) {
+        // A symbolic hidden size is learned from one 1x1 run.
+        m->embed_dim = binding.out_K;
+        if (m->embed_dim <= 0) {
+            const token_t one = 1;
+            m->embed_dim = run_pooled(*m->pool[0], binding, TokenBatch{1, 1, &cfg.pad_id, &one, nullptr},
+                                      Ort::RunOptions()).width;
+        }
+    }
+
+    // Embeddings are not cached: the score cache holds one float per row.
+    if (!m->embed && cfg.cache_entries > 0 && cfg.cache_mb > 0) {
+        m->cache = std::make_unique<ScoreCache>((size_t)cfg.cache_entries, (size_t)cfg.cache_mb << 20);
+    }
+    // Arena shrinkage names each worker's devices: the CPU arena, plus its GPU's.
+    BatchTuning tuning = cfg.tuning;
+    for (auto& ps : m->pool) {
+        const int dev = ps->scratch.cuda_device;
+        tuning.mem.shrink_arenas.push_back(dev >= 0 ? "cpu:0;gpu:" + std::to_string(dev) : std::string("cpu:0"));
+    }
+    ModelInstance* raw = m.get(); // the batcher never outlives its instance
+    m->batcher = std::make_unique<MicroBatcher>((int)m->pool.size(), cfg.max_batch, cfg.window_us, cfg.pad_id,
+        cfg.len_buckets, cfg.max_queue_rows, metrics, [raw](int worker, const TokenBatch& tb, const Ort::RunOptions& ro) {
+            return run_pooled(*raw->pool[(size_t)worker], raw->binding, tb, ro);
+        }, [raw, &metrics](int worker) {
+            pin_current_thread(raw->pool[(size_t)worker]->cpus);
+            metrics.trace.name_thread(raw->name + " worker " + std::to_string(worker));
+        }, std::move(tuning));
+
+    m->loaded_at = Clock::now();
+    m->load_sec = std::chrono::duration<double>(m->loaded_at - t0).count();
+    m->generation = generation;
+
+    std::cerr << "✅ Loaded ONNX model '" << name << "': " << path
+              << " (ep=" << m->ep << ", sessions=" << m->pool.size() << ", gen=" << generation
+              << ", " << (int64_t)(m->load_sec * 1000) << "ms incl. warm-up " << (int64_t)(m->warmup_sec * 1000)
+              << "ms, opt_cache=" << m->opt_cache << ")\n";
+    if (m->embed) {
+        std::cerr << "Embedding: dim=" << m->embed_dim << " pooling=" << (cfg.pooling == Pooling::kCls ? "cls" : "mean")
+                  << " normalize=" << (cfg.normalize ? "1" : "0") << "\n";
+    }
+    std::cerr << "Inputs:\n" << join_lines(m->input_names);
+    std::cerr << "Outputs:\n" << join_lines(m->output_names);
+    std::cerr << "Input dtypes: input_ids=" << dtype_name(binding.in_input_ids_type)
+              << " attention_mask=" << dtype_name(binding.in_attention_mask_type);
+    if (m->has_tti) std::cerr << " token_type_ids=" << dtype_name(binding.in_token_type_ids_type);
+    std::cerr << "\n";
+    return m;
+}
+
+// Allocator usage of one session's arena, for /metrics. With a shared CPU
+// arena every session reports the same one, so it is listed once as session "shared".
+struct ArenaReport {
+    std::string model;
+    std::string session;
+    std::string device; // "cpu" or "cuda:<id>"
+    ArenaStats stats;
+};
+
+static std::vector<ArenaReport> collect_arena_stats(const std::vector<std::shared_ptr<ModelInstance>>& models,
+                                                    bool shared_cpu) {
+    std::vector<ArenaReport> out;
+    const Ort::MemoryInfo cpu = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    bool shared_done = false;
+    for (auto& m : models) {
+        for (size_t i = 0; i < m->pool.size(); i++) {
+            const PooledSession& ps = *m->pool[i];
+            ArenaReport r;
+            if ((!shared_cpu || !shared_done) && allocator_stats(*ps.session, cpu, r.stats)) {
+                r.model = shared_cpu ? "" : m->name;
+                r.session = shared_cpu ? "shared" : std::to_string(i);
+                r.device = "cpu";
+                out.push_back(std::move(r));
+                shared_done = true;
+            }
+            const int dev = ps.scratch.cuda_device;
+            if (dev < 0) continue;
+            ArenaReport g;
+            const Ort::MemoryInfo cuda("Cuda", OrtArenaAllocator, dev, OrtMemTypeDefault);
+            if (!allocator_stats(*ps.session, cuda, g.stats)) continue;
+            g.model = m->name;
+            g.session = std::to_string(i);
+            g.device = "cuda:" + std::to_string(dev);
+            out.push_back(std::move(g));
+        }
+    }
+    return out;
+}
+
+// Name -> current instance. Lookups copy the shared_ptr under a short lock;
+// a reload builds the new instance off to the side and swaps the pointer.
+class ModelRegistry {
+public:
+    std::shared_ptr<ModelInstance> get(const std::string& name) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = models_.find(name.empty() ? default_ : name);
+        return it == models_.end() ? nullptr : it->second;
+    }
+
+    // Installs m under its name; returns the instance it replaced (if any).
+    std::shared_ptr<ModelInstance> put(std::shared_ptr<ModelInstance> m, bool make_default) {
+        std::lock_guard<std::mutex> lk(mu_);
+        const std::string name = m->name;
+        std::shared_ptr<ModelInstance> old = std::move(models_[name]);
+        models_[name] = std::move(m);
+        if (make_default || default_.empty()) default_ = name;
+        errors_.erase(name);
+        return old;
+    }
+
+    // The default model cannot be removed.
+    std::shared_ptr<ModelInstance> remove(const std::string& name) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (name == default_) throw std::runtime_error("cannot unload the default model");
+        auto it = models_.find(name);
+        if (it == models_.end()) return nullptr;
+        std::shared_ptr<ModelInstance> old = std::move(it->second);
+        models_.erase(it);
+        return old;
+    }
+
+    std::vector<std::shared_ptr<ModelInstance>> list() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        std::vector<std::shared_ptr<ModelInstance>> out;
+        for (auto& kv : models_) out.push_back(kv.second);
+        return out;
+    }
+
+    std::string default_name() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return default_;
+    }
+
+    // At most one background load per name.
+    bool begin_load(const std::string& name) {
+        std::lock_guard<std::mutex> lk(mu_);
+        return loading_.insert(name).second;
+    }
+    void end_load(const std::string& name, const std::string& error) {
+        std::lock_guard<std::mutex> lk(mu_);
+        loading_.erase(name);
+        if (!error.empty()) errors_[name] = error;
+    }
+
+    json status() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return { {"default", default_}, {"loading", loading_}, {"errors", errors_} };
+    }
+
+    uint64_t next_generation() { return generation_.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+private:
+    mutable std::mutex mu_;
+    std::map<std::string, std::shared_ptr<ModelInstance>> models_;
+    std::string default_;
+    std::set<std::string> loading_;
+    std::map<std::string, std::string> errors_; // last failed load per name
+    std::atomic<uint64_t> generation_{0};
+};
+
+// RERANK_MODELS="fp16=/path/a.onnx,int8=/path/b.onnx"
+struct ModelSpec {
+    std::string name;
+    std::string path;
+    std::string ep; // empty: the server's --ep
+};
+
+// "fp16=/m/model_fp16.onnx,int8=/m/model_int8.onnx@cpu" -> specs; "@ep" is optional.
+static std::vector<ModelSpec> parse_model_list(const std::string& s) {
+    std::vector<ModelSpec> out;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty()) continue;
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == item.size()) {
+            throw std::runtime_error("RERANK_MODELS: expected name=path[@ep], got '" + item + "'");
+        }
+        ModelSpec m{item.substr(0, eq), item.substr(eq + 1), ""};
+        const size_t at = m.path.rfind('@');
+        if (at != std::string::npos && m.path.find('/', at) == std::string::npos) {
+            m.ep = m.path.substr(at + 1);
+            m.path.resize(at);
+            if (!is_known_ep(m.ep)) {
+                throw std::runtime_error("RERANK_MODELS: unknown ep '" + m.ep + "' for " + m.name + " (expected " +
+                                         kEpChoices + ")");
+            }
+        }
+        out.push_back(std::move(m));
+    }
+    return out;
+}
+
+// Picks among precision/EP variants of one model by request shape. At startup
+// every variant is timed at each (B,S) grid point; requests that do not name a
+// model go to the fastest variant for the smallest grid point covering them.
+class ShapeRouter {
+public:
+    bool active() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return !cells_.empty();
+    }
+
+    // ms[(bi * s_edges.size() + si) * variants.size() + v]; infinity = failed.
+    void set(std::vector<std::string> variants, std::vector<int64_t> b_edges, std::vector<int64_t> s_edges,
+             std::vector<double> ms) {
+        std::lock_guard<std::mutex> lk(mu_);
+        variants_ = std::move(variants);
+        b_edges_ = std::move(b_edges);
+        s_edges_ = std::move(s_edges);
+        ms_ = std::move(ms);
+        const size_t V = variants_.size();
+        cells_.assign(b_edges_.size() * s_edges_.size(), 0);
+        for (size_t c = 0; c < cells_.size(); c++) {
+            for (size_t v = 1; v < V; v++) {
+                if (ms_[c * V + v] < ms_[c * V + cells_[c]]) cells_[c] = v;
+            }
+        }
+        hits_ = std::make_unique<std::atomic<uint64_t>[]>(V);
+        for (size_t v = 0; v < V; v++) hits_[v].store(0);
+    }
+
+    std::string pick(int64_t B, int64_t S) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (cells_.empty()) return std::string();
+        const size_t v = cells_[cell(B, S)];
+        hits_[v].fetch_add(1, std::memory_order_relaxed);
+        return variants_[v];
+    }
+
+    json table() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        json r;
+        r["active"] = !cells_.empty();
+        if (cells_.empty()) return r;
+        const size_t V = variants_.size();
+        json hits = json::object();
+        for (size_t v = 0; v < V; v++) hits[variants_[v]] = hits_[v].load(std::memory_order_relaxed);
+        json cells = json::array();
+        for (size_t bi = 0; bi < b_edges_.size(); bi++) {
+            for (size_t si = 0; si < s_edges_.size(); si++) {
+                const size_t c = bi * s_edges_.size() + si;
+                json ms = json::object();
+                for (size_t v = 0; v < V; v++) {
+                    const double x = ms_[c * V + v];
+                    ms[variants_[v]] = std::isfinite(x) ? json(x) : json(nullptr);
+                }
+                cells.push_back({ {"B", b_edges_[bi]}, {"S", s_edges_[si]}, {"variant", variants_[cells_[c]]}, {"ms", ms} });
+            }
+        }
+        r["variants"] = variants_;
+        r["batch_edges"] = b_edges_;
+        r["seq_edges"] = s_edges_;
+        r["cells"] = std::move(cells);
+        r["routed"] = std::move(hits);
+        return r;
+    }
+
+private:
+    size_t cell(int64_t B, int64_t S) const {
+        auto idx = [](const std::vector<int64_t>& e, int64_t x) {
+            const size_t i = (size_t)(std::lower_bound(e.begin(), e.end(), x) - e.begin());
+            return std::min(i, e.size() - 1);
+        };
+        return idx(b_edges_, B) * s_edges_.size() + idx(s_edges_, S);
+    }
+
+    mutable std::mutex mu_;
+    std::vector<std::string> variants_;
+    std::vector<int64_t> b_edges_, s_edges_;
+    std::vector<double> ms_;
+    std::vector<size_t> cells_; // winning variant per cell
+    std::unique_ptr<std::atomic<uint64_t>[]> hits_;
+};
+
+// Median latency of `iters` runs per variant and grid point, through each
+// variant's batcher (so it never races live traffic on a session).
+static void calibrate_router(ShapeRouter& router, const std::vector<std::shared_ptr<ModelInstance>>& variants,
+                             std::vector<int64_t> b_edges, std::vector<int64_t> s_edges, int iters,
+                             int64_t max_batch, token_t pad_id) {
+    for (auto& e : b_edges) e = std::min(e, max_batch);
+    std::sort(b_edges.begin(), b_edges.end());
+    b_edges.erase(std::unique(b_edges.begin(), b_edges.end()), b_edges.end());
+    std::sort(s_edges.begin(), s_edges.end());
+    s_edges.erase(std::unique(s_edges.begin(), s_edges.end()), s_edges.end());
+    if (b_edges.empty() || s_edges.empty()) throw std::runtime_error("routing grid is empty");
+
+    const size_t V = variants.size();
+    std::vector<double> ms(b_edges.size() * s_edges.size() * V, std::numeric_limits<double>::infinity());
+    std::vector<token_t> ids, mask;
+    for (size_t bi = 0; bi < b_edges.size(); bi++) {
+        for (size_t si = 0; si < s_edges.size(); si++) {
+            const int64_t B = b_edges[bi], S = s_edges[si];
+            ids.assign((size_t)(B * S), pad_id);
+            mask.assign((size_t)(B * S), 1);
+            const TokenBatch tb{B, S, ids.data(), mask.data(), nullptr};
+            for (size_t v = 0; v < V; v++) {
+                try {
+                    std::vector<double> t;
+                    for (int i = 0; i <= iters; i++) { // the first run is discarded
+                        const auto t0 = Clock::now();
+                        score_with_cache(*variants[v]->batcher, nullptr, tb, RequestControl{});
+                        if (i > 0) t.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+                    }
+                    std::nth_element(t.begin(), t.begin() + (std::ptrdiff_t)(t.size() / 2), t.end());
+                    ms[(bi * s_edges.size() + si) * V + v] = t[t.size() / 2];
+                } catch (const std::exception& e) {
+                    std::cerr << "⚠️  Routing calibration: '" << variants[v]->name << "' failed at B=" << B
+                              << " S=" << S << ": " << e.what() << "\n";
+                }
+            }
+        }
+    }
+    std::vector<std::string> names;
+    for (auto& m : variants) names.push_back(m->name);
+    router.set(std::move(names), std::move(b_edges), std::move(s_edges), std::move(ms));
+}
+
+/* ===================== Request decoding ===================== */
+
+// Decoded /v1/rerank body. `tokens` points either into the owned vectors or,
+// for the binary format, straight into the request body (zero-copy).
+// Optional server-side cutoff: keep rows with score >= min_score, best top_k first.
+struct Selection {
+    int64_t top_k = 0; // <= 0: no limit
+    bool has_min_score = false;
+    double min_score = 0;
+
+    bool active() const { return top_k > 0 || has_min_score; }
+};
+
+// Whole-number body fields may be written as floats (1e3); fractions and values
+// outside int64 are refused rather than truncated.
+static bool whole_int64(double v, int64_t& out) {
+    if (!std::isfinite(v) || v != std::trunc(v) || v < -9223372036854775808.0 || v >= 9223372036854775808.0) {
+        return false;
+    }
+    out = (int64_t)v;
+    return true;
+}
+
+// j[key] as an int64, or `defv` when absent or null; same rules as the
+// /v1/rerank SAX parser.
+static int64_t json_int_or(const json& j, const char* key, int64_t defv) {
+    auto it = j.find(key);
+    if (it == j.end() || it->is_null()) return defv;
+    int64_t v = 0;
+    if (it->is_number_unsigned() && it->get<uint64_t>() > (uint64_t)INT64_MAX) {
+        throw std::runtime_error(std::string("'") + key + "': value out of int64 range");
+    }
+    if (it->is_number_integer()) return it->get<int64_t>();
+    if (it->is_number_float() && whole_int64(it->get<double>(), v)) return v;
+    throw std::runtime_error(std::string("'") + key + "': must be int");
+}
+
+static void read_selection(const json& j, Selection& sel) {
+    sel.top_k = json_int_or(j, "top_k", sel.top_k);
+    if (j.contains("min_score") && !j["min_score"].is_null()) {
+        sel.has_min_score = true;
+        sel.min_score = j["min_score"].get<double>();
+    }
+}
+
+// Indices passing min_score, best first (ties by index), cut to top_k.
+// partial_sort keeps this O(B log k) for small k.
+static std::vector<size_t> select_top(const std::vector<float>& scores, const Selection& sel) {
+    std::vector<size_t> idx;
+    idx.reserve(scores.size());
+    for (size_t i = 0; i < scores.size(); i++) {
+        if (!sel.has_min_score || scores[i] >= sel.min_score) idx.push_back(i);
+    }
+    auto better = [&](size_t a, size_t b) { return scores[a] > scores[b] || (scores[a] == scores[b] && a < b); };
+    if (sel.top_k > 0 && (size_t)sel.top_k < idx.size()) {
+        std::partial_sort(idx.begin(), idx.begin() + sel.top_k, idx.end(), better);
+        idx.resize((size_t)sel.top_k);
+    } else {
+        std::sort(idx.begin(), idx.end(), better);
+    }
+    return idx;
+}
+
+struct RerankRequest {
+    TokenBatch tokens;
+    Selection select;
+    int64_t timeout_ms = 0; // body "timeout_ms"; 0: none
+    std::string priority;   // body "priority"; see parse_priority
+    int64_t parse_us = 0;
+    int64_t validate_us = 0;
+    std::vector<token_t> input_ids;
+    std::vector<token_t> attention_mask;
+    std::vector<token_t> token_type_ids;
+
+    // Keeps buffer capacity for the next request on this thread.
+    void reset() {
+        tokens = TokenBatch{};
+        select = Selection{};
+        timeout_ms = 0;
+        priority.clear();
+        parse_us = 0;
+        validate_us = 0;
+    }
+};
+
+static void check_limits(int64_t B, int64_t S, int64_t max_batch, int64_t max_seq) {
+    if (B <= 0 || S <= 0) throw std::runtime_error("invalid B/S");
+    if (B > max_batch) throw std::runtime_error("batch too large");
+    if (S > max_seq) throw std::runtime_error("seq too large");
+}
+
+static void validate_mask_flat(const token_t* p, size_t n) {
+    if (!mask_is_binary(p, n)) throw std::runtime_error("attention_mask: only 0/1 allowed");
+}
+
+// Token arrays as they arrive from the body: row r is vals[off[r], off[r+1]).
+// Rows of equal length are already the row-major tensor.
+struct RaggedRows {
+    std::vector<token_t> vals;
+    std::vector<uint32_t> off;
+    bool seen = false;
+
+    void clear() {
+        vals.clear();
+        off.clear();
+        seen = false;
+    }
+    size_t rows() const { return off.empty() ? 0 : off.size() - 1; }
+    size_t len(size_t r) const { return off[r + 1] - off[r]; }
+    size_t max_len() const {
+        size_t m = 0;
+        for (size_t r = 0; r < rows(); r++) m = std::max(m, len(r));
+        return m;
+    }
+};
+
+// Single-pass json::sax_parse handler for /v1/rerank bodies. Tokens go straight
+// into RaggedRows (4 bytes each instead of a DOM node), and range, mask-bit,
+// batch and row-length limits are checked as values arrive, so bad input fails
+// at the first offending token. Unknown keys are skipped.
+class RerankBodySax {
+public:
+    RaggedRows& ids;
+    RaggedRows& mask;
+    RaggedRows& tti;
+    RaggedRows& docs;
+    std::vector<token_t>& query;
+    bool has_query = false;
+    bool has_shape = false;
+    int64_t shape[2] = {0, 0};
+    bool has_doc_type_id = false;
+    token_t doc_type_id = 0;
+    Selection select;
+    int64_t timeout_ms = 0;
+    std::string priority;
+
+    RerankBodySax(int64_t max_batch, int64_t max_seq, RaggedRows& ids_, RaggedRows& mask_, RaggedRows& tti_,
+                  RaggedRows& docs_, std::vector<token_t>& query_)
+        : ids(ids_), mask(mask_), tti(tti_), docs(docs_), query(query_),
+          max_batch_((size_t)std::max<int64_t>(0, max_batch)), max_seq_((size_t)std::max<int64_t>(0, max_seq)) {}
+
+    bool null() {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (depth_ == 1) {
+            // null scalars mean "unset"; a null token_type_ids means "absent".
+            if (field_ == kIds || field_ == kMask || field_ == kDocs || field_ == kQuery || field_ == kShape) bad("expected an array");
+            return true;
+        }
+        return in_skip() || bad("expected an integer");
+    }
+    bool boolean(bool) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        return in_skip() || bad(field_ == kPriority ? "expected a string" : "expected a number");
+    }
+    bool string(std::string& v) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (depth_ == 1 && field_ == kPriority) {
+            priority = std::move(v);
+            return true;
+        }
+        return in_skip() || bad("expected a number");
+    }
+    bool binary(json::binary_t&) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        return in_skip() || bad("expected a number");
+    }
+    bool number_float(double v, const std::string&) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (depth_ == 1 && field_ == kMinScore) return set_min_score(v);
+        if (depth_ == 1 && field_ == kPriority) return bad("expected a string");
+        if (depth_ == 1 && (field_ == kTopK || field_ == kTimeout)) {
+            int64_t n = 0;
+            return whole_int64(v, n) ? number_integer(n) : bad("must be int");
+        }
+        return in_skip() || bad("must be int");
+    }
+    bool number_unsigned(uint64_t v) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (v > (uint64_t)INT64_MAX) return in_skip() || bad("value out of int32 range");
+        return number_integer((int64_t)v);
+    }
+    bool number_integer(int64_t v) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (in_skip()) return true;
+        if (depth_ == 1) {
+            switch (field_) {
+                case kTopK: select.top_k = v; return true;
+                case kTimeout: timeout_ms = v; return true;
+                case kMinScore: return set_min_score((double)v);
+                case kDocType: has_doc_type_id = true; doc_type_id = token(v); return true;
+                case kPriority: return bad("expected a string");
+                default: return bad("expected a 2D array");
+            }
+        }
+        if (depth_ == 2) {
+            if (field_ == kQuery) {
+                query.push_back(token(v));
+                return true;
+            }
+            if (field_ == kShape) {
+                if (shape_n_ < 2) shape[shape_n_] = v;
+                shape_n_++;
+                return true;
+            }
+            return bad("invalid row");
+        }
+        // depth 3: one token of a 2D field
+        if (field_ == kMask && v != 0 && v != 1) throw std::runtime_error("attention_mask: only 0/1 allowed");
+        RaggedRows& r = *rows_;
+        if (r.vals.size() - r.off.back() >= max_seq_) throw std::runtime_error("seq too large");
+        r.vals.push_back(token(v));
+        return true;
+    }
+
+    bool start_object(std::size_t) {
+        if (depth_ == 0) {
+            root_ = true;
+        } else if (!in_skip()) {
+            bad(depth_ == 1 ? "expected an array" : "expected an integer");
+        }
+        depth_++;
+        return true;
+    }
+    bool end_object() {
+        depth_--;
+        return true;
+    }
+    bool key(std::string& k) {
+        if (depth_ == 1) field_ = field_of(k);
+        return true;
+    }
+    bool start_array(std::size_t) {
+        if (depth_ == 0) throw std::runtime_error("body must be a JSON object");
+        if (in_skip()) {
+            depth_++;
+            return true;
+        }
+        if (depth_ == 1) {
+            switch (field_) {
+                case kIds: case kMask: case kTti: case kDocs:
+                    rows_ = field_ == kIds ? &ids : field_ == kMask ? &mask : field_ == kTti ? &tti : &docs;
+                    if (rows_->seen) bad("duplicate key");
+                    rows_->seen = true;
+                    rows_->off.assign(1, 0);
+                    break;
+                case kQuery:
+                    if (has_query) bad("duplicate key");
+                    has_query = true;
+                    break;
+                case kShape:
+                    has_shape = true;
+                    shape_n_ = 0;
+                    break;
+                default:
+                    bad("expected a number");
+            }
+        } else if (depth_ == 2 && rows_ && (field_ == kIds || field_ == kMask || field_ == kTti || field_ == kDocs)) {
+            if (rows_->rows() >= max_batch_) throw std::runtime_error("batch too large");
+        } else {
+            bad(depth_ == 2 ? "expected integers" : "expected a 2D array");
+        }
+        depth_++;
+        return true;
+    }
+    bool end_array() {
+        depth_--;
+        if (depth_ == 2 && !in_skip()) {
+            RaggedRows& r = *rows_;
+            if (field_ == kIds && r.vals.size() == r.off.back()) bad("invalid row");
+            r.off.push_back((uint32_t)r.vals.size());
+        }
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) {
+        throw std::runtime_error(ex.what());
+    }
+
+    bool root_object() const { return root_; }
+    bool shape_valid() const { return shape_n_ == 2; }
+
+private:
+    enum Field { kSkip, kIds, kMask, kTti, kDocs, kQuery, kShape, kTopK, kMinScore, kTimeout, kDocType, kPriority };
+
+    static Field field_of(const std::string& k) {
+        static const std::unordered_map<std::string, Field> fields = {
+            {"input_ids", kIds}, {"attention_mask", kMask}, {"token_type_ids", kTti},
+            {"doc_ids", kDocs}, {"query_ids", kQuery}, {"shape", kShape}, {"top_k", kTopK},
+            {"min_score", kMinScore}, {"timeout_ms", kTimeout}, {"doc_type_id", kDocType},
+            {"priority", kPriority},
+        };
+        auto it = fields.find(k);
+        return it == fields.end() ? kSkip : it->second;
+    }
+    static const char* field_name(Field f) {
+        switch (f) {
+            case kIds: return "input_ids";
+            case kMask: return "attention_mask";
+            case kTti: return "token_type_ids";
+            case kDocs: return "doc_ids";
+            case kQuery: return "query_ids";
+            case kShape: return "shape";
+            case kTopK: return "top_k";
+            case kMinScore: return "min_score";
+            case kTimeout: return "timeout_ms";
+            case kDocType: return "doc_type_id";
+            case kPriority: return "priority";
+            default: return "?";
+        }
+    }
+
+    // Values nested inside an unknown key (or the root object's own scalars) are ignored.
+    bool in_skip() const { return depth_ >= 1 && field_ == kSkip; }
+    bool bad(const char* what) const { throw std::runtime_error(std::string("'") + field_name(field_) + "': " + what); }
+    token_t token(int64_t v) const {
+        if (v < INT32_MIN || v > INT32_MAX) bad("value out of int32 range");
+        return (token_t)v;
+    }
+    bool set_min_score(double v) {
+        select.has_min_score = true;
+        select.min_score = v;
+        return true;
+    }
+
+    const size_t max_batch_;
+    const size_t max_seq_;
+    int depth_ = 0;
+    Field field_ = kSkip;
+    RaggedRows* rows_ = nullptr;
+    int shape_n_ = 0;
+    bool root_ = false;
+};
+
+// Companion rows (attention_mask/token_type_ids) must match input_ids row by row.
+static void check_rows_like(const RaggedRows& r, const char* key, const RaggedRows& ids) {
+    if (!r.seen || r.rows() == 0) throw std::runtime_error(std::string("missing/invalid '") + key + "': expected 2D array");
+    if (r.rows() != ids.rows()) throw std::runtime_error(std::string("'") + key + "': batch mismatch");
+    if (r.off != ids.off) throw std::runtime_error(std::string("'") + key + "': seq mismatch");
+}
+
+// Pads ragged rows into a row-major [B,S] tensor; equal-length rows are
+// swapped in as they are (the swap keeps both buffers' capacity for reuse).
+static void rows_to_tensor(RaggedRows& r, size_t S, token_t pad, std::vector<token_t>& out) {
+    const size_t B = r.rows();
+    if (r.vals.size() == B * S) {
+        out.swap(r.vals);
+        return;
+    }
+    out.assign(B * S, pad);
+    for (size_t i = 0; i < B; i++) {
+        std::copy(r.vals.begin() + r.off[i], r.vals.begin() + r.off[i + 1], out.begin() + (ptrdiff_t)(i * S));
+    }
+}
+
+// Query-prefix form: {"query_ids": [...], "doc_ids": [[...], ...]}. Each row is
+// query_ids ++ doc_ids[i], so the client puts the special tokens in (e.g.
+// "<s> q </s>" + "</s> d </s>"). The mask is generated; token_type_ids are 0
+// over the query and doc_type_id over the document.
+static void build_prefix_rows(const std::vector<token_t>& q, const RaggedRows& docs, int64_t max_batch,
+                              int64_t max_seq, token_t pad_id, token_t doc_type_id, RerankRequest& out) {
+    if (!docs.seen || docs.rows() == 0) throw std::runtime_error("missing/invalid 'doc_ids': expected 2D array");
+    const int64_t B = (int64_t)docs.rows();
+    const size_t qlen = q.size();
+    const int64_t S = (int64_t)(qlen + docs.max_len());
+    check_limits(B, S, max_batch, max_seq);
+
+    const size_t n = (size_t)B * (size_t)S;
+    out.input_ids.assign(n, pad_id);
+    out.attention_mask.assign(n, 0);
+    const bool with_tti = doc_type_id != 0;
+    if (with_tti) out.token_type_ids.assign(n, 0);
+
+    for (int64_t i = 0; i < B; i++) {
+        const size_t base = (size_t)i * (size_t)S;
+        const size_t dlen = docs.len((size_t)i);
+        const size_t len = qlen + dlen;
+        if (len == 0) throw std::runtime_error("doc_ids: empty row with empty query_ids");
+        std::copy(q.begin(), q.end(), out.input_ids.begin() + (ptrdiff_t)base);
+        std::copy_n(docs.vals.begin() + docs.off[(size_t)i], dlen, out.input_ids.begin() + (ptrdiff_t)(base + qlen));
+        std::fill_n(out.attention_mask.begin() + (ptrdiff_t)base, len, 1);
+        if (with_tti) std::fill_n(out.token_type_ids.begin() + (ptrdiff_t)(base + qlen), dlen, doc_type_id);
+    }
+
+    out.tokens.B = B;
+    out.tokens.S = S;
+    out.tokens.input_ids = out.input_ids.data();
+    out.tokens.attention_mask = out.attention_mask.data();
+    out.tokens.token_type_ids = with_tti ? out.token_type_ids.data() : nullptr;
+}
+
+// Rows may be ragged: S is the longest input_ids row and shorter rows are
+// right-padded with pad_id / attention_mask 0. parse_us covers the SAX pass
+// (including per-token checks), validate_us the shape checks and padding.
+static void parse_json_request(const std::string& body, int64_t max_batch, int64_t max_seq,
+                               token_t pad_id, token_t doc_type_id, RerankRequest& out) {
+    const auto t0 = Clock::now();
+    // Per-thread staging, reused across requests like RerankRequest's buffers.
+    thread_local RaggedRows ids, mask, tti, docs;
+    thread_local std::vector<token_t> query;
+    ids.clear();
+    mask.clear();
+    tti.clear();
+    docs.clear();
+    query.clear();
+
+    RerankBodySax sax(max_batch, max_seq, ids, mask, tti, docs, query);
+    json::sax_parse(body, &sax);
+    if (!sax.root_object()) throw std::runtime_error("body must be a JSON object");
+    const auto t1 = Clock::now();
+    out.parse_us = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+
+    out.select = sax.select;
+    out.timeout_ms = sax.timeout_ms;
+    out.priority = std::move(sax.priority);
+    if (sax.has_query) {
+        build_prefix_rows(query, docs, max_batch, max_seq, pad_id, sax.has_doc_type_id ? sax.doc_type_id : doc_type_id, out);
+        out.validate_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t1).count();
+        return;
+    }
+
+    if (!ids.seen || ids.rows() == 0) throw std::runtime_error("missing/invalid 'input_ids': expected 2D array");
+    const int64_t B = (int64_t)ids.rows();
+    const int64_t S = (int64_t)ids.max_len();
+    if (sax.has_shape && sax.shape_valid() && (sax.shape[0] != B || sax.shape[1] != S)) {
+        throw std::runtime_error("shape mismatch: shape != actual input_ids dims");
+    }
+    check_limits(B, S, max_batch, max_seq);
+
+    check_rows_like(mask, "attention_mask", ids);
+    const bool req_has_tti = tti.seen;
+    if (req_has_tti) check_rows_like(tti, "token_type_ids", ids);
+
+    rows_to_tensor(ids, (size_t)S, pad_id, out.input_ids);
+    rows_to_tensor(mask, (size_t)S, 0, out.attention_mask);
+    if (req_has_tti) rows_to_tensor(tti, (size_t)S, 0, out.token_type_ids);
+
+    out.tokens.B = B;
+    out.tokens.S = S;
+    out.tokens.input_ids = out.input_ids.data();
+    out.tokens.attention_mask = out.attention_mask.data();
+    out.tokens.token_type_ids = req_has_tti ? out.token_type_ids.data() : nullptr;
+    out.validate_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t1).count();
+}
+
+// Binary request body, Content-Type: application/x-rerank-tensor.
+// All fields little-endian:
+//    0  char[4] magic "RRT1"
+//    4  u8      dtype: 1 = int32, 2 = int64
+//    5  u8      flags: bit0 attention_mask present, bit1 token_type_ids present
+//    6  u16     reserved (0)
+//    8  u32     B
+//   12  u32     S
+//   16  input_ids[B*S], then attention_mask[B*S] and token_type_ids[B*S] if flagged
+// A missing attention_mask means all ones. int32 payloads are used in place;
+// int64 payloads are narrowed (and range-checked) into int32 buffers.
+static constexpr const char* kTensorContentType = "application/x-rerank-tensor";
+static constexpr const char* kScoresContentType = "application/octet-stream"; // float32[B], little-endian
+static constexpr size_t kTensorHeaderSize = 16;
+
+enum : uint8_t { kTensorInt32 = 1, kTensorInt64 = 2 };
+enum : uint8_t { kTensorHasMask = 1u << 0, kTensorHasTti = 1u << 1 };
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "binary tensor format assumes a little-endian host"
+#endif
+
+// data must stay valid (and unchanged) until out.tokens is no longer used:
+// aligned int32 planes are referenced in place. With copy_planes every plane
+// is copied into out first, for data the client can still write to (a shared
+// region): the mask is validated, hashed and run from the same bytes.
+static void parse_tensor_request(const char* data, size_t size, int64_t max_batch, int64_t max_seq, RerankRequest& out,
+                                 bool copy_planes = false) {
+    const auto t0 = Clock::now();
+    if (size < kTensorHeaderSize) throw std::runtime_error("tensor body: truncated header");
+    const char* p = data;
+    if (std::memcmp(p, "RRT1", 4) != 0) throw std::runtime_error("tensor body: bad magic (expected RRT1)");
+
+    const uint8_t dtype = (uint8_t)p[4];
+    const uint8_t flags = (uint8_t)p[5];
+    uint32_t B32 = 0, S32 = 0;
+    std::memcpy(&B32, p + 8, 4);
+    std::memcpy(&S32, p + 12, 4);
+
+    size_t es = 0;
+    if (dtype == kTensorInt32) es = 4;
+    else if (dtype == kTensorInt64) es = 8;
+    else throw std::runtime_error("tensor body: unknown dtype (expected 1=int32 or 2=int64)");
+
+    const int64_t B = (int64_t)B32, S = (int64_t)S32;
+    check_limits(B, S, max_batch, max_seq);
+
+    const auto t1 = Clock::now();
+    out.parse_us = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+
+    const bool has_mask = (flags & kTensorHasMask) != 0;
+    const bool has_tti = (flags & kTensorHasTti) != 0;
+    const size_t n = (size_t)B * (size_t)S;
+    const size_t planes = 1 + (has_mask ? 1 : 0) + (has_tti ? 1 : 0);
+    if (size != kTensorHeaderSize + planes * n * es) {
+        throw std::runtime_error("tensor body: size does not match header B/S/dtype/flags");
+    }
+
+    const char* ids_p = p + kTensorHeaderSize;
+    const char* mask_p = has_mask ? ids_p + n * es : nullptr;
+    const char* tti_p = has_tti ? ids_p + (has_mask ? 2 : 1) * n * es : nullptr;
+
+    auto plane = [&](const char* src, std::vector<token_t>& owned) -> const token_t* {
+        if (dtype == kTensorInt32 && !copy_planes && reinterpret_cast<uintptr_t>(src) % alignof(token_t) == 0) {
+            return reinterpret_cast<const token_t*>(src);
+        }
+        owned.resize(n);
+        if (dtype == kTensorInt32) {
+            std::memcpy(owned.data(), src, n * es);
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                int64_t v;
+                std::memcpy(&v, src + i * 8, 8);
+                if (v < INT32_MIN || v > INT32_MAX) throw std::runtime_error("tensor body: value out of int32 range");
+                owned[i] = (token_t)v;
+            }
+        }
+        return owned.data();
+    };
+
+    out.tokens.B = B;
+    out.tokens.S = S;
+    out.tokens.input_ids = plane(ids_p, out.input_ids);
+    if (has_mask) {
+        out.tokens.attention_mask = plane(mask_p, out.attention_mask);
+        validate_mask_flat(out.tokens.attention_mask, n);
+    } else {
+        out.attention_mask.assign(n, 1);
+        out.tokens.attention_mask = out.attention_mask.data();
+    }
+    out.tokens.token_type_ids = has_tti ? plane(tti_p, out.token_type_ids) : nullptr;
+    out.validate_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t1).count();
+}
+
+static bool header_has(const httplib::Request& req, const char* key, const char* needle) {
+    return req.get_header_value(key).find(needle) != std::string::npos;
+}
+
+// ?top_k=&min_score= work for every body format and override body fields.
+static void read_selection_params(const httplib::Request& req, Selection& sel) {
+    try {
+        if (req.has_param("top_k")) sel.top_k = std::stoll(req.get_param_value("top_k"));
+        if (req.has_param("min_score")) {
+            sel.min_score = std::stod(req.get_param_value("min_score"));
+            sel.has_min_score = true;
+        }
+    } catch (const std::logic_error&) {
+        throw std::runtime_error("top_k/min_score: invalid number");
+    }
+}
+
+/* ===================== Text requests ===================== */
+
+// POST /v1/rerank_text body; same contract as tools/rerank-proxy.
+struct TextRequest {
+    std::string query;
+    std::vector<std::string> documents;
+    Selection select;       // applies to ranked_*; scores stay complete
+    int64_t max_length = 0; // <= 0: server default
+    int64_t timeout_ms = 0; // 0: none
+    int64_t chunk = 0;      // /v1/rerank_stream sub-batch size; <= 0: server default
+    std::string priority;
+};
+
+static std::string strip_ascii_ws(const std::string& s) {
+    size_t b = 0, e = s.size();
+    while (b < e && std::isspace((unsigned char)s[b])) b++;
+    while (e > b && std::isspace((unsigned char)s[e - 1])) e--;
+    return s.substr(b, e - b);
+}
+
+static TextRequest parse_text_request(const std::string& body, int64_t max_batch) {
+    json j = json::parse(body);
+    TextRequest r;
+    if (!j.contains("query") || !j["query"].is_string()) throw std::runtime_error("query must be a string");
+    r.query = strip_ascii_ws(j["query"].get<std::string>());
+    if (r.query.empty()) throw std::runtime_error("query is empty");
+
+    if (!j.contains("documents") || !j["documents"].is_array()) throw std::runtime_error("documents must be an array");
+    const json& docs = j["documents"];
+    if (docs.empty()) throw std::runtime_error("documents is empty");
+    if ((int64_t)docs.size() > max_batch) throw std::runtime_error("batch too large");
+    // Empty documents are kept (and scored) so scores stay aligned with the input.
+    r.documents.reserve(docs.size());
+    for (auto& d : docs) {
+        if (!d.is_string()) throw std::runtime_error("documents must contain strings");
+        r.documents.push_back(strip_ascii_ws(d.get<std::string>()));
+    }
+
+    read_selection(j, r.select);
+    r.timeout_ms = json_int_or(j, "timeout_ms", r.timeout_ms);
+    r.max_length = json_int_or(j, "max_length", r.max_length);
+    r.chunk = json_int_or(j, "chunk", r.chunk);
+    if (j.contains("priority") && !j["priority"].is_null()) r.priority = j["priority"].get<std::string>();
+    return r;
+}
+
+// RERANK_TOKENIZE_THREADS threads shared by every text request, so concurrent
+// large requests (and /v1/rerank_stream sub-batches) queue for the same threads
+// instead of each starting their own.
+class TokenizePool {
+public:
+    explicit TokenizePool(int threads) {
+        for (int i = 0; i < std::max(1, threads); i++) threads_.emplace_back([this] { loop(); });
+    }
+
+    ~TokenizePool() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    // Runs fn on a pool thread; the future carries its result or exception.
+    template <class F>
+    auto submit(F fn) -> std::future<decltype(fn())> {
+        auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+        auto fut = task->get_future();
+        post([task] { (*task)(); });
+        return fut;
+    }
+
+    // Runs work(begin, end) over [0, n), split into up to one slice per pool
+    // thread once there are enough rows to be worth it. The calling thread
+    // takes slices too, so this never waits on a slice nobody has started,
+    // even when called from a pool thread or with every pool thread busy.
+    void parallel_rows(size_t n, const std::function<void(size_t, size_t)>& work) {
+        constexpr size_t kParallelMinRows = 32;
+        const size_t parts = n >= kParallelMinRows ? std::min(threads_.size(), n / 8) : 1;
+        if (parts <= 1) {
+            work(0, n);
+            return;
+        }
+        auto rows = std::make_shared<Rows>();
+        rows->work = &work;
+        rows->n = n;
+        rows->parts = parts;
+        rows->chunk = (n + parts - 1) / parts;
+        rows->errs.resize(parts);
+        for (size_t t = 1; t < parts; t++) post([rows] { run_slices(*rows); });
+        run_slices(*rows);
+        std::unique_lock<std::mutex> lk(rows->mu);
+        rows->cv.wait(lk, [&] { return rows->done == rows->parts; });
+        for (auto& e : rows->errs) if (e) std::rethrow_exception(e);
+    }
+
+private:
+    // One parallel_rows call. Helpers that find every slice taken return
+    // without touching `work`, which only lives until the caller returns.
+    struct Rows {
+        const std::function<void(size_t, size_t)>* work = nullptr;
+        size_t n = 0, parts = 0, chunk = 0;
+        std::atomic<size_t> next{0};
+        std::mutex mu;
+        std::condition_variable cv;
+        size_t done = 0; // guarded by mu
+        std::vector<std::exception_ptr> errs;
+    };
+
+    static void run_slices(Rows& r) {
+        for (size_t t; (t = r.next.fetch_add(1)) < r.parts;) {
+            const size_t begin = std::min(r.n, t * r.chunk), end = std::min(r.n, begin + r.chunk);
+            std::exception_ptr err;
+            try { (*r.work)(begin, end); } catch (...) { err = std::current_exception(); }
+            std::lock_guard<std::mutex> lk(r.mu);
+            r.errs[t] = err;
+            if (++r.done == r.parts) r.cv.notify_all();
+        }
+    }
+
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            tasks_.push_back(std::move(fn));
+        }
+        cv_.notify_one();
+    }
+
+    void loop() {
+        for (;;) {
+            std::function<void()> fn;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [&] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                fn = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            fn();
+        }
+    }
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Right-pads encoded rows into `out`'s buffers and points out.tokens at them.
+static void pad_rows(const std::vector<std::vector<token_t>>& ids, const std::vector<std::vector<token_t>>& tti,
+                     token_t pad_id, int64_t max_seq, RerankRequest& out) {
+    const size_t B = ids.size();
+    size_t S = 1;
+    for (auto& row : ids) S = std::max(S, row.size());
+    check_limits((int64_t)B, (int64_t)S, (int64_t)B, max_seq);
+
+    const size_t n = B * S;
+    out.input_ids.assign(n, pad_id);
+    out.attention_mask.assign(n, 0);
+    out.token_type_ids.assign(n, 0);
+    for (size_t i = 0; i < B; i++) {
+        std::copy(ids[i].begin(), ids[i].end(), out.input_ids.begin() + (ptrdiff_t)(i * S));
+        std::fill_n(out.attention_mask.begin() + (ptrdiff_t)(i * S), ids[i].size(), 1);
+        std::copy(tti[i].begin(), tti[i].end(), out.token_type_ids.begin() + (ptrdiff_t)(i * S));
+    }
+    out.tokens.B = (int64_t)B;
+    out.tokens.S = (int64_t)S;
+    out.tokens.input_ids = out.input_ids.data();
+    out.tokens.attention_mask = out.attention_mask.data();
+    out.tokens.token_type_ids = out.token_type_ids.data();
+}
+
+// Tokenizes query/document pairs into right-padded rows in `out`.
+static void tokenize_pairs(const Tokenizer& tok, const TextRequest& tr, size_t max_length,
+                           TokenizePool& pool, int64_t max_seq, RerankRequest& out) {
+    const size_t B = tr.documents.size();
+    const std::vector<int32_t> q = tok.encode(tr.query);
+
+    std::vector<std::vector<token_t>> ids(B), tti(B);
+    pool.parallel_rows(B, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            tok.encode_pair(q, tok.encode(tr.documents[i]), max_length, ids[i], tti[i]);
+        }
+    });
+    pad_rows(ids, tti, tok.pad_id(), max_seq, out);
+}
+
+// POST /v1/embed_text body: "input" is one string or an array of them.
+struct EmbedTextRequest {
+    std::vector<std::string> inputs;
+    bool single = false;    // "input" was a bare string
+    int64_t max_length = 0; // <= 0: server default
+    int64_t timeout_ms = 0; // 0: none
+    std::string priority;
+};
+
+static EmbedTextRequest parse_embed_text_request(const std::string& body, int64_t max_batch) {
+    json j = json::parse(body);
+    EmbedTextRequest r;
+    if (!j.contains("input")) throw std::runtime_error("input must be a string or an array of strings");
+    const json& in = j["input"];
+    if (in.is_string()) {
+        r.single = true;
+        r.inputs.push_back(strip_ascii_ws(in.get<std::string>()));
+    } else if (in.is_array()) {
+        if (in.empty()) throw std::runtime_error("input is empty");
+        if ((int64_t)in.size() > max_batch) throw std::runtime_error("batch too large");
+        r.inputs.reserve(in.size());
+        for (auto& t : in) {
+            if (!t.is_string()) throw std::runtime_error("input must contain strings");
+            r.inputs.push_back(strip_ascii_ws(t.get<std::string>()));
+        }
+    } else {
+        throw std::runtime_error("input must be a string or an array of strings");
+    }
+    r.timeout_ms = json_int_or(j, "timeout_ms", r.timeout_ms);
+    r.max_length = json_int_or(j, "max_length", r.max_length);
+    if (j.contains("priority") && !j["priority"].is_null()) r.priority = j["priority"].get<std::string>();
+    return r;
+}
+
+// Tokenizes single texts (the tokenizer's "single" template) into `out`.
+static void tokenize_singles(const Tokenizer& tok, const std::vector<std::string>& texts, size_t max_length,
+                             TokenizePool& pool, int64_t max_seq, RerankRequest& out) {
+    const size_t B = texts.size();
+    std::vector<std::vector<token_t>> ids(B), tti(B);
+    pool.parallel_rows(B, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) tok.encode_single(tok.encode(texts[i]), max_length, ids[i], tti[i]);
+    });
+    pad_rows(ids, tti, tok.pad_id(), max_seq, out);
+}
+
+/* ===================== Framed transport ===================== */
+
+// Length-prefixed frames on a persistent Unix domain socket, for a co-located
+// client (rerank-proxy with CPP_RERANK_FORMAT=frame|shm) that would otherwise pay
+// TCP + HTTP parsing per request. Headers are 16 bytes, little-endian:
+//   request:   "RRF1" | u32 payload_len | u32 id | u16 op     | u16 flags
+//   response:  "RRF1" | u32 payload_len | u32 id | u16 status | u16 reserved (0)
+// Status uses HTTP codes; errors carry a JSON {"error": ...}. Frames on one
+// connection are answered in order; clients open more connections for concurrency.
+//   op 1  score: payload is an application/x-rerank-tensor body -> float32[B]
+//   op 2  attach: a memfd/shm descriptor sent with SCM_RIGHTS becomes this
+//         connection's shared region (replacing any earlier one) -> {"size": N}
+//   op 3  score in place: payload u64 tensor_offset | u64 tensor_len | u64 scores_offset
+//         into the region; the tensor body is read where it lies (aligned int32
+//         planes reach ORT without a copy), float32[B] is written at
+//         scores_offset, and the response payload is empty. The client must not
+//         touch either range until the response arrives.
+//   op 4  embed: payload as op 1, run on the embedding model -> row-major [B, H]
+//         float32 (IEEE half with flag bit 1)
+// Request flags: bit 0 marks the frame batch priority class (X-Rerank-Priority: batch).
+static constexpr size_t kFrameHeaderSize = 16;
+enum : uint16_t { kFrameOpScore = 1, kFrameOpAttach = 2, kFrameOpScoreShm = 3, kFrameOpEmbed = 4 };
+enum : uint16_t { kFrameFlagBatch = 1, kFrameFlagFp16 = 2 };
+
+#ifdef MSG_NOSIGNAL
+static constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+static constexpr int kSendFlags = 0; // SO_NOSIGPIPE is set per socket instead
+#endif
+
+// Reads exactly n bytes. A descriptor passed alongside them (SCM_RIGHTS)
+// replaces passed_fd; extra descriptors are closed.
+static bool read_full(int fd, char* p, size_t n, int& passed_fd) {
+    while (n > 0) {
+        iovec iov{p, n};
+        alignas(cmsghdr) char ctrl[CMSG_SPACE(4 * sizeof(int))];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        const ssize_t k = ::recvmsg(fd, &msg, 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        for (cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            const size_t nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < nfds; i++) {
+                int got;
+                std::memcpy(&got, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (passed_fd >= 0) ::close(passed_fd);
+                passed_fd = got;
+            }
+        }
+        p += k;
+        n -= (size_t)k;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        const ssize_t k = ::send(fd, p, n, kSendFlags);
+        if (k > 0) { p += k; n -= (size_t)k; continue; }
+        if (k < 0 && errno == EINTR) continue;
+        return false;
+    }
+    return true;
+}
+
+// Replaces a stale socket file; refuses to remove anything that is not a socket.
+static void remove_stale_socket(const std::string& path) {
+    std::error_code ec;
+    const auto st = std::filesystem::symlink_status(path, ec);
+    if (ec || st.type() == std::filesystem::file_type::not_found) return;
+    if (st.type() != std::filesystem::file_type::socket) {
+        throw std::runtime_error(path + " exists and is not a socket");
+    }
+    std::filesystem::remove(path, ec);
+}
+
+// A client's MAP_SHARED region, mapped while its connection is open.
+struct SharedRegion {
+    char* base = nullptr;
+    size_t size = 0;
+
+    SharedRegion(char* b, size_t n) : base(b), size(n) {}
+    ~SharedRegion() { ::munmap(base, size); }
+    SharedRegion(const SharedRegion&) = delete;
+    SharedRegion& operator=(const SharedRegion&) = delete;
+
+    // Throws unless [off, off+len) lies inside the region.
+    char* at(uint64_t off, uint64_t len) const {
+        if (off > size || len > size - off) throw std::runtime_error("shm: range outside the attached region");
+        return base + off;
+    }
+};
+
+// Maps the descriptor from an attach frame (and closes it). On Linux the memfd
+// is sealed against shrinking first: truncating a file under a live mapping
+// would SIGBUS the server.
+static std::unique_ptr<SharedRegion> map_shared_region(int fd, size_t max_bytes) {
+#ifdef F_ADD_SEALS
+    // Sealed before the size is read, so the size mapped below cannot shrink.
+    if (::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        throw std::runtime_error("attach: region must be a memfd created with MFD_ALLOW_SEALING");
+    }
+#endif
+    struct stat st{};
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0) throw std::runtime_error("attach: descriptor is not a sized file");
+    const size_t size = (size_t)st.st_size;
+    if (size > max_bytes) throw std::runtime_error("attach: region exceeds RERANK_SHM_MAX_MB");
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) throw std::runtime_error(std::string("attach: mmap failed: ") + std::strerror(errno));
+    return std::make_unique<SharedRegion>(static_cast<char*>(base), size);
+}
+
+struct FrameRequest {
+    uint16_t op = 0;
+    uint16_t flags = 0;
+    const std::string& payload;
+    const SharedRegion* region; // null until the connection attaches one
+    const std::function<bool()>& client_gone;
+};
+
+class FrameServer {
+public:
+    // Called for ops 1, 3 and 4 (and unknown ones); returns the response status,
+    // out receives the response payload.
+    using Handler = std::function<uint16_t(const FrameRequest& req, std::string& out)>;
+
+    FrameServer(std::string path, size_t max_payload, size_t max_region, int max_conns, Handler handle)
+        : path_(std::move(path)), max_payload_(max_payload), max_region_(max_region),
+          max_conns_(std::max(1, max_conns)), handle_(std::move(handle)) {}
+    ~FrameServer() { stop(); }
+    FrameServer(const FrameServer&) = delete;
+    FrameServer& operator=(const FrameServer&) = delete;
+
+    void start() {
+        sockaddr_un addr{};
+        if (path_.size() >= sizeof(addr.sun_path)) throw std::runtime_error("frame socket path too long: " + path_);
+        remove_stale_socket(path_);
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) throw std::runtime_error(std::string("frame socket: ") + std::strerror(errno));
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path_.c_str(), path_.size() + 1);
+        if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listen_fd_, 64) != 0) {
+            const std::string err = std::strerror(errno);
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            throw std::runtime_error("cannot listen on " + path_ + ": " + err);
+        }
+        accept_thread_ = std::thread([this] { accept_loop(); });
+    }
+
+    // Closes the listener, disconnects every client and waits for in-flight frames.
+    void stop() {
+        if (listen_fd_ < 0) return;
+        stop_.store(true);
+        if (accept_thread_.joinable()) accept_thread_.join();
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        std::unique_lock<std::mutex> lk(mu_);
+        for (int fd : conns_) ::shutdown(fd, SHUT_RDWR);
+        cv_.wait(lk, [&] { return conns_.empty(); });
+        lk.unlock();
+        std::error_code ec;
+        std::filesystem::remove(path_, ec);
+    }
+
+    const std::string& path() const { return path_; }
+    size_t connections() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return conns_.size();
+    }
+    size_t regions() const { return regions_.load(); }
+
+private:
+    void accept_loop() {
+        while (!stop_.load()) {
+            // Poll so stop() is noticed without relying on shutdown() waking accept().
+            pollfd pfd{listen_fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 200) <= 0) continue;
+            const int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) continue;
+#ifdef SO_NOSIGPIPE
+            const int one = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                if ((int)conns_.size() >= max_conns_) {
+                    ::close(fd);
+                    continue;
+                }
+                conns_.insert(fd);
+            }
+            std::thread([this, fd] {
+                serve(fd);
+                std::lock_guard<std::mutex> lk(mu_);
+                conns_.erase(fd);
+                ::close(fd);
+                cv_.notify_all();
+            }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        // Peer hung up: POLLHUP once both directions are closed (what close() on
+        // the client does to a Unix socket), POLLRDHUP where available.
+        auto gone = [fd] {
+            pollfd pfd{fd, 0, 0};
+#ifdef POLLRDHUP
+            pfd.events = POLLRDHUP;
+#endif
+            return ::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR
+#ifdef POLLRDHUP
+                                                              | POLLRDHUP
+#endif
+                                                              )) != 0;
+        };
+        const std::function<bool()> client_gone = gone;
+        std::unique_ptr<SharedRegion> region;
+        int passed_fd = -1;
+        std::string payload, out;
+        char h[kFrameHeaderSize];
+        while (!stop_.load() && read_full(fd, h, sizeof(h), passed_fd)) {
+            uint32_t len = 0, id = 0;
+            uint16_t op = 0, flags = 0;
+            std::memcpy(&len, h + 4, 4);
+            std::memcpy(&id, h + 8, 4);
+            std::memcpy(&op, h + 12, 2);
+            std::memcpy(&flags, h + 14, 2);
+            uint16_t status;
+            bool keep = true;
+            out.clear();
+            if (std::memcmp(h, "RRF1", 4) != 0) {
+                status = 400;
+                out = R"({"error":"frame: bad magic, expected RRF1"})";
+                keep = false; // no way to find the next frame boundary
+            } else if (len > max_payload_) {
+                status = 413;
+                out = R"({"error":"frame: payload exceeds RERANK_FRAME_MAX_MB"})";
+                keep = false;
+            } else {
+                payload.resize(len);
+                if (!read_full(fd, &payload[0], len, passed_fd)) break;
+                if (op == kFrameOpAttach) {
+                    status = attach(passed_fd, region, out);
+                } else {
+                    status = handle_(FrameRequest{op, flags, payload, region.get(), client_gone}, out);
+                }
+            }
+            if (passed_fd >= 0) { // only attach frames keep a descriptor
+                ::close(passed_fd);
+                passed_fd = -1;
+            }
+            char rh[kFrameHeaderSize] = {'R', 'R', 'F', '1'};
+            const uint32_t out_len = (uint32_t)out.size();
+            std::memcpy(rh + 4, &out_len, 4);
+            std::memcpy(rh + 8, &id, 4);
+            std::memcpy(rh + 12, &status, 2);
+            if (!write_full(fd, rh, sizeof(rh)) || !write_full(fd, out.data(), out.size()) || !keep) break;
+        }
+        if (passed_fd >= 0) ::close(passed_fd);
+        if (region) regions_.fetch_sub(1);
+    }
+
+    uint16_t attach(int& passed_fd, std::unique_ptr<SharedRegion>& region, std::string& out) {
+        if (passed_fd < 0) {
+            out = R"({"error":"attach: no descriptor; send a memfd with SCM_RIGHTS"})";
+            return 400;
+        }
+        const int fd = passed_fd;
+        passed_fd = -1;
+        try {
+            std::unique_ptr<SharedRegion> r = map_shared_region(fd, max_region_);
+            ::close(fd);
+            if (!region) regions_.fetch_add(1);
+            region = std::move(r);
+        } catch (const std::exception& e) {
+            ::close(fd);
+            out = json{{"error", e.what()}}.dump();
+            return 400;
+        }
+        out = json{{"size", region->size}}.dump();
+        return 200;
+    }
+
+    std::string path_;
+    size_t max_payload_;
+    size_t max_region_;
+    int max_conns_;
+    Handler handle_;
+    int listen_fd_ = -1;
+    std::atomic<bool> stop_{false};
+    std::atomic<size_t> regions_{0};
+    std::thread accept_thread_;
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::set<int> conns_;
+};
+
+/* ===================== CLI / EP helpers ===================== */
+
+static void print_usage(const char* argv0) {
+    std::cerr
+        << "Usage:\n"
+        << "  " << argv0 << " [--ep cpu|coreml|cuda|tensorrt] [--model /path/to/model.onnx] [--tokenizer /path/to/tokenizer.json] [--list-ep]\n\n"
+        << "Env overrides:\n"
+        << "  RERANK_ONNX_PATH, RERANK_HTTP_HOST, RERANK_HTTP_PORT, RERANK_MAX_BATCH, RERANK_MAX_SEQ, ...\n\n"
+        << "Examples:\n"
+        << "  " << argv0 << " --model ./model.onnx\n"
+        << "  " << argv0 << " --ep coreml --model ./model.onnx\n"
+        << "  " << argv0 << " --ep tensorrt --model ./model.onnx\n"
+        << "  " << argv0 << " --list-ep\n";
+}
+
+static std::string to_lower(std::string s) {
+    for (auto& c : s) c = (char)std::tolower((unsigned char)c);
+    return s;
+}
+
+static void print_available_eps() {
+    const OrtApi* api = OrtGetApiBase()->GetApi(ORT_API_VERSION);
+
+    char** providers = nullptr;
+    int num = 0;
+
+    OrtStatus* st = api->GetAvailableProviders(&providers, &num);
+    if (st != nullptr) {
+        const char* msg = api->GetErrorMessage(st);
+        std::cerr << "❌ GetAvailableProviders failed: " << (msg ? msg : "(unknown)") << "\n";
+        api->ReleaseStatus(st);
+        return;
+    }
+
+    std::cerr << "Available Execution Providers:\n";
+    for (int i = 0; i < num; i++) {
+        const std::string name = providers[i] ? providers[i] : "";
+        const char* flag = name == "CPUExecutionProvider" ? "cpu"
+                         : name == "CoreMLExecutionProvider" ? "coreml"
+                         : name == "CUDAExecutionProvider" ? "cuda"
+                         : name == "TensorrtExecutionProvider" ? "tensorrt" : nullptr;
+        std::cerr << " - " << name;
+        if (flag) std::cerr << " (--ep " << flag << ")";
+        std::cerr << "\n";
+    }
+
+    OrtStatus* st2 = api->ReleaseAvailableProviders(providers, num);
+    if (st2 != nullptr) {
+        api->ReleaseStatus(st2);
+    }
+}
+
+struct CliOpts {
+    std::string ep = "cpu";   // see kEpChoices
+    std::string model;        // model path override
+    std::string tokenizer;    // tokenizer.json override
+    bool list_ep = false;
+    bool help = false;
+};
+
+static CliOpts parse_cli(int argc, char** argv) {
+    CliOpts o;
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if (std::strcmp(a, "-h") == 0 || std::strcmp(a, "--help") == 0) {
+            o.help = true;
+            continue;
+        }
+        if (std::strcmp(a, "--list-ep") == 0) {
+            o.list_ep = true;
+            continue;
+        }
+        if (std::strcmp(a, "--ep") == 0) {
+            if (i + 1 >= argc) throw std::runtime_error(std::string("--ep requires a value: ") + kEpChoices);
+            o.ep = to_lower(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(a, "--model") == 0) {
+            if (i + 1 >= argc) throw std::runtime_error("--model requires a value: /path/to/model.onnx");
+            o.model = std::string(argv[++i]);
+            continue;
+        }
+        if (std::strcmp(a, "--tokenizer") == 0) {
+            if (i + 1 >= argc) throw std::runtime_error("--tokenizer requires a value: /path/to/tokenizer.json");
+            o.tokenizer = std::string(argv[++i]);
+            continue;
+        }
+        o.help = true;
+    }
+    return o;
+}
+
+static void require_file_exists(const std::string& p) {
+    std::ifstream f(p);
+    if (!f.good()) {
+        throw std::runtime_error("model file not found or not readable: " + p);
+    }
+}
+
+/* ===================== CPU placement ===================== */
+
+struct CpuPlan {
+    std::string mode = "off"; // off | auto | manual
+    size_t numa_nodes = 0;
+    std::vector<CpuList> sessions; // session i -> sessions[i % size]
+    CpuList http;                  // HTTP, parsing and tokenizing; empty: unpinned
+};
+
+// RERANK_SESSION_CPUS: "" (off), "auto", or one list per session ("0-7;8-15").
+// auto spreads sessions round-robin over NUMA nodes, each taking intra_threads
+// free cores of its node. HTTP threads get RERANK_HTTP_CPUS, else every allowed
+// core that no session owns.
+static CpuPlan plan_cpus(const std::string& spec, const std::string& http_spec, int sessions, int intra_threads) {
+    CpuPlan p;
+    const std::vector<CpuList> nodes = numa_node_cpus();
+    p.numa_nodes = nodes.size();
+    const CpuList reserved = parse_cpu_list(http_spec);
+    if (spec == "auto" && !nodes.empty()) {
+        p.mode = "auto";
+        std::vector<CpuList> avail(nodes.size());
+        for (size_t n = 0; n < nodes.size(); n++) {
+            for (int c : nodes[n]) {
+                if (!std::binary_search(reserved.begin(), reserved.end(), c)) avail[n].push_back(c);
+            }
+        }
+        const size_t want = (size_t)std::max(1, intra_threads);
+        for (int i = 0; i < sessions; i++) {
+            CpuList set;
+            for (size_t k = 0; k < nodes.size() && set.empty(); k++) {
+                CpuList& a = avail[((size_t)i + k) % nodes.size()]; // spill to the next node with room
+                if (a.size() < want) continue;
+                set.assign(a.begin(), a.begin() + (std::ptrdiff_t)want);
+                a.erase(a.begin(), a.begin() + (std::ptrdiff_t)want);
+            }
+            if (set.empty()) {
+                std::cerr << "⚠️  RERANK_SESSION_CPUS=auto: no " << want << " free cores left for session " << i
+                          << "; it runs unpinned\n";
+            }
+            p.sessions.push_back(std::move(set));
+        }
+    } else if (!spec.empty() && spec != "auto") {
+        p.mode = "manual";
+        size_t pos = 0;
+        while (pos <= spec.size()) {
+            size_t end = spec.find(';', pos);
+            if (end == std::string::npos) end = spec.size();
+            CpuList set = parse_cpu_list(spec.substr(pos, end - pos));
+            if (!set.empty()) p.sessions.push_back(std::move(set));
+            pos = end + 1;
+        }
+    }
+
+    if (!reserved.empty()) {
+        p.http = reserved;
+    } else if (p.mode != "off") {
+        CpuList owned;
+        for (auto& set : p.sessions) owned.insert(owned.end(), set.begin(), set.end());
+        std::sort(owned.begin(), owned.end());
+        for (int c : allowed_cpus()) {
+            if (!std::binary_search(owned.begin(), owned.end(), c)) p.http.push_back(c);
+        }
+        if (p.http.empty()) {
+            std::cerr << "⚠️  Sessions own every core; HTTP threads run unpinned (lower RERANK_SESSIONS/RERANK_INTRA_THREADS or set RERANK_HTTP_CPUS)\n";
+        }
+    }
+    return p;
+}
+
+int main(int argc, char** argv) {
+    CliOpts cli;
+    try {
+        cli = parse_cli(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << "❌ " << e.what() << "\n";
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    if (cli.help) {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    if (cli.list_ep) {
+        print_available_eps();
+        return 0;
+    }
+
+    // Prefer: --model > env RERANK_ONNX_PATH > ./model.onnx
+    const std::string model_path =
+        (!cli.model.empty()) ? cli.model : getenv_or("RERANK_ONNX_PATH", "./model.onnx");
+
+    const std::string host = getenv_or("RERANK_HTTP_HOST", "127.0.0.1");
+    const int port = getenv_int_or("RERANK_HTTP_PORT", 8089);
+
+    const int intra_threads = getenv_int_or("RERANK_INTRA_THREADS", 1);
+    const int inter_threads = getenv_int_or("RERANK_INTER_THREADS", 1);
+
+    const int64_t max_batch = (int64_t)getenv_ll_or("RERANK_MAX_BATCH", 512);
+    const int64_t max_seq   = (int64_t)getenv_ll_or("RERANK_MAX_SEQ", 8192);
+
+    const int logits_index_default = getenv_int_or("RERANK_LOGITS_INDEX", 0);
+    const int64_t slow_ms = (int64_t)getenv_ll_or("RERANK_SLOW_MS", 300);
+
+    const int num_sessions = std::max(1, getenv_int_or("RERANK_SESSIONS", 1));
+    const bool allow_fp16_output = getenv_bool_or("RERANK_ALLOW_FP16_OUTPUT", true);
+
+    // Micro-batching: 0us still merges whatever is already queued behind a running batch.
+    const int64_t batch_window_us = (int64_t)getenv_ll_or("RERANK_BATCH_WINDOW_US", 0);
+    const token_t pad_id = (token_t)getenv_ll_or("RERANK_PAD_ID", 0);
+    // Rows are grouped by real length into these buckets; empty disables bucketing.
+    const std::vector<int64_t> len_buckets = parse_int_list(getenv_or("RERANK_LEN_BUCKETS", "64,128,256,512"));
+    // Adaptive limits: per bucket, RERANK_MAX_BATCH and RERANK_BATCH_WINDOW_US become
+    // ceilings (window: target/4 when unset) tuned to keep session.Run p95 under this.
+    BatchTuning batch_tuning;
+    batch_tuning.target_p95_ms = std::max(0.0, std::atof(getenv_or("RERANK_TARGET_P95_MS", "0").c_str()));
+    batch_tuning.window_max_us =
+        batch_window_us > 0 ? batch_window_us : (int64_t)(batch_tuning.target_p95_ms * 1000.0 / 4);
+    // Share of runs led by X-Rerank-Priority: batch work while interactive work also waits.
+    batch_tuning.batch_min_share = std::atof(getenv_or("RERANK_BATCH_MIN_SHARE", "0.1").c_str());
+    // Memory budget: activation bytes per run estimated from (B,S); the defaults
+    // fit an XLM-R large cross-encoder (hidden 1024, FFN 4096, 16 heads) in fp32.
+    batch_tuning.mem.run_bytes = std::max<int64_t>(0, (int64_t)getenv_ll_or("RERANK_MEM_RUN_MB", 0)) << 20;
+    batch_tuning.mem.token_bytes = std::max<int64_t>(1, (int64_t)getenv_ll_or("RERANK_MEM_TOKEN_KB", 32)) << 10;
+    batch_tuning.mem.attn_bytes = std::max<int64_t>(0, (int64_t)getenv_ll_or("RERANK_MEM_ATTN_BYTES", 128));
+    batch_tuning.mem.shrink_bytes = std::max<int64_t>(0, (int64_t)getenv_ll_or("RERANK_ARENA_SHRINK_MB", 0)) << 20;
+
+    // Row score cache; RERANK_CACHE_ENTRIES=0 disables it.
+    const int64_t cache_entries = (int64_t)getenv_ll_or("RERANK_CACHE_ENTRIES", 20000);
+    const int64_t cache_mb = (int64_t)getenv_ll_or("RERANK_CACHE_MB", 64);
+
+    // Native tokenizer for /v1/rerank_text: --tokenizer > env > tokenizer.json next to the model.
+    std::string tokenizer_path = !cli.tokenizer.empty() ? cli.tokenizer : getenv_or("RERANK_TOKENIZER_JSON", "");
+    const bool tokenizer_required = !tokenizer_path.empty();
+    if (tokenizer_path.empty()) {
+        const size_t slash = model_path.find_last_of('/');
+        tokenizer_path = (slash == std::string::npos ? std::string() : model_path.substr(0, slash + 1)) + "tokenizer.json";
+    }
+    const int64_t text_max_len = (int64_t)getenv_ll_or("RERANK_TEXT_MAX_LEN", 512);
+    const int tokenize_threads = std::max(1, getenv_int_or("RERANK_TOKENIZE_THREADS",
+        (int)std::min(8u, std::max(1u, std::thread::hardware_concurrency()))));
+
+    // /v1/rerank_stream: documents per job, default sub-batch, sub-batches in flight per job.
+    const int64_t stream_max_docs = (int64_t)getenv_ll_or("RERANK_STREAM_MAX_DOCS", 100000);
+    const int64_t stream_chunk = std::max<int64_t>(1, std::min<int64_t>(max_batch, getenv_ll_or("RERANK_STREAM_CHUNK", 128)));
+    const size_t stream_depth = (size_t)std::max(1, getenv_int_or("RERANK_STREAM_DEPTH", 2));
+
+    // Admission control. Scoring requests are capped below the HTTP thread count
+    // so control endpoints always find a free thread; rows waiting for a session
+    // are capped per model. Over either limit -> 429 + Retry-After.
+    const int http_threads = std::max(2, getenv_int_or("RERANK_HTTP_THREADS",
+        (int)std::max(8u, std::thread::hardware_concurrency())));
+    const int64_t http_queue = (int64_t)getenv_ll_or("RERANK_HTTP_QUEUE", 256);
+    const int64_t max_inflight = (int64_t)getenv_ll_or("RERANK_MAX_INFLIGHT", std::max(1, http_threads - 2));
+    const int64_t max_queue_rows = (int64_t)getenv_ll_or("RERANK_MAX_QUEUE_ROWS", 4 * max_batch);
+    const std::string retry_after = getenv_or("RERANK_RETRY_AFTER_SEC", "1");
+
+    // Deadlines: requests without one get this (0 = none); disconnected clients cancel their work.
+    // Longer timeouts are clamped: t0 + ms must not overflow steady_clock's nanoseconds.
+    constexpr int64_t kMaxTimeoutMs = 24ll * 3600 * 1000;
+    const int64_t default_timeout_ms = std::min(kMaxTimeoutMs, (int64_t)getenv_ll_or("RERANK_DEFAULT_TIMEOUT_MS", 0));
+    const bool cancel_on_disconnect = getenv_bool_or("RERANK_CANCEL_ON_DISCONNECT", true);
+
+    // Tracing: spans of every RERANK_TRACE_SAMPLE-th request (and all batch runs)
+    // into a ring of RERANK_TRACE_EVENTS; GET /admin/trace exports it.
+    const bool trace_on = getenv_bool_or("RERANK_TRACE", false);
+    const size_t trace_events = (size_t)std::max<long long>(1024, getenv_ll_or("RERANK_TRACE_EVENTS", 65536));
+    const uint32_t trace_sample = (uint32_t)std::max(1, getenv_int_or("RERANK_TRACE_SAMPLE", 1));
+    // POST /admin/profile: ORT profiler output dir and the longest window allowed.
+    const std::string profile_dir = getenv_or("RERANK_PROFILE_DIR", "/tmp");
+    const int64_t profile_max_sec = std::max<int64_t>(1, (int64_t)getenv_ll_or("RERANK_PROFILE_MAX_SEC", 60));
+
+    // Local transports: HTTP on a Unix socket instead of TCP, and/or the framed
+    // tensor protocol on its own Unix socket (HTTP stays up for health and admin).
+    const std::string http_unix_socket = getenv_or("RERANK_HTTP_UNIX_SOCKET", "");
+    const std::string frame_socket = getenv_or("RERANK_FRAME_SOCKET", "");
+    const int frame_max_conns = getenv_int_or("RERANK_FRAME_MAX_CONNS", 64);
+    const size_t frame_max_bytes = (size_t)std::max<long long>(1, getenv_ll_or("RERANK_FRAME_MAX_MB", 64)) << 20;
+    const size_t shm_max_bytes = (size_t)std::max<long long>(1, getenv_ll_or("RERANK_SHM_MAX_MB", 1024)) << 20;
+    const std::string listen_url = http_unix_socket.empty()
+        ? std::string("http://") + host + ":" + std::to_string(port) : "unix:" + http_unix_socket;
+
+    try {
+        require_file_exists(model_path);
+
+        // CPU arena: ORT's per-session default, or one arena on the Env with these settings.
+        const std::string cpu_arena = to_lower(getenv_or("RERANK_CPU_ARENA", "session"));
+        const std::string arena_extend = to_lower(getenv_or("RERANK_ARENA_EXTEND", "power_of_two"));
+        if (cpu_arena != "session" && cpu_arena != "shared") {
+            throw std::runtime_error("RERANK_CPU_ARENA: expected session|shared, got '" + cpu_arena + "'");
+        }
+        if (arena_extend != "power_of_two" && arena_extend != "same_as_requested") {
+            throw std::runtime_error("RERANK_ARENA_EXTEND: expected power_of_two|same_as_requested, got '" + arena_extend + "'");
+        }
+        ArenaOptions arena;
+        arena.same_as_requested = arena_extend == "same_as_requested";
+        arena.max_bytes = (size_t)std::max<long long>(0, getenv_ll_or("RERANK_ARENA_MAX_MB", 0)) << 20;
+        const bool shared_arena = cpu_arena == "shared";
+
+        // Pinning the main thread first means every thread it spawns (httplib's
+        // pool, tokenizer workers) inherits the HTTP set; session threads re-pin.
+        const CpuPlan cpu_plan = plan_cpus(getenv_or("RERANK_SESSION_CPUS", ""), getenv_or("RERANK_HTTP_CPUS", ""),
+                                           num_sessions, intra_threads);
+        if (cpu_plan.mode != "off") {
+            std::cerr << "📌 CPU placement (" << cpu_plan.mode << ", " << cpu_plan.numa_nodes << " NUMA node(s)):";
+            for (size_t i = 0; i < cpu_plan.sessions.size(); i++) {
+                std::cerr << " session " << i << " -> " << format_cpu_list(cpu_plan.sessions[i]) << ";";
+            }
+            std::cerr << " http -> " << (cpu_plan.http.empty() ? "unpinned" : format_cpu_list(cpu_plan.http)) << "\n";
+        }
+        if (!cpu_plan.http.empty() && !pin_current_thread(cpu_plan.http)) {
+            std::cerr << "⚠️  Could not pin HTTP threads to " << format_cpu_list(cpu_plan.http) << "\n";
+        }
+        TokenizePool tokenize_pool(tokenize_threads);
+
+        Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "rerank-http");
+        if (shared_arena) {
+            register_cpu_arena(env, arena);
+            std::cerr << "🧮 Shared CPU arena: extend=" << arena_extend << " max="
+                      << (arena.max_bytes ? std::to_string(arena.max_bytes >> 20) + "MB" : std::string("unlimited")) << "\n";
+        } else if (arena.same_as_requested || arena.max_bytes) {
+            std::cerr << "⚠️  RERANK_ARENA_EXTEND / RERANK_ARENA_MAX_MB apply to RERANK_CPU_ARENA=shared only\n";
+        }
+
+        if (cli.ep == "coreml") {
+            std::cerr << "⚙️  Execution Provider: CoreML (GPU/ANE)\n";
+        } else if (cli.ep == "cpu") {
+            std::cerr << "⚙️  Execution Provider: CPU\n";
+        } else if (cli.ep == "cuda") {
+            std::cerr << "⚙️  Execution Provider: CUDA\n";
+        } else if (cli.ep == "tensorrt") {
+            std::cerr << "⚙️  Execution Provider: TensorRT (CUDA fallback)\n";
+        } else {
+            throw std::runtime_error("unknown --ep value: " + cli.ep + " (expected " + kEpChoices + ")");
+        }
+
+        // GPU EPs: session i runs on RERANK_CUDA_DEVICES[i % n]. TensorRT engines are
+        // built per model and shape range; caching them turns a minutes-long start
+        // into a deserialize.
+        std::vector<int64_t> cuda_devices = parse_int_list(getenv_or("RERANK_CUDA_DEVICES", "0"));
+        if (cuda_devices.empty()) cuda_devices.push_back(0);
+        const std::string opt_cache_dir = getenv_or("RERANK_OPT_CACHE_DIR", "");
+        EpOptions gpu_options;
+        gpu_options.trt_fp16 = getenv_bool_or("RERANK_TRT_FP16", false);
+        gpu_options.trt_cache_dir = getenv_or("RERANK_TRT_CACHE_DIR", opt_cache_dir.empty() ? "" : opt_cache_dir + "/trt");
+        if (!gpu_options.trt_cache_dir.empty()) std::filesystem::create_directories(gpu_options.trt_cache_dir);
+
+        EngineConfig engine;
+        engine.sessions = num_sessions;
+        engine.max_batch = max_batch;
+        engine.window_us = batch_window_us;
+        engine.max_queue_rows = max_queue_rows;
+        engine.tuning = batch_tuning;
+        engine.pad_id = pad_id;
+        engine.len_buckets = len_buckets;
+        engine.cache_entries = cache_entries;
+        engine.cache_mb = cache_mb;
+        engine.logits_index = logits_index_default;
+        engine.allow_fp16_output = allow_fp16_output;
+        engine.ep = cli.ep;
+        engine.opt_cache_dir = opt_cache_dir;
+        engine.warmup_shapes = parse_shape_list(getenv_or("RERANK_WARMUP_SHAPES", "1x64,8x128"));
+        if (!engine.opt_cache_dir.empty()) std::filesystem::create_directories(engine.opt_cache_dir);
+        engine.session_cpus = cpu_plan.sessions;
+        engine.cuda_devices = cuda_devices;
+        engine.session_options = [&](int idx, const std::string& ep) {
+            EpOptions gpu = gpu_options;
+            gpu.device_id = (int)cuda_devices[(size_t)idx % cuda_devices.size()];
+            Ort::SessionOptions so = make_session_options(intra_threads, inter_threads, ep, gpu);
+            if (!cpu_plan.sessions.empty()) {
+                // ORT pins its intra-op pool threads; the batch worker (the calling thread) pins itself.
+                const std::string aff = ort_intra_affinities(cpu_plan.sessions[(size_t)idx % cpu_plan.sessions.size()], intra_threads);
+                if (!aff.empty()) so.AddConfigEntry("session.intra_op_thread_affinities", aff.c_str());
+            }
+            if (shared_arena) so.AddConfigEntry("session.use_env_allocators", "1");
+            return so;
+        };
+
+        Metrics metrics;
+        if (trace_on) {
+            metrics.trace.enable(true, trace_events, trace_sample);
+            std::cerr << "🧵 Tracing on: 1/" << trace_sample << " requests, " << metrics.trace.capacity() << " spans\n";
+        }
+        ModelRegistry registry;
+
+        // Startup models load after the listener is up (see below); until then
+        // /health reports ready=false and scoring endpoints return 503.
+        const std::string default_model = getenv_or("RERANK_MODEL_NAME", "default");
+        const auto extra_models = parse_model_list(getenv_or("RERANK_MODELS", ""));
+        for (auto& nm : extra_models) require_file_exists(nm.path);
+        // Per-model EP ("name=path@ep"); everything else is shared.
+        auto engine_for = [&](const std::string& ep) {
+            EngineConfig c = engine;
+            if (!ep.empty()) c.ep = ep;
+            return c;
+        };
+
+        // Bi-encoder behind /v1/embed*: RERANK_EMBED_MODEL=path[@ep], served as
+        // RERANK_EMBED_MODEL_NAME on the same batching and session machinery.
+        const std::string embed_model_name = getenv_or("RERANK_EMBED_MODEL_NAME", "embed");
+        const std::string embed_spec = getenv_or("RERANK_EMBED_MODEL", "");
+        const std::vector<ModelSpec> embed_models =
+            embed_spec.empty() ? std::vector<ModelSpec>{} : parse_model_list(embed_model_name + "=" + embed_spec);
+        for (auto& nm : embed_models) require_file_exists(nm.path);
+        const std::string embed_pooling = to_lower(getenv_or("RERANK_EMBED_POOLING", "mean"));
+        if (embed_pooling != "mean" && embed_pooling != "cls") {
+            throw std::runtime_error("RERANK_EMBED_POOLING: expected mean|cls, got '" + embed_pooling + "'");
+        }
+        const bool embed_normalize = getenv_bool_or("RERANK_EMBED_NORMALIZE", true);
+        auto embed_engine_for = [&](const std::string& ep) {
+            EngineConfig c = engine_for(ep);
+            c.embed = true;
+            c.pooling = embed_pooling == "cls" ? Pooling::kCls : Pooling::kMean;
+            c.normalize = embed_normalize;
+            return c;
+        };
+
+        // Shape routing over precision/EP variants: RERANK_ROUTE_VARIANTS names
+        // loaded models (the default included) to calibrate and route between.
+        const std::vector<std::string> route_variants = parse_name_list(getenv_or("RERANK_ROUTE_VARIANTS", ""));
+        const std::vector<int64_t> route_batches = parse_int_list(getenv_or("RERANK_ROUTE_BATCHES", "1,8,32"));
+        const std::vector<int64_t> route_seqs = parse_int_list(getenv_or("RERANK_ROUTE_SEQS", "64,128,256,512"));
+        const int route_iters = std::max(1, getenv_int_or("RERANK_ROUTE_ITERS", 3));
+        ShapeRouter router;
+        std::atomic<bool> ready{false};
+
+        std::unique_ptr<Tokenizer> tokenizer;
+        if (tokenizer_required || std::ifstream(tokenizer_path).good()) {
+            tokenizer = Tokenizer::load(tokenizer_path);
+            std::cerr << "✅ Loaded tokenizer: " << tokenizer_path << " (" << tokenizer->model_type()
+                      << ", vocab=" << tokenizer->vocab_size() << ", pad_id=" << tokenizer->pad_id() << ")\n";
+        } else {
+            std::cerr << "ℹ️  No tokenizer.json next to the model; /v1/rerank_text disabled\n";
+        }
+        // /v1/embed_text: RERANK_EMBED_TOKENIZER_JSON > tokenizer.json next to the embedding model > the one above.
+        std::unique_ptr<Tokenizer> embed_tokenizer_own;
+        if (!embed_models.empty()) {
+            std::string p = getenv_or("RERANK_EMBED_TOKENIZER_JSON", "");
+            const bool required = !p.empty();
+            if (p.empty()) {
+                const std::string& mp = embed_models[0].path;
+                const size_t slash = mp.find_last_of('/');
+                p = (slash == std::string::npos ? std::string() : mp.substr(0, slash + 1)) + "tokenizer.json";
+            }
+            if (required || (p != tokenizer_path && std::ifstream(p).good())) {
+                embed_tokenizer_own = Tokenizer::load(p);
+                std::cerr << "✅ Loaded embedding tokenizer: " << p << " (" << embed_tokenizer_own->model_type()
+                          << ", vocab=" << embed_tokenizer_own->vocab_size() << ")\n";
+            }
+        }
+        const Tokenizer* embed_tokenizer = embed_tokenizer_own ? embed_tokenizer_own.get() : tokenizer.get();
+
+        // token_type_ids for the document half of query-prefix requests; -1 follows the model/tokenizer.
+        const int64_t doc_type_id_env = (int64_t)getenv_ll_or("RERANK_DOC_TYPE_ID", -1);
+        auto doc_type_id_for = [&](const ModelInstance& m) -> token_t {
+            if (doc_type_id_env >= 0) return (token_t)doc_type_id_env;
+            return (m.has_tti && tokenizer) ? tokenizer->sequence_type_id(1) : 0;
+        };
+
+        // Resolves ?model= (empty: the default model, or the embedding model for the
+        // embed endpoints); writes a 404 (unknown) or 400 (wrong kind) and returns null.
+        auto resolve_model = [&](const httplib::Request& req, httplib::Response& res, bool embed = false) {
+            const std::string want = req.get_param_value("model");
+            std::shared_ptr<ModelInstance> m = registry.get(want.empty() && embed ? embed_model_name : want);
+            if (m && m->embed != embed) {
+                metrics.req_4xx.fetch_add(1, std::memory_order_relaxed);
+                json err;
+                err["error"] = "model '" + m->name + (m->embed ? "' is an embedding model; use /v1/embed"
+                                                               : "' is not an embedding model");
+                res.status = 400;
+                res.set_content(err.dump(), "application/json");
+                return std::shared_ptr<ModelInstance>();
+            }
+            if (!m && !ready.load(std::memory_order_acquire)) {
+                metrics.req_5xx.fetch_add(1, std::memory_order_relaxed);
+                res.status = 503;
+                res.set_header("Retry-After", "1");
+                res.set_content(R"({"error":"models are still loading"})", "application/json");
+            } else if (!m) {
+                metrics.req_4xx.fetch_add(1, std::memory_order_relaxed);
+                json err;
+                err["error"] = want.empty() && embed ? std::string("no embedding model loaded (set RERANK_EMBED_MODEL)")
+                                                     : "unknown model: " + want;
+                res.status = 404;
+                res.set_content(err.dump(), "application/json");
+            }
+            return m;
+        };
+
+        // Requests that did not pick a model go to the calibrated variant for
+        // their shape; an unloaded variant falls back to the resolved model.
+        auto route_shape = [&](std::shared_ptr<ModelInstance> m, int64_t B, int64_t S) {
+            if (!router.active()) return m;
+            std::shared_ptr<ModelInstance> v = registry.get(router.pick(B, S));
+            return v ? v : m;
+        };
+        auto route_model = [&](const httplib::Request& req, std::shared_ptr<ModelInstance> m, int64_t B, int64_t S) {
+            return req.has_param("model") ? m : route_shape(std::move(m), B, S);
+        };
+
+        // Deadline = tighter of X-Request-Timeout-Ms and body "timeout_ms" (else
+        // RERANK_DEFAULT_TIMEOUT_MS), measured from handler entry. Likewise the
+        // request is batch class if either X-Rerank-Priority or body "priority" says so.
+        auto make_control = [&](const httplib::Request& req, Clock::time_point t0, int64_t body_timeout_ms,
+                                const std::string& body_priority) {
+            int64_t ms = default_timeout_ms;
+            const int64_t hdr = req.has_header("X-Request-Timeout-Ms")
+                ? std::atoll(req.get_header_value("X-Request-Timeout-Ms").c_str()) : 0;
+            if (hdr > 0 || body_timeout_ms > 0) {
+                ms = (hdr > 0 && body_timeout_ms > 0) ? std::min(hdr, body_timeout_ms) : std::max(hdr, body_timeout_ms);
+            }
+            RequestControl ctl;
+            if (ms > 0) ctl.deadline = t0 + std::chrono::milliseconds(std::min(ms, kMaxTimeoutMs));
+            ctl.priority = std::max(parse_priority(req.get_header_value("X-Rerank-Priority")), parse_priority(body_priority));
+            ctl.trace_id = metrics.trace.request_id();
+            if (cancel_on_disconnect && req.is_connection_closed) {
+                ctl.client_gone = [&req] { return req.is_connection_closed(); };
+            }
+            return ctl;
+        };
+
+        // Admin endpoints require "Authorization: Bearer <RERANK_ADMIN_TOKEN>" when it is set.
+        const std::string admin_token = getenv_or("RERANK_ADMIN_TOKEN", "");
+        auto admin_ok = [&](const httplib::Request& req, httplib::Response& res) {
+            if (admin_token.empty() || req.get_header_value("Authorization") == "Bearer " + admin_token) return true;
+            res.status = 401;
+            res.set_content(R"({"error":"unauthorized"})", "application/json");
+            return false;
+        };
+
+        // Created before the routes so /health can report it; started next to the HTTP listener.
+        std::unique_ptr<FrameServer> frame_server;
+
+        httplib::Server app;
+        // Accepted connections beyond the pool wait in a bounded queue; past it httplib drops them.
+        app.new_task_queue = [&] { return new httplib::ThreadPool((size_t)http_threads, (size_t)std::max<int64_t>(0, http_queue)); };
+
+        // Basic request logging (off by default)
+        const bool access_log = getenv_bool_or("RERANK_ACCESS_LOG", false);
+        if (access_log) {
+            app.set_logger([](const httplib::Request& req, const httplib::Response& res) {
+                std::cerr << req.method << " " << req.path << " -> " << res.status << "\n";
+            });
+        }
+
+        // Per-model details for /health and /admin/models.
+        auto model_json = [&](const ModelInstance& m) {
+            json r;
+            r["name"] = m.name;
+            r["path"] = m.path;
+            r["ep"] = m.ep;
+            r["kind"] = m.embed ? "embed" : "rerank";
+            if (m.embed) {
+                r["embedding_dim"] = m.embed_dim;
+                r["pooling"] = m.binding.pooling == Pooling::kCls ? "cls" : "mean";
+                r["normalize"] = m.binding.normalize;
+            }
+            r["generation"] = m.generation;
+            r["load_sec"] = m.load_sec;
+            r["warmup_sec"] = m.warmup_sec;
+            r["opt_cache"] = m.opt_cache;
+            r["inputs"] = m.input_names;
+            r["outputs"] = m.output_names;
+            r["model_has_token_type_ids"] = m.has_tti;
+            r["input_dtypes"] = {
+                {"input_ids", dtype_name(m.binding.in_input_ids_type)},
+                {"attention_mask", dtype_name(m.binding.in_attention_mask_type)},
+            };
+            if (m.has_tti) r["input_dtypes"]["token_type_ids"] = dtype_name(m.binding.in_token_type_ids_type);
+
+            const double uptime_us = (double)std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - m.loaded_at).count();
+            json sessions = json::array();
+            for (size_t i = 0; i < m.pool.size(); i++) {
+                const PooledSession& ps = *m.pool[i];
+                const uint64_t busy_us = ps.busy_us.load(std::memory_order_relaxed);
+                sessions.push_back({
+                    {"id", i},
+                    {"busy", ps.busy.load(std::memory_order_relaxed)},
+                    {"runs", ps.runs.load(std::memory_order_relaxed)},
+                    {"busy_ms", busy_us / 1000},
+                    {"utilization", uptime_us > 0 ? (double)busy_us / uptime_us : 0.0},
+                    {"cpus", format_cpu_list(ps.cpus)},
+                });
+                if (ps.scratch.cuda_device >= 0) sessions.back()["cuda_device"] = ps.scratch.cuda_device;
+            }
+            r["sessions"] = { {"count", m.pool.size()}, {"pool", sessions} };
+            return r;
+        };
+
+        // The configuration half of /health never changes once the server is up;
+        // it is serialized on the first probe (the frame server exists by then)
+        // and spliced into every response.
+        std::once_flag health_static_once;
+        std::string health_static; // "key":value,... without the braces
+        auto health_static_part = [&]() -> const std::string& {
+            std::call_once(health_static_once, [&] {
+                json r;
+                r["limits"] = { {"max_batch", max_batch}, {"max_seq", max_seq} };
+                r["threads"] = { {"intra", intra_threads}, {"inter", inter_threads} };
+                json session_sets = json::array();
+                for (auto& set : cpu_plan.sessions) session_sets.push_back(format_cpu_list(set));
+                r["affinity"] = {
+                    {"mode", cpu_plan.mode}, {"numa_nodes", cpu_plan.numa_nodes},
+                    {"sessions", session_sets}, {"http", format_cpu_list(cpu_plan.http)},
+                };
+                r["cache"] = { {"enabled", cache_entries > 0 && cache_mb > 0}, {"max_entries", cache_entries}, {"max_mb", cache_mb} };
+                r["batching"] = {
+                    {"window_us", batch_window_us}, {"max_rows", max_batch}, {"len_buckets", len_buckets},
+                    {"target_p95_ms", batch_tuning.target_p95_ms}, {"batch_min_share", batch_tuning.batch_min_share},
+                };
+                r["admission"] = {
+                    {"http_threads", http_threads}, {"http_queue", http_queue},
+                    {"max_inflight", max_inflight}, {"max_queue_rows", max_queue_rows},
+                };
+                r["tokenizer"] = { {"loaded", tokenizer != nullptr} };
+                if (tokenizer) {
+                    r["tokenizer"]["path"] = tokenizer_path;
+                    r["tokenizer"]["vocab_size"] = tokenizer->vocab_size();
+                    r["tokenizer"]["default_max_length"] = text_max_len;
+                    r["tokenizer"]["threads"] = tokenize_threads;
+                }
+                r["ep"] = cli.ep;
+                r["listening"] = listen_url;
+                health_static = r.dump();
+                health_static = health_static.substr(1, health_static.size() - 2);
+            });
+            return health_static;
+        };
+
+        app.Get("/health", [&](const httplib::Request&, httplib::Response& res) {
+            const std::shared_ptr<ModelInstance> def = registry.get("");
+            json r;
+            r["ok"] = def != nullptr;
+            // ready: startup models loaded and warmed. Load balancers should gate on this.
+            r["ready"] = ready.load(std::memory_order_acquire);
+            if (!r["ready"].get<bool>()) res.status = 503;
+            // Top-level model fields describe the default model.
+            if (def) {
+                json d = model_json(*def);
+                r["model_path"] = def->path;
+                r["load_sec"] = def->load_sec;
+                r["warmup_sec"] = def->warmup_sec;
+                r["opt_cache"] = def->opt_cache;
+                for (const char* k : {"inputs", "outputs", "model_has_token_type_ids", "input_dtypes", "sessions"}) r[k] = d[k];
+            }
+            json models = json::object();
+            for (auto& m : registry.list()) {
+                models[m->name] = { {"path", m->path}, {"ep", m->ep}, {"generation", m->generation},
+                                    {"kind", m->embed ? "embed" : "rerank"} };
+                if (m->embed) models[m->name]["embedding_dim"] = m->embed_dim;
+            }
+            r["models"] = models;
+            r["default_model"] = registry.default_name();
+            r["embed_model"] = embed_models.empty() ? json(nullptr) : json(embed_model_name);
+            r["routing"] = router.table();
+            if (frame_server) {
+                r["frame"] = {
+                    {"socket", frame_server->path()}, {"connections", frame_server->connections()},
+                    {"max_connections", frame_max_conns}, {"max_payload_bytes", frame_max_bytes},
+                    {"shm_regions", frame_server->regions()}, {"shm_max_bytes", shm_max_bytes},
+                };
+            }
+            std::string body = r.dump();
+            body.back() = ',';
+            body += health_static_part();
+            body += '}';
+            metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+            res.set_content(std::move(body), "application/json");
+        });
+
+        // JSON by default; Prometheus text with ?format=prometheus or a text/plain /
+        // openmetrics Accept header (what Prometheus scrapers send).
+        app.Get("/metrics", [&](const httplib::Request& req, httplib::Response& res) {
+            // Cache and queue figures are summed over every loaded model.
+            int64_t class_rows[kPriorities] = {}, class_pieces[kPriorities] = {};
+            bool cache_on = false;
+            uint64_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+            size_t cache_entries_now = 0, cache_bytes_now = 0;
+            const auto models = registry.list();
+            for (auto& m : models) {
+                for (int c = 0; c < kPriorities; c++) {
+                    class_rows[c] += m->batcher->queued_rows(c);
+                    class_pieces[c] += m->batcher->queued_pieces(c);
+                }
+                if (!m->cache) continue;
+                size_t e = 0, by = 0;
+                m->cache->stats(e, by);
+                cache_on = true;
+                cache_entries_now += e;
+                cache_bytes_now += by;
+                cache_hits += m->cache->hits.load();
+                cache_misses += m->cache->misses.load();
+                cache_evictions += m->cache->evictions.load();
+            }
+            const int64_t queue_rows = class_rows[kPriorityInteractive] + class_rows[kPriorityBatch];
+            const int64_t queue_pieces = class_pieces[kPriorityInteractive] + class_pieces[kPriorityBatch];
+            int64_t rss = -1, peak_rss = -1;
+            process_memory(rss, peak_rss);
+            const std::vector<ArenaReport> arenas = collect_arena_stats(models, shared_arena);
+
+            const bool prom = req.get_param_value("format") == "prometheus" ||
+                              header_has(req, "Accept", "text/plain") ||
+                              header_has(req, "Accept", "application/openmetrics-text");
+            if (prom) {
+                std::string body;
+                body.reserve(16384);
+                for (auto& c : metrics.counters()) {
+                    append_prometheus_value(body, std::string("rerank_") + c.first, "counter", c.second);
+                }
+                append_prometheus_value(body, "rerank_models_loaded", "gauge", models.size());
+                append_prometheus_value(body, "rerank_queue_rows", "gauge", (uint64_t)std::max<int64_t>(0, queue_rows));
+                append_prometheus_value(body, "rerank_queue_pieces", "gauge", (uint64_t)std::max<int64_t>(0, queue_pieces));
+                body += "# TYPE rerank_priority_queue_rows gauge\n";
+                for (int c = 0; c < kPriorities; c++) {
+                    body += std::string("rerank_priority_queue_rows{priority=\"") + priority_name(c) + "\"} " +
+                            std::to_string(std::max<int64_t>(0, class_rows[c])) + "\n";
+                }
+                body += "# TYPE rerank_priority_queue_pieces gauge\n";
+                for (int c = 0; c < kPriorities; c++) {
+                    body += std::string("rerank_priority_queue_pieces{priority=\"") + priority_name(c) + "\"} " +
+                            std::to_string(std::max<int64_t>(0, class_pieces[c])) + "\n";
+                }
+                append_prometheus_value(body, "rerank_inflight_requests", "gauge", (uint64_t)std::max<int64_t>(0, metrics.inflight.load()));
+                if (cache_on) {
+                    append_prometheus_value(body, "rerank_cache_hits", "counter", cache_hits);
+                    append_prometheus_value(body, "rerank_cache_misses", "counter", cache_misses);
+                    append_prometheus_value(body, "rerank_cache_evictions", "counter", cache_evictions);
+                    append_prometheus_value(body, "rerank_cache_entries", "gauge", cache_entries_now);
+                    append_prometheus_value(body, "rerank_cache_bytes", "gauge", cache_bytes_now);
+                }
+                for (auto& h : metrics.histograms()) {
+                    const std::string name = std::string("rerank_") + h.name + (h.seconds ? "_seconds" : "");
+                    append_prometheus_histogram(body, name, *h.h, h.seconds);
+                }
+                // Current per-bucket limits (the static ones unless RERANK_TARGET_P95_MS is set).
+                body += "# TYPE rerank_batch_max_rows gauge\n";
+                for (auto& m : models) {
+                    const auto& edges = m->batcher->bucket_edges();
+                    for (size_t b = 0; b < edges.size(); b++) {
+                        body += "rerank_batch_max_rows" + batch_bucket_labels(m->name, edges[b]) + " " +
+                                std::to_string(m->batcher->controller().max_rows(b)) + "\n";
+                    }
+                }
+                body += "# TYPE rerank_batch_window_us gauge\n";
+                for (auto& m : models) {
+                    const auto& edges = m->batcher->bucket_edges();
+                    for (size_t b = 0; b < edges.size(); b++) {
+                        body += "rerank_batch_window_us" + batch_bucket_labels(m->name, edges[b]) + " " +
+                                std::to_string(m->batcher->controller().window_us(b)) + "\n";
+                    }
+                }
+                if (rss >= 0) append_prometheus_value(body, "rerank_process_resident_bytes", "gauge", (uint64_t)rss);
+                if (peak_rss >= 0) append_prometheus_value(body, "rerank_process_peak_resident_bytes", "gauge", (uint64_t)peak_rss);
+                const std::pair<const char*, int64_t ArenaStats::*> arena_gauges[] = {
+                    {"rerank_arena_in_use_bytes", &ArenaStats::in_use},
+                    {"rerank_arena_reserved_bytes", &ArenaStats::reserved},
+                    {"rerank_arena_peak_bytes", &ArenaStats::peak},
+                };
+                for (auto& g : arena_gauges) {
+                    if (arenas.empty()) break;
+                    body += std::string("# TYPE ") + g.first + " gauge\n";
+                    for (auto& a : arenas) {
+                        const int64_t v = a.stats.*g.second;
+                        if (v < 0) continue;
+                        body += std::string(g.first) + "{model=\"" + a.model + "\",session=\"" + a.session + "\",device=\"" +
+                                a.device + "\"} " + std::to_string(v) + "\n";
                     }
-                } else {
-                    throw std::runtime_error("unexpected output dtype (expected float32; enable fp16 via RERANK_ALLOW_FP16_OUTPUT=1 if needed)");
                 }
+                metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                res.set_content(body, "text/plain; version=0.0.4");
+                return;
+            }
+
+            std::string body;
+            body.reserve(4096);
+            JsonWriter w(body);
+            w.begin_object();
+            for (auto& c : metrics.counters()) w.key(c.first).value(c.second);
+            w.key("models_loaded").value(models.size());
+            w.key("queue_rows").value(queue_rows);
+            w.key("queue_pieces").value(queue_pieces);
+            w.key("queue_by_priority").begin_object();
+            for (int c = 0; c < kPriorities; c++) {
+                w.key(priority_name(c)).begin_object();
+                w.key("rows").value(class_rows[c]).key("pieces").value(class_pieces[c]);
+                w.end_object();
+            }
+            w.end_object();
+            w.key("inflight_requests").value(metrics.inflight.load());
+            if (cache_on) {
+                w.key("cache_hits").value(cache_hits);
+                w.key("cache_misses").value(cache_misses);
+                w.key("cache_evictions").value(cache_evictions);
+                w.key("cache_entries").value(cache_entries_now);
+                w.key("cache_bytes").value(cache_bytes_now);
+            }
+            // Durations in microseconds; quantiles are bucket upper bounds.
+            w.key("histograms").begin_object();
+            for (auto& h : metrics.histograms()) {
+                w.key(std::string(h.name) + (h.seconds ? "_us" : ""));
+                write_histogram(w, *h.h);
+            }
+            w.end_object();
+            w.key("batch_limits").begin_object();
+            for (auto& m : models) {
+                w.key(m->name);
+                write_batch_limits(w, *m->batcher);
+            }
+            w.end_object();
+            // Bytes; -1 where the platform or allocator does not report a figure.
+            w.key("memory").begin_object();
+            w.key("rss").value(rss).key("peak_rss").value(peak_rss);
+            w.key("run_budget").value(batch_tuning.mem.run_bytes).key("cpu_arena").value(cpu_arena);
+            w.key("arenas").begin_array();
+            for (auto& a : arenas) {
+                w.begin_object().key("model").value(a.model).key("session").value(a.session).key("device").value(a.device)
+                    .key("in_use").value(a.stats.in_use).key("reserved").value(a.stats.reserved)
+                    .key("peak").value(a.stats.peak).key("extensions").value(a.stats.extensions)
+                    .key("shrinkages").value(a.stats.shrinkages).end_object();
+            }
+            w.end_array();
+            w.end_object();
+            w.end_object();
+            metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+            res.set_content(std::move(body), "application/json");
+        });
+
+        app.Post("/v1/rerank", [&](const httplib::Request& req, httplib::Response& res) {
+            metrics.req_total.fetch_add(1, std::memory_order_relaxed);
+            metrics.bytes_in.fetch_add((uint64_t)req.body.size(), std::memory_order_relaxed);
 
-                json resp;
-                resp["scores"] = scores;
+            auto t0 = Clock::now();
 
-                std::string body = resp.dump();
+            auto fail = [&](int status, const std::string& msg) {
+                metrics.count_failure(status);
+                std::string body = json{{"error", msg}}.dump();
                 metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                res.status = status;
                 res.set_content(body, "application/json");
+            };
+
+            // Held until the response is built, so a concurrent reload cannot tear it down.
+            std::shared_ptr<ModelInstance> model = resolve_model(req, res);
+            if (!model) return;
+
+            try {
+                InflightSlot slot(metrics.inflight, max_inflight);
+                if (req.body.empty()) throw std::runtime_error("empty body");
+
+                const bool tensor_in = header_has(req, "Content-Type", kTensorContentType);
+                const bool raw_out = header_has(req, "Accept", kScoresContentType);
+
+                // Per-handler-thread decode buffers, reused across requests.
+                thread_local RerankRequest rr;
+                rr.reset();
+                if (tensor_in) {
+                    metrics.req_tensor.fetch_add(1, std::memory_order_relaxed);
+                    parse_tensor_request(req.body.data(), req.body.size(), max_batch, max_seq, rr);
+                } else {
+                    parse_json_request(req.body, max_batch, max_seq, pad_id, doc_type_id_for(*model), rr);
+                }
+                read_selection_params(req, rr.select);
+                metrics.parse_us.observe((uint64_t)rr.parse_us);
+                metrics.validate_us.observe((uint64_t)rr.validate_us);
+                const int64_t B = rr.tokens.B, S = rr.tokens.S;
+                metrics.input_tokens.fetch_add((uint64_t)B * (uint64_t)S, std::memory_order_relaxed);
+                model = route_model(req, std::move(model), B, S);
+
+                // If model expects token_type_ids but request doesn't send it, zeros are supplied at run time.
+                const bool supply_tti = model->has_tti;
+
+                const RequestControl ctl = make_control(req, t0, rr.timeout_ms, rr.priority);
+                const ScoreResult sr = score_with_cache(*model->batcher, model->cache.get(), rr.tokens, ctl);
+                const std::vector<float>& scores = sr.scores;
+                const int64_t K = sr.K;
+                const int et = sr.dtype;
+
+                const auto t_ser = Clock::now();
+                std::string body;
+                const char* content_type = raw_out ? kScoresContentType : "application/json";
+                if (rr.select.active()) {
+                    // Only the selected rows, best first.
+                    const std::vector<size_t> top = select_top(scores, rr.select);
+                    if (raw_out) {
+                        body.resize(top.size() * 8);
+                        char* p = &body[0];
+                        for (size_t i = 0; i < top.size(); i++, p += 8) {
+                            const uint32_t idx = (uint32_t)top[i];
+                            std::memcpy(p, &idx, 4);
+                            std::memcpy(p + 4, &scores[top[i]], 4);
+                        }
+                    } else {
+                        body.reserve(16 + top.size() * 32);
+                        JsonWriter w(body);
+                        w.begin_object().key("results").begin_array();
+                        for (size_t i : top) w.begin_object().key("index").value(i).key("score").value(scores[i]).end_object();
+                        w.end_array().end_object();
+                    }
+                } else if (raw_out) {
+                    body.assign(reinterpret_cast<const char*>(scores.data()), scores.size() * sizeof(float));
+                } else {
+                    body.reserve(16 + scores.size() * 12);
+                    JsonWriter(body).begin_object().key("scores").floats(scores.data(), scores.size()).end_object();
+                }
+                metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                res.set_content(std::move(body), content_type);
                 metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                metrics.serialize_us.observe_since(t_ser);
+                metrics.total_us.observe_since(t0);
+                trace_request(metrics.trace, ctl.trace_id, "rerank", t0,
+                              {{"parse", rr.parse_us}, {"validate", rr.validate_us}}, t_ser, B, S);
 
                 auto t1 = Clock::now();
                 auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
@@ -591,34 +4137,731 @@ int main(int argc, char** argv) {
                     std::cerr << "⚠️  slow rerank: " << ms << "ms"
                               << " B=" << B << " S=" << S
                               << " K=" << K
-                              << " dtype=" << (int)et
+                              << " dtype=" << et
                               << " tti=" << (supply_tti ? "1" : "0")
-                              << " ep=" << cli.ep
+                              << " ep=" << model->ep
+                              << " model=" << model->name
                               << "\n";
                 }
 
-            } catch (const Ort::Exception& e) {
-                metrics.ort_fail.fetch_add(1, std::memory_order_relaxed);
-                metrics.req_5xx.fetch_add(1, std::memory_order_relaxed);
+            } catch (const std::exception&) {
+                const RequestError err = current_request_error(metrics);
+                if (err.status == 429) res.set_header("Retry-After", retry_after);
+                fail(err.status, err.message);
+            }
+        });
+
+        // Text in, scores out: tokenizes query/document pairs here instead of in rerank-proxy.
+        app.Post("/v1/rerank_text", [&](const httplib::Request& req, httplib::Response& res) {
+            metrics.req_total.fetch_add(1, std::memory_order_relaxed);
+            metrics.req_text.fetch_add(1, std::memory_order_relaxed);
+            metrics.bytes_in.fetch_add((uint64_t)req.body.size(), std::memory_order_relaxed);
+
+            auto t0 = Clock::now();
+
+            auto fail = [&](int status, const std::string& msg) {
+                metrics.count_failure(status);
                 json err;
-                err["error"] = std::string("onnxruntime: ") + e.what();
+                err["error"] = msg;
                 std::string body = err.dump();
                 metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
-                res.status = 500;
+                res.status = status;
                 res.set_content(body, "application/json");
-            } catch (const std::exception& e) {
-                metrics.req_4xx.fetch_add(1, std::memory_order_relaxed);
-                json err;
-                err["error"] = e.what();
-                std::string body = err.dump();
+            };
+
+            if (!tokenizer) {
+                fail(503, "no tokenizer loaded (set RERANK_TOKENIZER_JSON or --tokenizer)");
+                return;
+            }
+            std::shared_ptr<ModelInstance> model = resolve_model(req, res);
+            if (!model) return;
+
+            try {
+                InflightSlot slot(metrics.inflight, max_inflight);
+                if (req.body.empty()) throw std::runtime_error("empty body");
+                TextRequest tr = parse_text_request(req.body, max_batch);
+                read_selection_params(req, tr.select);
+                metrics.parse_us.observe_since(t0);
+
+                const int64_t max_len = std::min<int64_t>(
+                    std::max<int64_t>(1, tr.max_length > 0 ? tr.max_length : text_max_len),
+                    std::min<int64_t>(4096, max_seq));
+
+                const auto t_tok = Clock::now();
+                thread_local RerankRequest rr;
+                rr.reset();
+                tokenize_pairs(*tokenizer, tr, (size_t)max_len, tokenize_pool, max_seq, rr);
+                const double tok_sec = std::chrono::duration<double>(Clock::now() - t_tok).count();
+                metrics.tokenize_us.observe_since(t_tok);
+                const int64_t B = rr.tokens.B, S = rr.tokens.S;
+                metrics.input_tokens.fetch_add((uint64_t)B * (uint64_t)S, std::memory_order_relaxed);
+                model = route_model(req, std::move(model), B, S);
+
+                const auto t_run = Clock::now();
+                const RequestControl ctl = make_control(req, t0, tr.timeout_ms, tr.priority);
+                const ScoreResult sr = score_with_cache(*model->batcher, model->cache.get(), rr.tokens, ctl);
+                const double run_sec = std::chrono::duration<double>(Clock::now() - t_run).count();
+
+                const auto t_ser = Clock::now();
+                const std::vector<size_t> ranked = select_top(sr.scores, tr.select);
+                std::string body;
+                size_t doc_bytes = 0;
+                for (size_t i : ranked) doc_bytes += tr.documents[i].size();
+                body.reserve(128 + sr.scores.size() * 12 + ranked.size() * 8 + doc_bytes + doc_bytes / 8);
+                JsonWriter w(body);
+                w.begin_object();
+                w.key("scores").floats(sr.scores.data(), sr.scores.size());
+                w.key("ranked_indices").values(ranked.begin(), ranked.end());
+                w.key("ranked_documents").begin_array();
+                for (size_t i : ranked) w.value(tr.documents[i]);
+                w.end_array();
+                w.key("meta").begin_object()
+                    .key("model").value(model->name)
+                    .key("B").value(B)
+                    .key("S").value(S)
+                    .key("max_length").value(max_len)
+                    .key("timing_sec").begin_object().key("tokenize").value(tok_sec).key("rerank").value(run_sec).end_object()
+                    .end_object();
+                w.end_object();
                 metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
-                res.status = 400;
+                res.set_content(std::move(body), "application/json");
+                metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                metrics.serialize_us.observe_since(t_ser);
+                metrics.total_us.observe_since(t0);
+                trace_request(metrics.trace, ctl.trace_id, "rerank_text", t0,
+                              {{"parse", std::chrono::duration_cast<std::chrono::microseconds>(t_tok - t0).count()},
+                               {"tokenize", (int64_t)(tok_sec * 1e6)}}, t_ser, B, S);
+
+                auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - t0).count();
+                if (ms >= slow_ms) {
+                    metrics.slow_req.fetch_add(1, std::memory_order_relaxed);
+                    std::cerr << "⚠️  slow rerank_text: " << ms << "ms"
+                              << " B=" << B << " S=" << S
+                              << " tokenize_ms=" << (int64_t)(tok_sec * 1000)
+                              << " ep=" << model->ep
+                              << " model=" << model->name
+                              << "\n";
+                }
+
+            } catch (const std::exception&) {
+                const RequestError err = current_request_error(metrics);
+                if (err.status == 429) res.set_header("Retry-After", retry_after);
+                fail(err.status, err.message);
+            }
+        });
+
+        // Bi-encoder embeddings on the embedding model (?model= picks another one).
+        // /v1/embed takes token ids like /v1/rerank (JSON "input_ids"/"attention_mask"
+        // or an x-rerank-tensor body); /v1/embed_text takes {"input": str | [str]}.
+        // JSON out is {"dim": H, "embeddings": [[...], ...]} ("embedding" for a single
+        // string input); Accept: application/octet-stream returns packed row-major
+        // [B, H] float32, or IEEE half with ?dtype=fp16, plus an X-Embedding-Dim header.
+        auto embed_handler = [&](bool text) {
+            return [&, text](const httplib::Request& req, httplib::Response& res) {
+                metrics.req_total.fetch_add(1, std::memory_order_relaxed);
+                metrics.req_embed.fetch_add(1, std::memory_order_relaxed);
+                metrics.bytes_in.fetch_add((uint64_t)req.body.size(), std::memory_order_relaxed);
+
+                auto t0 = Clock::now();
+
+                auto fail = [&](int status, const std::string& msg) {
+                    metrics.count_failure(status);
+                    json err;
+                    err["error"] = msg;
+                    std::string body = err.dump();
+                    metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                    res.status = status;
+                    res.set_content(body, "application/json");
+                };
+
+                if (text && !embed_tokenizer) {
+                    fail(503, "no tokenizer loaded (set RERANK_EMBED_TOKENIZER_JSON)");
+                    return;
+                }
+                std::shared_ptr<ModelInstance> model = resolve_model(req, res, true);
+                if (!model) return;
+
+                try {
+                    InflightSlot slot(metrics.inflight, max_inflight);
+                    if (req.body.empty()) throw std::runtime_error("empty body");
+                    const bool raw_out = header_has(req, "Accept", kScoresContentType);
+                    const std::string dtype = req.has_param("dtype") ? req.get_param_value("dtype") : "fp32";
+                    if (dtype != "fp32" && dtype != "fp16") throw std::runtime_error("dtype must be fp32 or fp16");
+
+                    thread_local RerankRequest rr;
+                    rr.reset();
+                    bool single = false;
+                    if (text) {
+                        EmbedTextRequest er = parse_embed_text_request(req.body, max_batch);
+                        metrics.parse_us.observe_since(t0);
+                        const int64_t max_len = std::min<int64_t>(
+                            std::max<int64_t>(1, er.max_length > 0 ? er.max_length : text_max_len),
+                            std::min<int64_t>(4096, max_seq));
+                        const auto t_tok = Clock::now();
+                        tokenize_singles(*embed_tokenizer, er.inputs, (size_t)max_len, tokenize_pool, max_seq, rr);
+                        metrics.tokenize_us.observe_since(t_tok);
+                        // Reported as the parse / tokenize trace spans.
+                        rr.parse_us = std::chrono::duration_cast<std::chrono::microseconds>(t_tok - t0).count();
+                        rr.validate_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t_tok).count();
+                        single = er.single;
+                        rr.timeout_ms = er.timeout_ms;
+                        rr.priority = er.priority;
+                    } else if (header_has(req, "Content-Type", kTensorContentType)) {
+                        metrics.req_tensor.fetch_add(1, std::memory_order_relaxed);
+                        parse_tensor_request(req.body.data(), req.body.size(), max_batch, max_seq, rr);
+                    } else {
+                        parse_json_request(req.body, max_batch, max_seq, pad_id, 0, rr);
+                    }
+                    if (!text) {
+                        metrics.parse_us.observe((uint64_t)rr.parse_us);
+                        metrics.validate_us.observe((uint64_t)rr.validate_us);
+                    }
+                    const int64_t B = rr.tokens.B, S = rr.tokens.S;
+                    metrics.input_tokens.fetch_add((uint64_t)B * (uint64_t)S, std::memory_order_relaxed);
+
+                    const RequestControl ctl = make_control(req, t0, rr.timeout_ms, rr.priority);
+                    const ScoreResult emb = embed_rows(*model->batcher, model->embed_dim, rr.tokens, ctl);
+                    const int64_t H = emb.width;
+
+                    const auto t_ser = Clock::now();
+                    std::string body;
+                    if (raw_out) {
+                        body.reserve(emb.scores.size() * sizeof(float));
+                        append_packed_floats(body, emb.scores.data(), emb.scores.size(), dtype == "fp16");
+                        res.set_header("X-Embedding-Dim", std::to_string(H));
+                        res.set_header("X-Embedding-Dtype", dtype);
+                    } else {
+                        body.reserve(64 + emb.scores.size() * 12);
+                        JsonWriter w(body);
+                        w.begin_object();
+                        w.key("model").value(model->name);
+                        w.key("dim").value(H);
+                        if (single) {
+                            w.key("embedding").floats(emb.scores.data(), (size_t)H);
+                        } else {
+                            w.key("embeddings").begin_array();
+                            for (int64_t i = 0; i < B; i++) w.floats(emb.scores.data() + (size_t)(i * H), (size_t)H);
+                            w.end_array();
+                        }
+                        w.end_object();
+                    }
+                    metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                    res.set_content(std::move(body), raw_out ? kScoresContentType : "application/json");
+                    metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                    metrics.serialize_us.observe_since(t_ser);
+                    metrics.total_us.observe_since(t0);
+                    trace_request(metrics.trace, ctl.trace_id, text ? "embed_text" : "embed", t0,
+                                  {{"parse", rr.parse_us}, {text ? "tokenize" : "validate", rr.validate_us}}, t_ser, B, S);
+
+                    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - t0).count();
+                    if (ms >= slow_ms) {
+                        metrics.slow_req.fetch_add(1, std::memory_order_relaxed);
+                        std::cerr << "⚠️  slow embed: " << ms << "ms B=" << B << " S=" << S
+                                  << " ep=" << model->ep << " model=" << model->name << "\n";
+                    }
+
+                } catch (const std::exception&) {
+                    const RequestError err = current_request_error(metrics);
+                    if (err.status == 429) res.set_header("Retry-After", retry_after);
+                    fail(err.status, err.message);
+                }
+            };
+        };
+        app.Post("/v1/embed", embed_handler(false));
+        app.Post("/v1/embed_text", embed_handler(true));
+
+        // One large text job, scored as sub-batches of `chunk` documents and
+        // streamed back as NDJSON in order. Up to RERANK_STREAM_DEPTH sub-batches
+        // are tokenized/queued ahead of the one being written, so the sessions
+        // never wait on tokenization and memory stays bounded per job.
+        //   {"offset": 0, "scores": [...]}\n ... {"done": true, "count": N, ...}\n
+        // Failures after the first line arrive as a final {"error": ..., "offset": k}.
+        app.Post("/v1/rerank_stream", [&](const httplib::Request& req, httplib::Response& res) {
+            metrics.req_total.fetch_add(1, std::memory_order_relaxed);
+            metrics.req_stream.fetch_add(1, std::memory_order_relaxed);
+            metrics.bytes_in.fetch_add((uint64_t)req.body.size(), std::memory_order_relaxed);
+
+            const auto t0 = Clock::now();
+
+            auto fail = [&](int status, const std::string& msg) {
+                metrics.count_failure(status);
+                std::string body = json{{"error", msg}}.dump();
+                metrics.bytes_out.fetch_add((uint64_t)body.size(), std::memory_order_relaxed);
+                res.status = status;
                 res.set_content(body, "application/json");
+            };
+
+            if (!tokenizer) {
+                fail(503, "no tokenizer loaded (set RERANK_TOKENIZER_JSON or --tokenizer)");
+                return;
+            }
+            std::shared_ptr<ModelInstance> model = resolve_model(req, res);
+            if (!model) return;
+
+            // Outlives the handler: the content provider runs after it returns.
+            struct StreamState {
+                std::unique_ptr<InflightSlot> slot;
+                TextRequest tr;
+                RequestControl ctl;
+                size_t chunk = 0;
+                size_t max_len = 0;
+                size_t next = 0; // first document not yet submitted
+                size_t sent = 0; // scores written so far
+                std::deque<std::future<std::vector<float>>> ahead;
+                ~StreamState() { for (auto& f : ahead) if (f.valid()) f.wait(); }
+            };
+            auto st = std::make_shared<StreamState>();
+            try {
+                st->slot = std::make_unique<InflightSlot>(metrics.inflight, max_inflight);
+                if (req.body.empty()) throw std::runtime_error("empty body");
+                st->tr = parse_text_request(req.body, stream_max_docs);
+                metrics.parse_us.observe_since(t0);
+                st->chunk = (size_t)(st->tr.chunk > 0 ? std::min(st->tr.chunk, max_batch) : stream_chunk);
+                st->max_len = (size_t)std::min<int64_t>(
+                    std::max<int64_t>(1, st->tr.max_length > 0 ? st->tr.max_length : text_max_len),
+                    std::min<int64_t>(4096, max_seq));
+                st->ctl = make_control(req, t0, st->tr.timeout_ms, st->tr.priority);
+            } catch (const std::exception&) {
+                const RequestError err = current_request_error(metrics);
+                if (err.status == 429) res.set_header("Retry-After", retry_after);
+                fail(err.status, err.message);
+                return;
+            }
+
+            // Tokenizes and scores documents [begin, begin + chunk) on the tokenizer
+            // pool. Tasks borrow the state: ~StreamState waits for them, and runs
+            // when the provider is dropped, before req goes away.
+            auto launch = [&, st, model](size_t begin) {
+                auto sub = std::make_shared<TextRequest>();
+                sub->query = st->tr.query;
+                const size_t end = std::min(st->tr.documents.size(), begin + st->chunk);
+                for (size_t i = begin; i < end; i++) sub->documents.push_back(std::move(st->tr.documents[i]));
+                return tokenize_pool.submit([&, st = st.get(), model, sub] {
+                    const auto t_tok = Clock::now();
+                    RerankRequest rr;
+                    tokenize_pairs(*tokenizer, *sub, st->max_len, tokenize_pool, max_seq, rr);
+                    metrics.tokenize_us.observe_since(t_tok);
+                    metrics.input_tokens.fetch_add((uint64_t)(rr.tokens.B * rr.tokens.S), std::memory_order_relaxed);
+                    const std::shared_ptr<ModelInstance> m = route_model(req, model, rr.tokens.B, rr.tokens.S);
+                    return score_with_cache(*m->batcher, m->cache.get(), rr.tokens, st->ctl).scores;
+                });
+            };
+
+            res.set_chunked_content_provider("application/x-ndjson",
+                [&, st, launch, model, t0](size_t, httplib::DataSink& sink) {
+                    const size_t N = st->tr.documents.size();
+                    while (st->ahead.size() < stream_depth && st->next < N) {
+                        st->ahead.push_back(launch(st->next));
+                        st->next += st->chunk;
+                    }
+                    std::string line;
+                    bool last = false;
+                    if (st->ahead.empty()) {
+                        const double sec = std::chrono::duration<double>(Clock::now() - t0).count();
+                        line = json{{"done", true}, {"count", st->sent}, {"model", model->name},
+                                    {"chunk", st->chunk}, {"timing_sec", sec}}.dump();
+                        metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                        metrics.total_us.observe_since(t0);
+                        last = true;
+                    } else {
+                        try {
+                            std::vector<float> scores = st->ahead.front().get();
+                            st->ahead.pop_front();
+                            line.reserve(32 + scores.size() * 12);
+                            JsonWriter(line).begin_object().key("offset").value(st->sent)
+                                .key("scores").floats(scores.data(), scores.size()).end_object();
+                            st->sent += scores.size();
+                            metrics.stream_chunks.fetch_add(1, std::memory_order_relaxed);
+                        } catch (const std::exception&) {
+                            // The 200 is already out, so any failure here ends the stream as a 5xx.
+                            const RequestError err = current_request_error(metrics);
+                            if (err.status == 499) return false;
+                            metrics.req_5xx.fetch_add(1, std::memory_order_relaxed);
+                            st->ahead.pop_front();
+                            line = json{{"error", err.message}, {"offset", st->sent}}.dump();
+                            last = true;
+                        }
+                    }
+                    line += '\n';
+                    metrics.bytes_out.fetch_add((uint64_t)line.size(), std::memory_order_relaxed);
+                    if (!sink.write(line.data(), line.size())) return false;
+                    if (last) sink.done();
+                    return true;
+                });
+        });
+
+        // Model admin: list, (re)load in the background, unload.
+        app.Get("/admin/models", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            json r = registry.status();
+            json models = json::array();
+            for (auto& m : registry.list()) models.push_back(model_json(*m));
+            r["models"] = models;
+            res.set_content(r.dump(), "application/json");
+        });
+
+        // {"name": "fp16", "path": "/models/model_fp16.onnx", "default": false, "kind": "rerank"}
+        // Omitting path (or kind) reloads the model's current file (as the same kind). The new instance is built
+        // and warmed off to the side; the swap is a pointer exchange.
+        app.Post("/admin/models/load", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            try {
+                const json j = json::parse(req.body.empty() ? std::string("{}") : req.body);
+                const std::string name = j.value("name", registry.default_name());
+                std::string path = j.value("path", "");
+                const bool make_default = j.value("default", false);
+                if (name.empty()) throw std::runtime_error("name is required");
+                auto cur = registry.get(name);
+                if (path.empty()) {
+                    if (!cur) throw std::runtime_error("path is required for a new model");
+                    path = cur->path;
+                }
+                const std::string ep = j.value("ep", cur ? cur->ep : cli.ep);
+                if (!is_known_ep(ep)) throw std::runtime_error("unknown ep: " + ep + " (expected " + kEpChoices + ")");
+                const std::string kind = j.value("kind", cur && cur->embed ? "embed" : "rerank");
+                if (kind != "rerank" && kind != "embed") throw std::runtime_error("unknown kind: " + kind + " (expected rerank|embed)");
+                const bool embed = kind == "embed";
+                if (embed && (make_default || name == registry.default_name())) {
+                    throw std::runtime_error("an embedding model cannot be the default model");
+                }
+                cur.reset();
+                require_file_exists(path);
+                if (!registry.begin_load(name)) {
+                    res.status = 409;
+                    res.set_content(json{{"error", "already loading: " + name}}.dump(), "application/json");
+                    return;
+                }
+                std::thread([&, name, path, ep, embed, make_default] {
+                    std::string error;
+                    try {
+                        auto m = load_model(env, name, path, embed ? embed_engine_for(ep) : engine_for(ep), metrics,
+                                            registry.next_generation());
+                        auto old = registry.put(std::move(m), make_default);
+                        metrics.model_loads.fetch_add(1, std::memory_order_relaxed);
+                        std::cerr << "🔁 Model '" << name << "' is live"
+                                  << (old ? " (previous instance drains in-flight requests)" : "") << "\n";
+                    } catch (const std::exception& e) {
+                        error = e.what();
+                        metrics.model_load_fail.fetch_add(1, std::memory_order_relaxed);
+                        std::cerr << "❌ Model load failed for '" << name << "': " << error << "\n";
+                    }
+                    registry.end_load(name, error);
+                }).detach();
+                res.status = 202;
+                res.set_content(json{{"loading", name}, {"path", path}, {"ep", ep}, {"kind", kind}}.dump(), "application/json");
+            } catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            }
+        });
+
+        app.Post("/admin/models/unload", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            try {
+                const json j = json::parse(req.body);
+                const std::string name = j.at("name").get<std::string>();
+                if (!registry.remove(name)) {
+                    res.status = 404;
+                    res.set_content(json{{"error", "unknown model: " + name}}.dump(), "application/json");
+                    return;
+                }
+                res.set_content(json{{"unloaded", name}}.dump(), "application/json");
+            } catch (const json::exception& e) {
+                res.status = 400;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            } catch (const std::exception& e) {
+                res.status = 409;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            }
+        });
+
+        // Spans recorded so far as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+        app.Get("/admin/trace", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            std::string out;
+            write_chrome_trace(out, metrics.trace);
+            res.set_content(std::move(out), "application/json");
+        });
+
+        // {"enable": true, "sample": 10}: turn span recording on/off at runtime.
+        app.Post("/admin/trace", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            try {
+                const json j = json::parse(req.body.empty() ? std::string("{}") : req.body);
+                const bool on = j.value("enable", true);
+                const uint32_t sample = (uint32_t)std::max<int64_t>(1, j.value("sample", (int64_t)metrics.trace.sample()));
+                metrics.trace.enable(on, trace_events, sample);
+                res.set_content(json{{"enabled", metrics.trace.enabled()}, {"sample", metrics.trace.sample()},
+                                     {"capacity", metrics.trace.capacity()}, {"recorded", metrics.trace.recorded()}}.dump(),
+                                "application/json");
+            } catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            }
+        });
+
+        // ORT's profiler is fixed per session at creation, so a bounded profile
+        // hot-swaps in an instance built with it on, lets it serve for the window,
+        // then ends profiling on its sessions (they keep serving, unprofiled).
+        struct ProfileState {
+            std::mutex mu;
+            std::string state = "idle"; // idle | loading | profiling | done | failed
+            std::string model;
+            std::vector<std::string> files;
+            std::string error;
+        } profile;
+        auto profile_json = [&] {
+            std::lock_guard<std::mutex> lk(profile.mu);
+            return json{{"state", profile.state}, {"model", profile.model}, {"files", profile.files}, {"error", profile.error}};
+        };
+
+        app.Get("/admin/profile", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            res.set_content(profile_json().dump(), "application/json");
+        });
+
+        // {"name": "default", "seconds": 10}
+        app.Post("/admin/profile", [&](const httplib::Request& req, httplib::Response& res) {
+            if (!admin_ok(req, res)) return;
+            try {
+                const json j = json::parse(req.body.empty() ? std::string("{}") : req.body);
+                const std::string name = j.value("name", registry.default_name());
+                const int64_t seconds = std::min(profile_max_sec, std::max<int64_t>(1, j.value("seconds", (int64_t)10)));
+                auto cur = registry.get(name);
+                if (!cur) {
+                    res.status = 404;
+                    res.set_content(json{{"error", "unknown model: " + name}}.dump(), "application/json");
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lk(profile.mu);
+                    if (profile.state == "loading" || profile.state == "profiling") {
+                        res.status = 409;
+                        res.set_content(json{{"error", "a profile is already running for " + profile.model}}.dump(), "application/json");
+                        return;
+                    }
+                }
+                if (!registry.begin_load(name)) {
+                    res.status = 409;
+                    res.set_content(json{{"error", "already loading: " + name}}.dump(), "application/json");
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lk(profile.mu);
+                    profile.state = "loading";
+                    profile.model = name;
+                    profile.files.clear();
+                    profile.error.clear();
+                }
+                EngineConfig cfg = cur->embed ? embed_engine_for(cur->ep) : engine_for(cur->ep);
+                cfg.profile_prefix = profile_dir + "/rerank-" + name;
+                const std::string path = cur->path;
+                cur.reset();
+                std::thread([&, name, path, cfg, seconds] {
+                    std::string error;
+                    bool loaded = false;
+                    try {
+                        std::shared_ptr<ModelInstance> m =
+                            load_model(env, name, path, cfg, metrics, registry.next_generation());
+                        registry.put(m, false);
+                        metrics.model_loads.fetch_add(1, std::memory_order_relaxed);
+                        registry.end_load(name, "");
+                        loaded = true;
+                        {
+                            std::lock_guard<std::mutex> lk(profile.mu);
+                            profile.state = "profiling";
+                        }
+                        std::cerr << "🔬 Profiling '" << name << "' for " << seconds << "s\n";
+                        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+                        // The profiler serializes its own events, so this is safe next to a running batch.
+                        std::vector<std::string> files;
+                        Ort::AllocatorWithDefaultOptions alloc;
+                        for (auto& ps : m->pool) files.push_back(ps->session->EndProfilingAllocated(alloc).get());
+                        std::lock_guard<std::mutex> lk(profile.mu);
+                        profile.state = "done";
+                        profile.files = std::move(files);
+                        std::cerr << "🔬 Profile of '" << name << "' written (" << profile.files.size() << " files)\n";
+                        return;
+                    } catch (const std::exception& e) {
+                        error = e.what();
+                    }
+                    std::cerr << "❌ Profile of '" << name << "' failed: " << error << "\n";
+                    if (!loaded) {
+                        metrics.model_load_fail.fetch_add(1, std::memory_order_relaxed);
+                        registry.end_load(name, error);
+                    }
+                    std::lock_guard<std::mutex> lk(profile.mu);
+                    profile.state = "failed";
+                    profile.error = error;
+                }).detach();
+                res.status = 202;
+                res.set_content(json{{"profiling", name}, {"seconds", seconds}, {"prefix", cfg.profile_prefix}}.dump(),
+                                "application/json");
+            } catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            }
+        });
+
+        // Framed tensor requests: the /v1/rerank tensor path minus HTTP, with the
+        // body in the frame (op 1) or in the client's shared region (op 3).
+        // Always the default model (or its routed variant); deadlines come from
+        // RERANK_DEFAULT_TIMEOUT_MS.
+        auto frame_handle = [&](const FrameRequest& fr, std::string& out) -> uint16_t {
+            metrics.req_total.fetch_add(1, std::memory_order_relaxed);
+            metrics.req_frame.fetch_add(1, std::memory_order_relaxed);
+            metrics.bytes_in.fetch_add((uint64_t)fr.payload.size(), std::memory_order_relaxed);
+            const auto t0 = Clock::now();
+            auto fail = [&](uint16_t status, const std::string& msg) {
+                metrics.count_failure(status);
+                out = json{{"error", msg}}.dump();
+                metrics.bytes_out.fetch_add((uint64_t)out.size(), std::memory_order_relaxed);
+                return status;
+            };
+            if (fr.op != kFrameOpScore && fr.op != kFrameOpScoreShm && fr.op != kFrameOpEmbed) {
+                return fail(400, "frame: unknown op " + std::to_string(fr.op));
+            }
+            const bool embed = fr.op == kFrameOpEmbed;
+            std::shared_ptr<ModelInstance> model = registry.get(embed ? embed_model_name : "");
+            if (!model) {
+                return embed && ready.load(std::memory_order_acquire) ? fail(404, "frame: no embedding model loaded")
+                                                                      : fail(503, "models are still loading");
+            }
+            if (model->embed != embed) return fail(400, "frame: model '" + model->name + "' is not an embedding model");
+
+            try {
+                InflightSlot slot(metrics.inflight, max_inflight);
+                thread_local RerankRequest rr;
+                rr.reset();
+                uint64_t scores_off = 0;
+                if (fr.op != kFrameOpScoreShm) {
+                    parse_tensor_request(fr.payload.data(), fr.payload.size(), max_batch, max_seq, rr);
+                } else {
+                    if (!fr.region) throw std::runtime_error("shm: no region attached (op 2)");
+                    if (fr.payload.size() != 24) throw std::runtime_error("shm: payload must be 24 bytes");
+                    uint64_t off = 0, len = 0;
+                    std::memcpy(&off, fr.payload.data(), 8);
+                    std::memcpy(&len, fr.payload.data() + 8, 8);
+                    std::memcpy(&scores_off, fr.payload.data() + 16, 8);
+                    metrics.req_shm.fetch_add(1, std::memory_order_relaxed);
+                    parse_tensor_request(fr.region->at(off, len), (size_t)len, max_batch, max_seq, rr, true);
+                    fr.region->at(scores_off, (uint64_t)rr.tokens.B * sizeof(float)); // range check before scoring
+                }
+                metrics.parse_us.observe((uint64_t)rr.parse_us);
+                metrics.validate_us.observe((uint64_t)rr.validate_us);
+                const int64_t B = rr.tokens.B, S = rr.tokens.S;
+                metrics.input_tokens.fetch_add((uint64_t)B * (uint64_t)S, std::memory_order_relaxed);
+                if (!embed) model = route_shape(std::move(model), B, S);
+
+                RequestControl ctl;
+                if (default_timeout_ms > 0) ctl.deadline = t0 + std::chrono::milliseconds(default_timeout_ms);
+                if (cancel_on_disconnect) ctl.client_gone = fr.client_gone;
+                if (fr.flags & kFrameFlagBatch) ctl.priority = kPriorityBatch;
+                ctl.trace_id = metrics.trace.request_id();
+                if (embed) {
+                    metrics.req_embed.fetch_add(1, std::memory_order_relaxed);
+                    const ScoreResult emb = embed_rows(*model->batcher, model->embed_dim, rr.tokens, ctl);
+                    const auto t_ser = Clock::now();
+                    out.clear();
+                    append_packed_floats(out, emb.scores.data(), emb.scores.size(), (fr.flags & kFrameFlagFp16) != 0);
+                    metrics.bytes_out.fetch_add((uint64_t)out.size(), std::memory_order_relaxed);
+                    metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                    metrics.serialize_us.observe_since(t_ser);
+                    metrics.total_us.observe_since(t0);
+                    trace_request(metrics.trace, ctl.trace_id, "frame embed", t0,
+                                  {{"parse", rr.parse_us}, {"validate", rr.validate_us}}, t_ser, B, S);
+                    return 200;
+                }
+                const ScoreResult sr = score_with_cache(*model->batcher, model->cache.get(), rr.tokens, ctl);
+
+                const auto t_ser = Clock::now();
+                char* dst;
+                if (fr.op == kFrameOpScore) {
+                    out.resize(sr.scores.size() * sizeof(float));
+                    dst = &out[0];
+                } else {
+                    dst = fr.region->at(scores_off, sr.scores.size() * sizeof(float));
+                }
+                std::memcpy(dst, sr.scores.data(), sr.scores.size() * sizeof(float));
+                metrics.bytes_out.fetch_add((uint64_t)out.size(), std::memory_order_relaxed);
+                metrics.req_ok.fetch_add(1, std::memory_order_relaxed);
+                metrics.serialize_us.observe_since(t_ser);
+                metrics.total_us.observe_since(t0);
+                trace_request(metrics.trace, ctl.trace_id, "frame score", t0,
+                              {{"parse", rr.parse_us}, {"validate", rr.validate_us}}, t_ser, B, S);
+                const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - t0).count();
+                if (ms >= slow_ms) {
+                    metrics.slow_req.fetch_add(1, std::memory_order_relaxed);
+                    std::cerr << "⚠️  slow rerank (frame): " << ms << "ms B=" << B << " S=" << S
+                              << " ep=" << model->ep << " model=" << model->name << "\n";
+                }
+                return 200;
+            } catch (const std::exception&) {
+                const RequestError err = current_request_error(metrics);
+                return fail((uint16_t)err.status, err.message);
+            }
+        };
+        if (!frame_socket.empty()) {
+            frame_server = std::make_unique<FrameServer>(frame_socket, frame_max_bytes, shm_max_bytes, frame_max_conns,
+                                                         frame_handle);
+            frame_server->start();
+            std::cerr << "🚀 Frames: unix:" << frame_socket << "\n";
+        }
+
+        // Load (and warm) startup models while the listener already answers /health.
+        std::atomic<bool> listen_returned{false};
+        std::string startup_error;
+        std::thread startup([&] {
+            try {
+                registry.put(load_model(env, default_model, model_path, engine, metrics, registry.next_generation()), true);
+                for (auto& nm : extra_models) {
+                    registry.put(load_model(env, nm.name, nm.path, engine_for(nm.ep), metrics, registry.next_generation()), false);
+                }
+                for (auto& nm : embed_models) {
+                    registry.put(load_model(env, nm.name, nm.path, embed_engine_for(nm.ep), metrics, registry.next_generation()), false);
+                }
+                if (route_variants.size() > 1) {
+                    std::vector<std::shared_ptr<ModelInstance>> vs;
+                    for (auto& name : route_variants) {
+                        auto m = registry.get(name);
+                        if (!m) throw std::runtime_error("RERANK_ROUTE_VARIANTS: no loaded model named '" + name + "'");
+                        if (m->embed) throw std::runtime_error("RERANK_ROUTE_VARIANTS: '" + name + "' is an embedding model");
+                        vs.push_back(std::move(m));
+                    }
+                    const auto t_cal = Clock::now();
+                    calibrate_router(router, vs, route_batches, route_seqs, route_iters, max_batch, pad_id);
+                    std::cerr << "🧭 Routing calibrated over " << vs.size() << " variants in "
+                              << std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - t_cal).count()
+                              << "ms (see /health routing)\n";
+                }
+                metrics.model_loads.store(registry.list().size(), std::memory_order_relaxed);
+                ready.store(true, std::memory_order_release);
+                std::cerr << "✅ Ready\n";
+            } catch (const std::exception& e) {
+                startup_error = e.what();
+                while (!app.is_running() && !listen_returned.load()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                app.stop();
             }
         });
 
-        std::cerr << "🚀 Listening: http://" << host << ":" << port << "\n";
-        app.listen(host.c_str(), port);
+        std::cerr << "🚀 Listening: " << listen_url << "\n";
+        bool listened;
+        if (!http_unix_socket.empty()) {
+            remove_stale_socket(http_unix_socket);
+            app.set_address_family(AF_UNIX);
+            listened = app.listen(http_unix_socket, 80); // port is ignored for AF_UNIX
+        } else {
+            listened = app.listen(host.c_str(), port);
+        }
+        listen_returned.store(true);
+        startup.join();
+        if (frame_server) frame_server->stop();
+        if (!http_unix_socket.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(http_unix_socket, ec);
+        }
+        if (!startup_error.empty()) throw std::runtime_error("model load failed: " + startup_error);
+        if (!listened) throw std::runtime_error("cannot listen on " + listen_url);
         return 0;
 
     } catch (const Ort::Exception& e) {
@@ -0,0 +1,919 @@
+// rerank_http/rerank_core.cpp
+// See rerank_core.hpp.
+
+#include "rerank_core.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__linux__)
+  #include <pthread.h>
+  #include <sched.h>
+  #include <dirent.h>
+#elif defined(__APPLE__)
+  #include <sys/sysctl.h>
+#endif
+
+// ---- Optional CoreML EP header (macOS) ----
+#if defined(__APPLE__)
+  #if defined(__has_include)
+    #if __has_include(<coreml_provider_factory.h>)
+      #include <coreml_provider_factory.h>
+      #define RERANK_HAS_COREML_EP 1
+    #else
+      #define RERANK_HAS_COREML_EP 0
+    #endif
+  #else
+    #define RERANK_HAS_COREML_EP 0
+  #endif
+#else
+  #define RERANK_HAS_COREML_EP 0
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+  #include <immintrin.h>
+  #define RERANK_SIMD_SSE2 1
+#else
+  #define RERANK_SIMD_SSE2 0
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define RERANK_SIMD_NEON 1
+#else
+  #define RERANK_SIMD_NEON 0
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Convert float16 (IEEE 754) -> float32
+static float fp16_to_fp32(uint16_t h) {
+    uint16_t h_exp = (h & 0x7C00u);
+    uint16_t h_sig = (h & 0x03FFu);
+    uint32_t f_sgn = ((uint32_t)h & 0x8000u) << 16;
+
+    if (h_exp == 0x7C00u) { // Inf/NaN
+        uint32_t f_exp = 0x7F800000u;
+        uint32_t f_sig = (uint32_t)h_sig << 13;
+        uint32_t bits = f_sgn | f_exp | f_sig;
+        float out;
+        std::memcpy(&out, &bits, sizeof(out));
+        return out;
+    }
+
+    if (h_exp == 0) { // Subnormal/zero
+        if (h_sig == 0) {
+            uint32_t f = f_sgn;
+            float out;
+            std::memcpy(&out, &f, sizeof(out));
+            return out;
+        }
+        int shift = 0;
+        while ((h_sig & 0x0400u) == 0) { h_sig <<= 1; shift++; }
+        h_sig &= 0x03FFu;
+        uint32_t f_exp = (uint32_t)(127 - 14 - shift) << 23; // subnormal: 2^-14 * 0.sig
+        uint32_t f_sig2 = (uint32_t)h_sig << 13;
+        uint32_t f = f_sgn | f_exp | f_sig2;
+        float out;
+        std::memcpy(&out, &f, sizeof(out));
+        return out;
+    }
+
+    uint32_t f_exp = (uint32_t)(((h_exp >> 10) + (127 - 15)) & 0xFF) << 23;
+    uint32_t f_sig2 = (uint32_t)h_sig << 13;
+    uint32_t f = f_sgn | f_exp | f_sig2;
+    float out;
+    std::memcpy(&out, &f, sizeof(out));
+    return out;
+}
+
+// Convert float32 -> float16, round to nearest even.
+static uint16_t fp32_to_fp16(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint16_t sgn = (uint16_t)((x >> 16) & 0x8000u);
+    const uint32_t ax = x & 0x7FFFFFFFu;
+    if (ax >= 0x7F800000u) return sgn | (ax > 0x7F800000u ? 0x7E00u : 0x7C00u); // NaN / Inf
+    if (ax >= 0x477FF000u) return sgn | 0x7C00u;                                 // rounds past 65504
+    if (ax < 0x38800000u) {                                                       // half subnormal or zero
+        if (ax < 0x33000000u) return sgn;
+        const uint32_t m = (ax & 0x007FFFFFu) | 0x00800000u;
+        const int shift = 126 - (int)(ax >> 23);
+        const uint32_t q = m >> shift, rem = m & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        return sgn | (uint16_t)(q + (rem > mid || (rem == mid && (q & 1))));
+    }
+    const uint32_t r = ax - 0x38000000u; // rebias the exponent 127 -> 15
+    return sgn | (uint16_t)((r + 0x0FFFu + ((r >> 13) & 1)) >> 13);
+}
+
+/* ===================== SIMD kernels ===================== */
+
+// Mask scans (0/1 check, real row length), fp16 <-> fp32 conversion and the
+// embedding pooling/normalization loops. SSE2 is baseline on x86-64 and NEON
+// on arm64; F16C is picked at run time.
+
+bool mask_is_binary(const int32_t* p, size_t n) {
+    size_t i = 0;
+    uint32_t acc = 0;
+#if RERANK_SIMD_SSE2
+    __m128i vacc = _mm_setzero_si128();
+    const __m128i not1 = _mm_set1_epi32(~1);
+    for (; i + 4 <= n; i += 4) {
+        vacc = _mm_or_si128(vacc, _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i)), not1));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(vacc, _mm_setzero_si128())) != 0xFFFF) return false;
+#elif RERANK_SIMD_NEON
+    uint32x4_t vacc = vdupq_n_u32(0);
+    const uint32x4_t not1 = vdupq_n_u32(~1u);
+    for (; i + 4 <= n; i += 4) {
+        vacc = vorrq_u32(vacc, vandq_u32(vld1q_u32((const uint32_t*)(p + i)), not1));
+    }
+    if (vmaxvq_u32(vacc) != 0) return false;
+#endif
+    for (; i < n; i++) acc |= (uint32_t)p[i] & ~1u;
+    return acc == 0;
+}
+
+int64_t last_nonzero_end(const int32_t* p, int64_t n) {
+#if RERANK_SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    while (n >= 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(p + n - 4));
+        const int nz = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) & 0xF;
+        if (nz) return n - 4 + (32 - __builtin_clz((unsigned)nz));
+        n -= 4;
+    }
+#elif RERANK_SIMD_NEON
+    while (n >= 4) {
+        const uint32x4_t v = vld1q_u32((const uint32_t*)(p + n - 4));
+        if (vmaxvq_u32(v) != 0) break;
+        n -= 4;
+    }
+#endif
+    while (n > 0 && p[n - 1] == 0) n--;
+    return n;
+}
+
+#if RERANK_SIMD_SSE2
+__attribute__((target("avx,f16c")))
+static void fp16_to_fp32_f16c(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+    for (; i < n; i++) dst[i] = fp16_to_fp32(src[i]);
+}
+
+static bool cpu_has_f16c() {
+    static const bool has = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return has;
+}
+#endif
+
+void fp16_to_fp32_bulk(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+#if RERANK_SIMD_SSE2
+    if (cpu_has_f16c()) {
+        fp16_to_fp32_f16c(src, dst, n);
+        return;
+    }
+#elif RERANK_SIMD_NEON
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    }
+#endif
+    for (; i < n; i++) dst[i] = fp16_to_fp32(src[i]);
+}
+
+#if RERANK_SIMD_SSE2
+__attribute__((target("avx,f16c")))
+static void fp32_to_fp16_f16c(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; i++) dst[i] = fp32_to_fp16(src[i]);
+}
+#endif
+
+void fp32_to_fp16_bulk(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+#if RERANK_SIMD_SSE2
+    if (cpu_has_f16c()) {
+        fp32_to_fp16_f16c(src, dst, n);
+        return;
+    }
+#elif RERANK_SIMD_NEON
+    for (; i + 4 <= n; i += 4) {
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+    }
+#endif
+    for (; i < n; i++) dst[i] = fp32_to_fp16(src[i]);
+}
+
+// dst += src
+static void add_f32(float* dst, const float* src, size_t n) {
+    size_t i = 0;
+#if RERANK_SIMD_SSE2
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+        _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_loadu_ps(src + i + 4)));
+    }
+#elif RERANK_SIMD_NEON
+    for (; i + 8 <= n; i += 8) {
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+        vst1q_f32(dst + i + 4, vaddq_f32(vld1q_f32(dst + i + 4), vld1q_f32(src + i + 4)));
+    }
+#endif
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+static void scale_f32(float* v, float s, size_t n) {
+    size_t i = 0;
+#if RERANK_SIMD_SSE2
+    const __m128 vs = _mm_set1_ps(s);
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(v + i, _mm_mul_ps(_mm_loadu_ps(v + i), vs));
+#elif RERANK_SIMD_NEON
+    const float32x4_t vs = vdupq_n_f32(s);
+    for (; i + 4 <= n; i += 4) vst1q_f32(v + i, vmulq_f32(vld1q_f32(v + i), vs));
+#endif
+    for (; i < n; i++) v[i] *= s;
+}
+
+void mean_pool(const float* h, const int32_t* mask, int64_t S, int64_t H, float* out) {
+    std::fill(out, out + H, 0.0f);
+    int64_t count = 0;
+    for (int64_t s = 0; s < S; s++) {
+        if (!mask[s]) continue;
+        add_f32(out, h + (size_t)s * (size_t)H, (size_t)H);
+        count++;
+    }
+    if (count > 1) scale_f32(out, 1.0f / (float)count, (size_t)H);
+}
+
+void l2_normalize(float* v, size_t n) {
+    size_t i = 0;
+    float sum = 0;
+#if RERANK_SIMD_SSE2
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 x = _mm_loadu_ps(v + i);
+        acc = _mm_add_ps(acc, _mm_mul_ps(x, x));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif RERANK_SIMD_NEON
+    float32x4_t acc = vdupq_n_f32(0);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t x = vld1q_f32(v + i);
+        acc = vmlaq_f32(acc, x, x);
+    }
+    sum = vaddvq_f32(acc);
+#endif
+    for (; i < n; i++) sum += v[i] * v[i];
+    if (sum > 0) scale_f32(v, 1.0f / std::sqrt(sum), n);
+}
+
+/* ===================== CPU affinity ===================== */
+
+CpuList parse_cpu_list(const std::string& s) {
+    CpuList out;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t end = s.find(',', pos);
+        if (end == std::string::npos) end = s.size();
+        std::string item = s.substr(pos, end - pos);
+        pos = end + 1;
+        item.erase(0, item.find_first_not_of(" \t\n"));
+        item.erase(item.find_last_not_of(" \t\n") + 1);
+        if (item.empty()) continue;
+        try {
+            const size_t dash = item.find('-');
+            const int lo = std::stoi(item.substr(0, dash));
+            const int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+            if (lo < 0 || hi < lo) throw std::out_of_range("range");
+            for (int c = lo; c <= hi; c++) out.push_back(c);
+        } catch (...) {
+            throw std::runtime_error("invalid cpu list '" + s + "' (expected e.g. 0-3,8)");
+        }
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+std::vector<int64_t> parse_int_list(const std::string& s) {
+    std::vector<int64_t> out;
+    size_t i = 0;
+    while (i < s.size()) {
+        size_t j = s.find(',', i);
+        if (j == std::string::npos) j = s.size();
+        try {
+            long long v = std::stoll(s.substr(i, j - i));
+            if (v > 0) out.push_back((int64_t)v);
+        } catch (...) {}
+        i = j + 1;
+    }
+    return out;
+}
+
+std::string format_cpu_list(const CpuList& cpus) {
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!out.empty()) out += ',';
+        out += std::to_string(cpus[i]);
+        if (j > i) out += '-' + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+CpuList allowed_cpus() {
+    CpuList out;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) if (CPU_ISSET(c, &set)) out.push_back(c);
+    }
+#endif
+    return out;
+}
+
+std::vector<CpuList> numa_node_cpus() {
+    const CpuList allowed = allowed_cpus();
+    std::vector<CpuList> nodes;
+#if defined(__linux__)
+    std::vector<int> ids;
+    if (DIR* d = opendir("/sys/devices/system/node")) {
+        while (dirent* e = readdir(d)) {
+            if (std::strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+                ids.push_back(std::atoi(e->d_name + 4));
+            }
+        }
+        closedir(d);
+    }
+    std::sort(ids.begin(), ids.end());
+    for (int id : ids) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        std::string line;
+        if (!std::getline(f, line)) continue;
+        CpuList node;
+        try {
+            for (int c : parse_cpu_list(line)) {
+                if (std::binary_search(allowed.begin(), allowed.end(), c)) node.push_back(c);
+            }
+        } catch (const std::exception&) {
+            continue;
+        }
+        if (!node.empty()) nodes.push_back(std::move(node));
+    }
+#endif
+    if (nodes.empty() && !allowed.empty()) nodes.push_back(allowed);
+    return nodes;
+}
+
+bool pin_current_thread(const CpuList& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+std::string ort_intra_affinities(const CpuList& cpus, int intra_threads) {
+    std::string out;
+    if (cpus.empty()) return out;
+    for (int t = 1; t < intra_threads; t++) {
+        if (!out.empty()) out += ';';
+        out += std::to_string(cpus[(size_t)t % cpus.size()] + 1);
+    }
+    return out;
+}
+
+std::string cpu_identity() {
+#if defined(__x86_64__) || defined(_M_X64)
+    std::string id = "x86_64";
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    std::string id = "arm64";
+#else
+    std::string id = "other";
+#endif
+#if defined(__linux__)
+    // x86 reports "model name"; arm64 only implementer and part numbers.
+    std::ifstream f("/proc/cpuinfo");
+    std::string line, implementer, part;
+    while (std::getline(f, line)) {
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        while (!key.empty() && (key.back() == ' ' || key.back() == '\t')) key.pop_back();
+        const std::string val = line.substr(std::min(line.size(), colon + 2));
+        if (key == "model name") return id + " " + val;
+        if (key == "CPU implementer" && implementer.empty()) implementer = val;
+        if (key == "CPU part" && part.empty()) part = val;
+    }
+    if (!implementer.empty()) id += " " + implementer + ":" + part;
+#elif defined(__APPLE__)
+    char buf[256] = {};
+    size_t len = sizeof(buf) - 1;
+    if (sysctlbyname("machdep.cpu.brand_string", buf, &len, nullptr, 0) == 0) id += std::string(" ") + buf;
+#endif
+    return id;
+}
+
+/* ===================== Sessions ===================== */
+
+std::vector<std::string> get_input_names(Ort::Session& session) {
+    Ort::AllocatorWithDefaultOptions alloc;
+    size_t n = session.GetInputCount();
+    std::vector<std::string> out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        Ort::AllocatedStringPtr name = session.GetInputNameAllocated(i, alloc);
+        out.emplace_back(name.get() ? name.get() : "");
+    }
+    return out;
+}
+std::vector<std::string> get_output_names(Ort::Session& session) {
+    Ort::AllocatorWithDefaultOptions alloc;
+    size_t n = session.GetOutputCount();
+    std::vector<std::string> out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        Ort::AllocatedStringPtr name = session.GetOutputNameAllocated(i, alloc);
+        out.emplace_back(name.get() ? name.get() : "");
+    }
+    return out;
+}
+const char* find_name(const std::vector<std::string>& names, const std::string& want) {
+    for (auto& n : names) if (n == want) return n.c_str();
+    return nullptr;
+}
+
+static void append_coreml_ep_or_throw(Ort::SessionOptions& so) {
+#if RERANK_HAS_COREML_EP
+    uint32_t flags = 0;
+    #ifdef ORT_COREML_FLAG_ENABLE_ON_SUBGRAPHS
+        flags |= ORT_COREML_FLAG_ENABLE_ON_SUBGRAPHS;
+    #endif
+    Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_CoreML(so, flags));
+#else
+    (void)so;
+    throw std::runtime_error(
+        "CoreML EP headers not found (onnxruntime/coreml_provider_factory.h).\n"
+        "Fix options:\n"
+        "  1) Install/Build ONNX Runtime with CoreML enabled (macOS), and ensure headers are in include path.\n"
+        "  2) Or run with --ep cpu.\n"
+    );
+#endif
+}
+
+// The V2 provider options are opaque and set by key/value. A build without the
+// EP fails at Create*ProviderOptions; that error is passed on with a hint.
+static void throw_gpu_ep_error(const std::string& ep, const Ort::Exception& e) {
+    throw std::runtime_error("--ep " + ep + ": " + e.what() +
+                             "\nThis needs an onnxruntime-gpu SDK (ORT_ROOT); --list-ep shows what this build has.");
+}
+
+static void append_cuda_ep(Ort::SessionOptions& so, const EpOptions& o) {
+    const OrtApi& api = Ort::GetApi();
+    OrtCUDAProviderOptionsV2* opts = nullptr;
+    try {
+        Ort::ThrowOnError(api.CreateCUDAProviderOptions(&opts));
+    } catch (const Ort::Exception& e) {
+        throw_gpu_ep_error("cuda", e);
+    }
+    std::unique_ptr<OrtCUDAProviderOptionsV2, decltype(api.ReleaseCUDAProviderOptions)> guard(
+        opts, api.ReleaseCUDAProviderOptions);
+    const std::string dev = std::to_string(o.device_id);
+    // B×S changes every run; doubling the device arena would strand most of it.
+    const char* keys[] = {"device_id", "arena_extend_strategy"};
+    const char* vals[] = {dev.c_str(), "kSameAsRequested"};
+    Ort::ThrowOnError(api.UpdateCUDAProviderOptions(opts, keys, vals, 2));
+    so.AppendExecutionProvider_CUDA_V2(*opts);
+}
+
+static void append_tensorrt_ep(Ort::SessionOptions& so, const EpOptions& o) {
+    const OrtApi& api = Ort::GetApi();
+    OrtTensorRTProviderOptionsV2* opts = nullptr;
+    try {
+        Ort::ThrowOnError(api.CreateTensorRTProviderOptions(&opts));
+    } catch (const Ort::Exception& e) {
+        throw_gpu_ep_error("tensorrt", e);
+    }
+    std::unique_ptr<OrtTensorRTProviderOptionsV2, decltype(api.ReleaseTensorRTProviderOptions)> guard(
+        opts, api.ReleaseTensorRTProviderOptions);
+    const std::string dev = std::to_string(o.device_id);
+    std::vector<const char*> keys = {"device_id", "trt_fp16_enable"};
+    std::vector<const char*> vals = {dev.c_str(), o.trt_fp16 ? "1" : "0"};
+    if (!o.trt_cache_dir.empty()) {
+        // Engines are keyed by model, GPU and TensorRT version inside the directory.
+        for (const char* k : {"trt_engine_cache_enable", "trt_timing_cache_enable"}) {
+            keys.push_back(k);
+            vals.push_back("1");
+        }
+        for (const char* k : {"trt_engine_cache_path", "trt_timing_cache_path"}) {
+            keys.push_back(k);
+            vals.push_back(o.trt_cache_dir.c_str());
+        }
+    }
+    Ort::ThrowOnError(api.UpdateTensorRTProviderOptions(opts, keys.data(), vals.data(), keys.size()));
+    so.AppendExecutionProvider_TensorRT_V2(*opts);
+}
+
+const char* const kEpChoices = "cpu|coreml|cuda|tensorrt";
+
+bool is_known_ep(const std::string& ep) {
+    return ep == "cpu" || ep == "coreml" || ep_uses_cuda(ep);
+}
+
+bool ep_uses_cuda(const std::string& ep) { return ep == "cuda" || ep == "tensorrt"; }
+
+Ort::SessionOptions make_session_options(int intra_threads, int inter_threads, const std::string& ep,
+                                         const EpOptions& gpu) {
+    Ort::SessionOptions so;
+    so.SetIntraOpNumThreads(intra_threads);
+    so.SetInterOpNumThreads(inter_threads);
+    so.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+    if (ep == "coreml") append_coreml_ep_or_throw(so);
+    if (ep == "tensorrt") append_tensorrt_ep(so, gpu);
+    if (ep_uses_cuda(ep)) append_cuda_ep(so, gpu);
+    return so;
+}
+
+/* ===================== Memory ===================== */
+
+void register_cpu_arena(Ort::Env& env, const ArenaOptions& a) {
+    // -1 keeps ORT's defaults for the initial chunk and dead bytes per chunk.
+    const Ort::ArenaCfg cfg(a.max_bytes, a.same_as_requested ? 1 : 0, -1, -1);
+    const Ort::MemoryInfo mem = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    env.CreateAndRegisterAllocator(mem, cfg);
+}
+
+bool allocator_stats(const Ort::Session& session, const Ort::MemoryInfo& mem, ArenaStats& out) {
+    const OrtApi& api = Ort::GetApi();
+    OrtKeyValuePairs* kvp = nullptr;
+    try {
+        const Ort::Allocator alloc(session, mem);
+        OrtStatus* st = api.AllocatorGetStats(alloc, &kvp);
+        if (st) {
+            api.ReleaseStatus(st);
+            return false;
+        }
+    } catch (const Ort::Exception&) {
+        return false; // no allocator for this device
+    }
+    const char* const* keys = nullptr;
+    const char* const* vals = nullptr;
+    size_t n = 0;
+    api.GetKeyValuePairs(kvp, &keys, &vals, &n);
+    for (size_t i = 0; i < n; i++) {
+        const int64_t v = std::atoll(vals[i]);
+        if (!std::strcmp(keys[i], "InUse")) out.in_use = v;
+        else if (!std::strcmp(keys[i], "TotalAllocated")) out.reserved = v;
+        else if (!std::strcmp(keys[i], "MaxInUse")) out.peak = v;
+        else if (!std::strcmp(keys[i], "NumArenaExtensions")) out.extensions = v;
+        else if (!std::strcmp(keys[i], "NumArenaShrinkages")) out.shrinkages = v;
+    }
+    api.ReleaseKeyValuePairs(kvp);
+    return true;
+}
+
+/* ===================== Inference ===================== */
+
+// Written as a plain loop so the compiler emits a packed sign-extend
+// (vpmovsxdq / sxtl) at -O2.
+static void widen_tokens(const token_t* src, int64_t* dst, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = (int64_t)src[i];
+}
+
+static size_t element_size(ONNXTensorElementDataType et) {
+    switch (et) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT: return 4;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16: return 2;
+        default: return 0;
+    }
+}
+
+static void read_input_types(Ort::Session& session, const std::vector<std::string>& names, ModelBinding& mb) {
+    for (size_t i = 0; i < names.size(); i++) {
+        ONNXTensorElementDataType* slot = nullptr;
+        if (mb.in_input_ids && names[i] == mb.in_input_ids) slot = &mb.in_input_ids_type;
+        else if (mb.in_attention_mask && names[i] == mb.in_attention_mask) slot = &mb.in_attention_mask_type;
+        else if (mb.in_token_type_ids && names[i] == mb.in_token_type_ids) slot = &mb.in_token_type_ids_type;
+        if (!slot) continue;
+        auto et = session.GetInputTypeInfo(i).GetTensorTypeAndShapeInfo().GetElementType();
+        if (et != ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32 && et != ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64) {
+            throw std::runtime_error("input '" + names[i] + "' must be int32 or int64 (got element type " +
+                                     std::to_string((int)et) + ")");
+        }
+        *slot = et;
+    }
+}
+
+const char* dtype_name(ONNXTensorElementDataType et) {
+    switch (et) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32: return "int32";
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64: return "int64";
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT: return "float32";
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16: return "float16";
+        default: return "other";
+    }
+}
+
+static void read_output_spec(Ort::Session& session, ModelBinding& mb) {
+    Ort::AllocatorWithDefaultOptions alloc;
+    for (size_t i = 0; i < session.GetOutputCount(); i++) {
+        Ort::AllocatedStringPtr name = session.GetOutputNameAllocated(i, alloc);
+        if (!name.get() || std::strcmp(name.get(), mb.out_logits) != 0) continue;
+        auto info = session.GetOutputTypeInfo(i).GetTensorTypeAndShapeInfo();
+        auto shape = info.GetShape();
+        mb.out_dtype = info.GetElementType();
+        mb.out_rank = shape.size();
+        if (shape.size() == 1) mb.out_K = 1;
+        else if ((shape.size() == 2 || shape.size() == 3) && shape.back() > 0) mb.out_K = shape.back();
+        return;
+    }
+}
+
+void bind_model(Ort::Session& session, const std::vector<std::string>& input_names,
+                const std::vector<std::string>& output_names, ModelBinding& mb) {
+    mb.in_input_ids = find_name(input_names, "input_ids");
+    mb.in_attention_mask = find_name(input_names, "attention_mask");
+    mb.in_token_type_ids = find_name(input_names, "token_type_ids"); // optional
+    if (!mb.in_input_ids || !mb.in_attention_mask) {
+        throw std::runtime_error("model must have input_ids and attention_mask");
+    }
+
+    if (mb.embed) {
+        mb.out_logits = find_name(output_names, "last_hidden_state");
+        if (!mb.out_logits) mb.out_logits = find_name(output_names, "sentence_embedding");
+    } else {
+        mb.out_logits = find_name(output_names, "logits");
+    }
+    if (!mb.out_logits && !output_names.empty()) mb.out_logits = output_names[0].c_str();
+    if (!mb.out_logits) throw std::runtime_error("model has no outputs");
+
+    read_input_types(session, input_names, mb);
+    read_output_spec(session, mb);
+    if (mb.embed && mb.out_rank != 2 && mb.out_rank != 3) {
+        throw std::runtime_error(std::string("embedding output '") + mb.out_logits + "' must be [B,S,H] or [B,H]");
+    }
+}
+
+static void decode_scores(const void* data, ONNXTensorElementDataType et, const std::vector<int64_t>& oshape,
+                          const ModelBinding& mb, int64_t B, ScoreResult& r) {
+    if (oshape.empty() || oshape[0] != B) {
+        throw std::runtime_error("unexpected output shape (batch dim mismatch)");
+    }
+
+    int64_t K = 1;
+    if (oshape.size() == 1) {
+        K = 1;
+    } else if (oshape.size() == 2) {
+        K = oshape[1];
+        if (K <= 0) throw std::runtime_error("invalid output K");
+    } else {
+        throw std::runtime_error("unexpected output rank (expected 1 or 2)");
+    }
+
+    int pick = mb.logits_index_default;
+    if (K == 2) pick = 1;
+    if (pick < 0 || pick >= (int)K) {
+        throw std::runtime_error("logits pick index out of range; set RERANK_LOGITS_INDEX properly");
+    }
+
+    r.K = K;
+    r.dtype = (int)et;
+    r.scores.clear();
+    r.scores.reserve((size_t)B);
+
+    if (et == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+        const float* p = static_cast<const float*>(data);
+        if (K == 1) {
+            r.scores.assign(p, p + B);
+        } else {
+            for (int64_t i = 0; i < B; i++) r.scores.push_back(p[i * K + pick]);
+        }
+    } else if (mb.allow_fp16_output && et == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16) {
+        thread_local std::vector<float> f;
+        f.resize((size_t)(B * K));
+        fp16_to_fp32_bulk(static_cast<const uint16_t*>(data), f.data(), f.size());
+        for (int64_t i = 0; i < B; i++) r.scores.push_back(f[(size_t)(i * K + pick)]);
+    } else {
+        throw std::runtime_error("unexpected output dtype (expected float32; enable fp16 via RERANK_ALLOW_FP16_OUTPUT=1 if needed)");
+    }
+}
+
+// Bi-encoder output -> one float32 vector per row: [B,S,H] is pooled over
+// attention_mask (CLS or mean), [B,H] is taken as is; then L2-normalized.
+static void decode_embeddings(const void* data, ONNXTensorElementDataType et, const std::vector<int64_t>& oshape,
+                              const ModelBinding& mb, const TokenBatch& tb, ScoreResult& r) {
+    const int64_t B = tb.B, S = tb.S;
+    if (oshape.empty() || oshape[0] != B) {
+        throw std::runtime_error("unexpected output shape (batch dim mismatch)");
+    }
+    const bool pooled = oshape.size() == 2;
+    if (!pooled && !(oshape.size() == 3 && oshape[1] == S)) {
+        throw std::runtime_error("unexpected embedding output shape (expected [B,S,H] or [B,H])");
+    }
+    const int64_t H = oshape.back();
+    if (H <= 0) throw std::runtime_error("invalid embedding dim");
+    const bool fp16 = et == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16;
+    if (et != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT && !(fp16 && mb.allow_fp16_output)) {
+        throw std::runtime_error("unexpected output dtype (expected float32; enable fp16 via RERANK_ALLOW_FP16_OUTPUT=1 if needed)");
+    }
+
+    r.K = H;
+    r.width = H;
+    r.dtype = (int)et;
+    r.scores.resize((size_t)B * (size_t)H);
+    const size_t row_stride = (pooled ? 1 : (size_t)S) * (size_t)H; // floats per input row
+    const bool mean = !pooled && mb.pooling == Pooling::kMean;
+
+    const float* src = static_cast<const float*>(data);
+    thread_local std::vector<float> f;
+    if (fp16 && mean) { // every position is read: convert once
+        f.resize((size_t)B * row_stride);
+        fp16_to_fp32_bulk(static_cast<const uint16_t*>(data), f.data(), f.size());
+        src = f.data();
+    }
+    for (int64_t i = 0; i < B; i++) {
+        float* out = r.scores.data() + (size_t)i * (size_t)H;
+        const size_t base = (size_t)i * row_stride;
+        if (mean) {
+            mean_pool(src + base, tb.attention_mask + (size_t)i * (size_t)S, S, H, out);
+        } else if (fp16) { // CLS / pooled: only the first H values of the row
+            fp16_to_fp32_bulk(static_cast<const uint16_t*>(data) + base, out, (size_t)H);
+        } else {
+            std::copy_n(src + base, (size_t)H, out);
+        }
+        if (mb.normalize) l2_normalize(out, (size_t)H);
+    }
+}
+
+ScoreResult run_scores(Ort::Session& session, const ModelBinding& mb, const TokenBatch& tb, RunScratch& sc,
+                       const Ort::RunOptions& ro) {
+    const auto t_build = Clock::now();
+    const int64_t B = tb.B, S = tb.S;
+    const size_t n = (size_t)B * (size_t)S;
+
+    if (!sc.io) sc.io = std::make_unique<Ort::IoBinding>(session);
+    Ort::IoBinding& io = *sc.io;
+    const bool pinned = sc.cuda_device >= 0;
+    if (pinned && !sc.pinned) {
+        sc.pinned_mem = Ort::MemoryInfo("CudaPinned", OrtDeviceAllocator, sc.cuda_device, OrtMemTypeCPUOutput);
+        sc.pinned = std::make_unique<Ort::Allocator>(session, sc.pinned_mem);
+    }
+    const OrtMemoryInfo* host_mem = pinned ? (const OrtMemoryInfo*)sc.pinned_mem : (const OrtMemoryInfo*)sc.mem;
+    io.ClearBoundInputs();
+    io.ClearBoundOutputs();
+    sc.inputs.clear();
+
+    const token_t* tti = tb.token_type_ids;
+    if (mb.in_token_type_ids && !tti) {
+        if (sc.zeros.size() < n) sc.zeros.resize(n, 0);
+        tti = sc.zeros.data();
+    }
+
+    const int64_t dims[2] = {B, S};
+    auto bind_input = [&](int slot, const char* name, ONNXTensorElementDataType type, const token_t* p) {
+        if (type == ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32) {
+            // ORT never writes to inputs; CreateTensor just wants a mutable pointer.
+            token_t* data = const_cast<token_t*>(p);
+            if (pinned) {
+                data = static_cast<token_t*>(sc.staged[slot].reserve(*sc.pinned, n * sizeof(token_t)));
+                std::copy_n(p, n, data);
+            }
+            sc.inputs.emplace_back(Ort::Value::CreateTensor<int32_t>(host_mem, data, n, dims, 2));
+        } else {
+            int64_t* w;
+            if (pinned) {
+                w = static_cast<int64_t*>(sc.staged[slot].reserve(*sc.pinned, n * sizeof(int64_t)));
+            } else {
+                if (sc.wide[slot].size() < n) sc.wide[slot].resize(n);
+                w = sc.wide[slot].data();
+            }
+            widen_tokens(p, w, n);
+            sc.inputs.emplace_back(Ort::Value::CreateTensor<int64_t>(host_mem, w, n, dims, 2));
+        }
+        io.BindInput(name, sc.inputs.back());
+    };
+    sc.inputs.reserve(4);
+    bind_input(0, mb.in_input_ids, mb.in_input_ids_type, tb.input_ids);
+    bind_input(1, mb.in_attention_mask, mb.in_attention_mask_type, tb.attention_mask);
+    if (mb.in_token_type_ids) bind_input(2, mb.in_token_type_ids, mb.in_token_type_ids_type, tti);
+
+    const size_t es = element_size(mb.out_dtype);
+    const bool prebound = mb.out_K > 0 && es > 0 &&
+        (mb.out_dtype == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || mb.allow_fp16_output);
+    std::vector<int64_t> oshape;
+    void* out_data = nullptr;
+    if (prebound) {
+        if (mb.out_rank == 1) oshape = {B};
+        else if (mb.out_rank == 2) oshape = {B, mb.out_K};
+        else oshape = {B, S, mb.out_K};
+        const size_t bytes = (size_t)B * (mb.out_rank == 3 ? (size_t)S : 1) * (size_t)mb.out_K * es;
+        if (pinned) {
+            out_data = sc.staged[3].reserve(*sc.pinned, bytes);
+        } else {
+            if (sc.out_buf.size() < bytes) sc.out_buf.resize(bytes);
+            out_data = sc.out_buf.data();
+        }
+        sc.inputs.emplace_back(Ort::Value::CreateTensor(
+            host_mem, out_data, bytes, oshape.data(), oshape.size(), mb.out_dtype));
+        io.BindOutput(mb.out_logits, sc.inputs.back());
+    } else {
+        io.BindOutput(mb.out_logits, host_mem);
+    }
+
+    const auto t_run = Clock::now();
+    session.Run(ro, io);
+    const auto t_done = Clock::now();
+
+    ScoreResult r;
+    r.build_us = std::chrono::duration_cast<std::chrono::microseconds>(t_run - t_build).count();
+    r.run_us = std::chrono::duration_cast<std::chrono::microseconds>(t_done - t_run).count();
+
+    auto decode = [&](const void* data, ONNXTensorElementDataType et, const std::vector<int64_t>& shape) {
+        if (mb.embed) decode_embeddings(data, et, shape, mb, tb, r);
+        else decode_scores(data, et, shape, mb, B, r);
+    };
+    if (prebound) {
+        decode(out_data, mb.out_dtype, oshape);
+    } else {
+        std::vector<Ort::Value> outputs = io.GetOutputValues();
+        if (outputs.empty()) throw std::runtime_error("no outputs returned");
+        auto& out = outputs[0];
+        auto info = out.GetTensorTypeAndShapeInfo();
+        decode(out.GetTensorData<uint8_t>(), info.GetElementType(), info.GetShape());
+    }
+    return r;
+}
+
+void* PinnedBuffer::reserve(Ort::Allocator& a, size_t bytes) {
+    if (bytes <= cap) return p;
+    if (p) alloc->Free(p);
+    p = nullptr;
+    cap = 0;
+    alloc = &a;
+    p = a.Alloc(bytes);
+    cap = bytes;
+    return p;
+}
+
+ScoreResult run_pooled(PooledSession& ps, const ModelBinding& mb, const TokenBatch& tb, const Ort::RunOptions& ro) {
+    struct BusyGuard {
+        PooledSession& ps;
+        Clock::time_point t0 = Clock::now();
+        explicit BusyGuard(PooledSession& p) : ps(p) { ps.busy.store(true, std::memory_order_relaxed); }
+        ~BusyGuard() {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count();
+            ps.busy_us.fetch_add((uint64_t)us, std::memory_order_relaxed);
+            ps.runs.fetch_add(1, std::memory_order_relaxed);
+            ps.busy.store(false, std::memory_order_relaxed);
+        }
+    } guard(ps);
+    return run_scores(*ps.session, mb, tb, ps.scratch, ro);
+}
+
+std::vector<std::unique_ptr<PooledSession>> load_session_pool(
+    Ort::Env& env, const std::string& model_path, int n,
+    const std::function<Ort::SessionOptions(int idx)>& make_options,
+    const std::vector<CpuList>& session_cpus) {
+    if (n < 1) n = 1;
+    std::vector<std::unique_ptr<PooledSession>> pool(n);
+    std::vector<std::exception_ptr> errors(n);
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < n; i++) {
+        pool[i] = std::make_unique<PooledSession>();
+        if ((size_t)i < session_cpus.size()) pool[i]->cpus = session_cpus[(size_t)i];
+        loaders.emplace_back([&, i] {
+            try {
+                pin_current_thread(pool[i]->cpus);
+                Ort::SessionOptions so = make_options(i);
+                pool[i]->session = std::make_unique<Ort::Session>(env, model_path.c_str(), so);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& t : loaders) t.join();
+    for (auto& e : errors) if (e) std::rethrow_exception(e);
+    return pool;
+}
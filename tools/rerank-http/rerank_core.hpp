@@ -0,0 +1,226 @@
+// rerank_http/rerank_core.hpp
+// Inference core shared by rerank_http and rerank_bench: session creation,
+// model input/output binding and one scoring run. No HTTP, batching or caching.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_cxx_api.h>
+
+// Bi-encoder pooling of a [B,S,H] output over attention_mask. Outputs that
+// are already [B,H] (e.g. an exported sentence_embedding) are used as is.
+enum class Pooling { kCls, kMean };
+
+struct ModelBinding {
+    const char* in_input_ids = nullptr;
+    const char* in_attention_mask = nullptr;
+    const char* in_token_type_ids = nullptr; // optional
+    const char* out_logits = nullptr;
+    int logits_index_default = 0;
+    bool allow_fp16_output = true;
+
+    // Embedding models: each row becomes an out_K-float vector instead of one
+    // logit. Set by the caller before bind_model, which picks the output.
+    bool embed = false;
+    Pooling pooling = Pooling::kMean;
+    bool normalize = true; // L2-normalize pooled rows
+
+    // Element type each token input is declared with (int32 or int64).
+    ONNXTensorElementDataType in_input_ids_type = ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64;
+    ONNXTensorElementDataType in_attention_mask_type = ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64;
+    ONNXTensorElementDataType in_token_type_ids_type = ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64;
+
+    // Declared output, read at load time. When K and dtype are static the
+    // output is bound into a reused per-session buffer instead of ORT allocating.
+    int64_t out_K = -1; // last dim (hidden size for [B,S,H]); -1: symbolic or unsupported rank
+    size_t out_rank = 0;
+    ONNXTensorElementDataType out_dtype = ONNX_TENSOR_ELEMENT_DATA_TYPE_UNDEFINED;
+};
+
+// Tokens are carried as int32 end to end (vocabulary ids fit comfortably);
+// run_scores widens to int64 only for models that declare int64 inputs.
+using token_t = int32_t;
+
+// Row-major [B,S] token tensors. token_type_ids may be null (zeros are
+// supplied when the model declares the input).
+struct TokenBatch {
+    int64_t B = 0;
+    int64_t S = 0;
+    const token_t* input_ids = nullptr;
+    const token_t* attention_mask = nullptr;
+    const token_t* token_type_ids = nullptr;
+};
+
+// Scores stay float32 end to end: the model emits fp32/fp16, so doubles would
+// only add bytes (cache entries, responses), not precision.
+struct ScoreResult {
+    std::vector<float> scores;
+    int64_t K = 0;
+    int64_t width = 1; // floats per row in scores: 1, or the embedding dim
+    int dtype = 0;
+    int64_t build_us = 0; // tensor creation inside run_scores
+    int64_t run_us = 0;   // session.Run
+};
+
+// Page-locked host memory from a session's "CudaPinned" allocator; grows, never shrinks.
+struct PinnedBuffer {
+    Ort::Allocator* alloc = nullptr;
+    void* p = nullptr;
+    size_t cap = 0;
+
+    PinnedBuffer() = default;
+    PinnedBuffer(const PinnedBuffer&) = delete;
+    PinnedBuffer& operator=(const PinnedBuffer&) = delete;
+    ~PinnedBuffer() { if (p) alloc->Free(p); }
+    void* reserve(Ort::Allocator& a, size_t bytes);
+};
+
+// Per-session scratch, reused across runs: buffers only ever grow to the
+// largest B×S seen, the IoBinding and MemoryInfo are created once.
+struct RunScratch {
+    Ort::MemoryInfo mem = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    std::unique_ptr<Ort::IoBinding> io;
+    std::vector<Ort::Value> inputs;
+    std::vector<token_t> zeros;
+    std::vector<int64_t> wide[3]; // int64 copies for models that declare int64 inputs
+    std::vector<uint8_t> out_buf;
+
+    // CUDA/TensorRT sessions: inputs are staged and outputs bound in pinned
+    // memory, so ORT's host<->device copies are async DMA on the session's
+    // stream rather than a bounce through a driver staging buffer.
+    int cuda_device = -1; // -1: pageable host memory (cpu, coreml)
+    Ort::MemoryInfo pinned_mem{nullptr};
+    std::unique_ptr<Ort::Allocator> pinned;
+    PinnedBuffer staged[4]; // input_ids, attention_mask, token_type_ids, output
+};
+
+// Logical CPU ids, as in /proc/cpuinfo and taskset.
+using CpuList = std::vector<int>;
+
+// One ORT session plus the usage counters reported on /health. Each session
+// is driven by exactly one batch worker, so Run() is never called concurrently.
+struct PooledSession {
+    std::unique_ptr<Ort::Session> session;
+    RunScratch scratch;
+    std::atomic<bool> busy{false};
+    std::atomic<uint64_t> runs{0};
+    std::atomic<uint64_t> busy_us{0};
+    CpuList cpus; // empty: not pinned
+};
+
+/* ===================== SIMD kernels ===================== */
+
+// True when every element is 0 or 1.
+bool mask_is_binary(const int32_t* p, size_t n);
+// One past the last non-zero element of a row (0 if the row is all zeros).
+int64_t last_nonzero_end(const int32_t* p, int64_t n);
+void fp16_to_fp32_bulk(const uint16_t* src, float* dst, size_t n);
+// Round to nearest even, as F16C/NEON conversions do.
+void fp32_to_fp16_bulk(const float* src, uint16_t* dst, size_t n);
+// out[0..H) = mean of the rows h[s*H..] with mask[s] != 0 (zeros if none).
+void mean_pool(const float* h, const int32_t* mask, int64_t S, int64_t H, float* out);
+// v /= |v|; a zero vector is left as is.
+void l2_normalize(float* v, size_t n);
+
+/* ===================== CPU affinity ===================== */
+
+// Linux only; elsewhere nothing is pinned and the lists below are empty.
+
+// "0-3,8,10-11" -> {0,1,2,3,8,10,11}; throws std::runtime_error on bad input.
+CpuList parse_cpu_list(const std::string& s);
+// "64,128,256" -> {64,128,256}; items that are not positive integers are skipped.
+std::vector<int64_t> parse_int_list(const std::string& s);
+// Inverse of parse_cpu_list, with runs collapsed into ranges.
+std::string format_cpu_list(const CpuList& cpus);
+// CPUs this process may run on.
+CpuList allowed_cpus();
+// Processor model string ("Intel(R) Xeon(R) ...", "apple m2", "arm 0x41:0xd0c"),
+// or just the architecture when it cannot be read. For hardware-keyed caches.
+std::string cpu_identity();
+// Allowed CPUs grouped by NUMA node; a single group when topology is unknown.
+std::vector<CpuList> numa_node_cpus();
+// Restricts the calling thread to cpus. False if unsupported or refused.
+bool pin_current_thread(const CpuList& cpus);
+// Value for ORT's "session.intra_op_thread_affinities": one group per pool
+// thread (intra_threads - 1; the calling thread is the remaining one), thread
+// t on cpus[t % size]. ORT counts processors from 1. Empty if nothing to pin.
+std::string ort_intra_affinities(const CpuList& cpus, int intra_threads);
+
+/* ===================== Sessions ===================== */
+
+std::vector<std::string> get_input_names(Ort::Session& session);
+std::vector<std::string> get_output_names(Ort::Session& session);
+const char* find_name(const std::vector<std::string>& names, const std::string& want);
+const char* dtype_name(ONNXTensorElementDataType et);
+
+// Fills mb from the session: input_ids/attention_mask (required),
+// token_type_ids (optional), "logits" or else the first output, plus the
+// declared dtypes. Names point into input_names/output_names, which must
+// outlive mb. logits_index_default/allow_fp16_output are left to the caller.
+// With mb.embed the output is "last_hidden_state" or "sentence_embedding"
+// (else the first one) and must be [B,S,H] or [B,H].
+void bind_model(Ort::Session& session, const std::vector<std::string>& input_names,
+                const std::vector<std::string>& output_names, ModelBinding& mb);
+
+// "cpu|coreml|cuda|tensorrt", for messages.
+extern const char* const kEpChoices;
+bool is_known_ep(const std::string& ep);
+// cuda and tensorrt: the session runs on a GPU and its I/O is staged in pinned memory.
+bool ep_uses_cuda(const std::string& ep);
+
+// Settings for the GPU EPs; cpu and coreml ignore them.
+struct EpOptions {
+    int device_id = 0;
+    std::string trt_cache_dir; // TensorRT engine + timing cache; empty: engines are rebuilt per start
+    bool trt_fp16 = false;
+};
+
+// Intra/inter-op threads, ORT_ENABLE_ALL, and the EP. tensorrt also appends
+// CUDA for the nodes TensorRT does not take.
+Ort::SessionOptions make_session_options(int intra_threads, int inter_threads, const std::string& ep,
+                                         const EpOptions& gpu = {});
+
+// Sessions are built in parallel: graph optimization dominates load time.
+// With session_cpus, loader i runs pinned to session_cpus[i] so the weights
+// are first touched (and so placed) on that set's NUMA node.
+std::vector<std::unique_ptr<PooledSession>> load_session_pool(
+    Ort::Env& env, const std::string& model_path, int n,
+    const std::function<Ort::SessionOptions(int idx)>& make_options,
+    const std::vector<CpuList>& session_cpus = {});
+
+/* ===================== Memory ===================== */
+
+// ORT's default CPU arena is per session and doubles on every extension, so
+// one large B×S run can leave it holding several times what later runs use.
+// A shared arena registered on the Env (register_cpu_arena) takes these
+// settings instead; sessions opt into it with "session.use_env_allocators".
+struct ArenaOptions {
+    bool same_as_requested = false; // extend by the allocation size instead of doubling
+    size_t max_bytes = 0;           // 0: unlimited; allocations past it fail the run
+};
+void register_cpu_arena(Ort::Env& env, const ArenaOptions& a);
+
+// AllocatorGetStats counters; -1 where the allocator does not report one.
+struct ArenaStats {
+    int64_t in_use = -1;     // InUse
+    int64_t reserved = -1;   // TotalAllocated: bytes held from the system
+    int64_t peak = -1;       // MaxInUse
+    int64_t extensions = -1; // NumArenaExtensions
+    int64_t shrinkages = -1; // NumArenaShrinkages
+};
+// Stats of the session's allocator for mem; false if it has none or cannot report.
+bool allocator_stats(const Ort::Session& session, const Ort::MemoryInfo& mem, ArenaStats& out);
+
+/* ===================== Inference ===================== */
+
+ScoreResult run_scores(Ort::Session& session, const ModelBinding& mb, const TokenBatch& tb, RunScratch& sc,
+                       const Ort::RunOptions& ro);
+// run_scores plus the PooledSession busy/run counters.
+ScoreResult run_pooled(PooledSession& ps, const ModelBinding& mb, const TokenBatch& tb, const Ort::RunOptions& ro);
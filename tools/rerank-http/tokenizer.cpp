@@ -0,0 +1,499 @@
+// rerank_http/tokenizer.cpp
+// See tokenizer.hpp. Behaviour follows HuggingFace `tokenizers` for the
+// supported components so ids match the Python proxy.
+
+#include "tokenizer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/* ===================== helpers ===================== */
+
+static size_t utf8_len(unsigned char c) {
+    if (c < 0x80) return 1;
+    if ((c >> 5) == 0x6) return 2;
+    if ((c >> 4) == 0xE) return 3;
+    if ((c >> 3) == 0x1E) return 4;
+    return 1; // invalid lead byte: treat as a single unit
+}
+
+static std::string base64_decode(const std::string& in) {
+    static const std::string chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int8_t rev[256];
+    std::memset(rev, -1, sizeof(rev));
+    for (size_t i = 0; i < chars.size(); i++) rev[(unsigned char)chars[i]] = (int8_t)i;
+
+    std::string out;
+    out.reserve(in.size() * 3 / 4);
+    uint32_t buf = 0;
+    int bits = 0;
+    for (unsigned char c : in) {
+        if (c == '=') break;
+        if (rev[c] < 0) continue; // whitespace/newlines
+        buf = (buf << 6) | (uint32_t)rev[c];
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)((buf >> bits) & 0xFF));
+        }
+    }
+    return out;
+}
+
+static int32_t special_token_id(const json& j, const std::unordered_map<std::string_view, int32_t>& ids,
+                                const std::string& content) {
+    if (j.contains("added_tokens") && j["added_tokens"].is_array()) {
+        for (auto& t : j["added_tokens"]) {
+            if (t.value("content", "") == content && t.contains("id")) return t["id"].get<int32_t>();
+        }
+    }
+    auto it = ids.find(content);
+    return it != ids.end() ? it->second : -1;
+}
+
+/* ===================== load ===================== */
+
+std::unique_ptr<Tokenizer> Tokenizer::load(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.good()) throw std::runtime_error("tokenizer file not found or not readable: " + path);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    json j = json::parse(ss.str());
+
+    std::unique_ptr<Tokenizer> tp(new Tokenizer());
+    Tokenizer& t = *tp;
+
+    // ---- model ----
+    const json& model = j.at("model");
+    t.model_type_ = model.value("type", "");
+    if (t.model_type_ != "Unigram") {
+        throw std::runtime_error("tokenizer: unsupported model type '" + t.model_type_ + "' (only Unigram)");
+    }
+    const json& vocab = model.at("vocab");
+    t.pieces_.reserve(vocab.size());
+    double min_score = std::numeric_limits<double>::max();
+    for (auto& v : vocab) {
+        Piece p;
+        p.text = v.at(0).get<std::string>();
+        p.score = v.at(1).get<double>();
+        min_score = std::min(min_score, p.score);
+        t.pieces_.push_back(std::move(p));
+    }
+    t.piece_ids_.reserve(t.pieces_.size());
+    for (size_t i = 0; i < t.pieces_.size(); i++) {
+        const std::string& s = t.pieces_[i].text;
+        t.piece_ids_.emplace(std::string_view(s), (int32_t)i);
+        t.max_piece_bytes_ = std::max(t.max_piece_bytes_, s.size());
+    }
+    if (model.contains("unk_id") && model["unk_id"].is_number_integer()) t.unk_id_ = model["unk_id"].get<int32_t>();
+    t.byte_fallback_ = model.value("byte_fallback", false);
+    // HF: unknown pieces score 10 below the worst vocabulary piece.
+    t.unk_score_ = (t.pieces_.empty() ? 0.0 : min_score) - 10.0;
+
+    // ---- normalizer ----
+    std::vector<const json*> norms;
+    if (j.contains("normalizer") && !j["normalizer"].is_null()) {
+        const json& n = j["normalizer"];
+        if (n.value("type", "") == "Sequence") {
+            for (auto& x : n.at("normalizers")) norms.push_back(&x);
+        } else {
+            norms.push_back(&n);
+        }
+    }
+    for (const json* np : norms) {
+        const std::string type = np->value("type", "");
+        if (type == "Precompiled") {
+            const std::string blob = base64_decode(np->value("precompiled_charsmap", ""));
+            if (blob.empty()) continue;
+            if (blob.size() < 4) throw std::runtime_error("tokenizer: truncated precompiled_charsmap");
+            uint32_t trie_bytes = 0;
+            std::memcpy(&trie_bytes, blob.data(), 4);
+            if (trie_bytes % 4 != 0 || 4 + (size_t)trie_bytes > blob.size()) {
+                throw std::runtime_error("tokenizer: malformed precompiled_charsmap");
+            }
+            t.charsmap_trie_.resize(trie_bytes / 4);
+            std::memcpy(t.charsmap_trie_.data(), blob.data() + 4, trie_bytes);
+            t.charsmap_normalized_ = blob.substr(4 + trie_bytes);
+            t.steps_.push_back(Step::Precompiled);
+        } else if (type == "Replace") {
+            ReplaceRule r;
+            const json& pat = np->at("pattern");
+            if (pat.contains("Regex")) {
+                r.is_regex = true;
+                r.re = std::regex(pat["Regex"].get<std::string>(), std::regex::ECMAScript | std::regex::optimize);
+            } else {
+                r.literal = pat.at("String").get<std::string>();
+                if (r.literal.empty()) continue;
+            }
+            r.content = np->value("content", "");
+            t.replaces_.push_back(std::move(r));
+            t.steps_.push_back(Step::Replace);
+        } else {
+            throw std::runtime_error("tokenizer: unsupported normalizer '" + type + "'");
+        }
+    }
+
+    // ---- pre-tokenizer ----
+    if (j.contains("pre_tokenizer") && !j["pre_tokenizer"].is_null()) {
+        const json& pt = j["pre_tokenizer"];
+        const std::string type = pt.value("type", "");
+        if (type != "Metaspace") throw std::runtime_error("tokenizer: unsupported pre_tokenizer '" + type + "'");
+        t.metaspace_ = true;
+        t.replacement_ = pt.value("replacement", t.replacement_);
+        if (pt.contains("prepend_scheme")) {
+            t.prepend_ = pt["prepend_scheme"].get<std::string>() != "never";
+        } else {
+            t.prepend_ = pt.value("add_prefix_space", true);
+        }
+        t.split_ = pt.value("split", true);
+    }
+
+    // ---- post-processor (pair and single templates) ----
+    auto special = [&](const json& pair_entry) -> int32_t {
+        // ["</s>", 2] as used by Roberta/BertProcessing
+        return pair_entry.at(1).get<int32_t>();
+    };
+    if (j.contains("post_processor") && !j["post_processor"].is_null()) {
+        const json& pp = j["post_processor"];
+        const std::string type = pp.value("type", "");
+        if (type == "TemplateProcessing") {
+            const json& specials = pp.value("special_tokens", json::object());
+            auto read_template = [&](const json& items, std::vector<TemplateItem>& out) {
+                for (auto& item : items) {
+                    if (item.contains("SpecialToken")) {
+                        const json& st = item["SpecialToken"];
+                        const std::string name = st.at("id").get<std::string>();
+                        const int32_t type_id = st.value("type_id", 0);
+                        if (!specials.contains(name)) throw std::runtime_error("tokenizer: template special '" + name + "' has no ids");
+                        for (auto& id : specials[name].at("ids")) {
+                            TemplateItem ti;
+                            ti.special_id = id.get<int32_t>();
+                            ti.type_id = type_id;
+                            out.push_back(ti);
+                        }
+                    } else if (item.contains("Sequence")) {
+                        const json& sq = item["Sequence"];
+                        TemplateItem ti;
+                        ti.seq = sq.at("id").get<std::string>() == "B" ? 1 : 0;
+                        ti.type_id = sq.value("type_id", 0);
+                        out.push_back(ti);
+                    }
+                }
+            };
+            read_template(pp.at("pair"), t.pair_template_);
+            if (pp.contains("single")) read_template(pp["single"], t.single_template_);
+        } else if (type == "RobertaProcessing" || type == "BertProcessing") {
+            const int32_t cls = special(pp.at("cls"));
+            const int32_t sep = special(pp.at("sep"));
+            const bool roberta = (type == "RobertaProcessing");
+            // <s> A </s> </s> B </s>   |   [CLS] A [SEP] B [SEP]
+            t.pair_template_.push_back({cls, 0, 0});
+            t.pair_template_.push_back({-1, 0, 0});
+            t.pair_template_.push_back({sep, 0, 0});
+            // RobertaProcessing gives every token type_id 0 (type_vocab_size is 1).
+            const int32_t b_type = roberta ? 0 : 1;
+            if (roberta) t.pair_template_.push_back({sep, 0, 0});
+            t.pair_template_.push_back({-1, 1, b_type});
+            t.pair_template_.push_back({sep, 0, b_type});
+            t.single_template_ = {{cls, 0, 0}, {-1, 0, 0}, {sep, 0, 0}};
+        } else {
+            throw std::runtime_error("tokenizer: unsupported post_processor '" + type + "'");
+        }
+    }
+    if (t.pair_template_.empty()) {
+        t.pair_template_.push_back({-1, 0, 0});
+        t.pair_template_.push_back({-1, 1, 1});
+    }
+    if (t.single_template_.empty()) t.single_template_.push_back({-1, 0, 0});
+
+    // ---- padding id ----
+    if (j.contains("padding") && j["padding"].is_object() && j["padding"].contains("pad_id")) {
+        t.pad_id_ = j["padding"]["pad_id"].get<int32_t>();
+    } else {
+        int32_t id = special_token_id(j, t.piece_ids_, "<pad>");
+        if (id < 0) id = special_token_id(j, t.piece_ids_, "[PAD]");
+        t.pad_id_ = id < 0 ? 0 : id;
+    }
+
+    return tp;
+}
+
+/* ===================== normalization ===================== */
+
+// sentencepiece normalizer: at each position take the longest charsmap entry
+// that prefixes the remaining input; copy one UTF-8 character otherwise.
+void Tokenizer::precompiled_normalize(const std::string& in, std::string& out) const {
+    const std::vector<uint32_t>& a = charsmap_trie_;
+    auto has_leaf = [](uint32_t u) { return ((u >> 8) & 1) != 0; };
+    auto value = [](uint32_t u) { return u & ((1u << 31) - 1); };
+    auto label = [](uint32_t u) { return u & ((1u << 31) | 0xFF); };
+    auto offset = [](uint32_t u) { return (u >> 10) << ((u & (1u << 9)) >> 6); };
+
+    out.clear();
+    out.reserve(in.size());
+    size_t i = 0;
+    while (i < in.size()) {
+        size_t best_len = 0;
+        uint32_t best_val = 0;
+
+        // darts-clone commonPrefixSearch
+        size_t node = 0;
+        if (!a.empty()) {
+            node ^= offset(a[0]);
+            for (size_t k = i; k < in.size(); k++) {
+                const unsigned char c = (unsigned char)in[k];
+                node ^= c;
+                if (node >= a.size()) break;
+                const uint32_t unit = a[node];
+                if (label(unit) != c) break;
+                node ^= offset(unit);
+                if (node >= a.size()) break;
+                if (has_leaf(unit)) {
+                    best_len = k - i + 1;
+                    best_val = value(a[node]);
+                }
+            }
+        }
+
+        if (best_len > 0 && best_val < charsmap_normalized_.size()) {
+            const char* rep = charsmap_normalized_.c_str() + best_val;
+            out.append(rep, std::strlen(rep));
+            i += best_len;
+        } else {
+            const size_t n = std::min(utf8_len((unsigned char)in[i]), in.size() - i);
+            out.append(in, i, n);
+            i += n;
+        }
+    }
+}
+
+std::string Tokenizer::normalize(const std::string& text) const {
+    std::string cur = text, tmp;
+    size_t next_replace = 0;
+    for (Step s : steps_) {
+        if (s == Step::Precompiled) {
+            precompiled_normalize(cur, tmp);
+            cur.swap(tmp);
+            continue;
+        }
+        const ReplaceRule& r = replaces_[next_replace++];
+        if (r.is_regex) {
+            cur = std::regex_replace(cur, r.re, r.content);
+        } else {
+            tmp.clear();
+            size_t pos = 0;
+            for (;;) {
+                size_t hit = cur.find(r.literal, pos);
+                if (hit == std::string::npos) break;
+                tmp.append(cur, pos, hit - pos);
+                tmp += r.content;
+                pos = hit + r.literal.size();
+            }
+            tmp.append(cur, pos, std::string::npos);
+            cur.swap(tmp);
+        }
+    }
+    return cur;
+}
+
+/* ===================== Unigram ===================== */
+
+void Tokenizer::emit_unknown(std::string_view piece, std::vector<int32_t>& out) const {
+    if (byte_fallback_) {
+        std::vector<int32_t> bytes;
+        char name[8];
+        for (unsigned char c : piece) {
+            std::snprintf(name, sizeof(name), "<0x%02X>", c);
+            auto it = piece_ids_.find(std::string_view(name));
+            if (it == piece_ids_.end()) { bytes.clear(); break; }
+            bytes.push_back(it->second);
+        }
+        if (!bytes.empty()) {
+            out.insert(out.end(), bytes.begin(), bytes.end());
+            return;
+        }
+    }
+    if (unk_id_ >= 0) out.push_back(unk_id_);
+}
+
+// Viterbi over byte positions; consecutive unknown characters are fused into
+// a single unknown piece (HF `fuse_unk`).
+void Tokenizer::unigram_word(std::string_view w, std::vector<int32_t>& out) const {
+    const size_t n = w.size();
+    if (n == 0) return;
+
+    struct Node { int32_t id = -1; size_t start = 0; double score = 0; bool set = false; };
+    thread_local std::vector<Node> best;
+    best.assign(n + 1, Node{});
+    best[0].set = true;
+
+    for (size_t start = 0; start < n; ) {
+        const size_t mblen = std::min(utf8_len((unsigned char)w[start]), n - start);
+        if (!best[start].set) { start += mblen; continue; }
+        const double base = best[start].score;
+        bool has_single = false;
+
+        const size_t limit = std::min(n - start, max_piece_bytes_);
+        for (size_t len = mblen; len <= limit; ) {
+            auto it = piece_ids_.find(w.substr(start, len));
+            if (it != piece_ids_.end()) {
+                Node& tgt = best[start + len];
+                const double cand = base + pieces_[(size_t)it->second].score;
+                if (!tgt.set || cand > tgt.score) tgt = {it->second, start, cand, true};
+                if (len == mblen) has_single = true;
+            }
+            if (start + len >= n) break;
+            len += std::min(utf8_len((unsigned char)w[start + len]), n - start - len);
+        }
+        if (!has_single) {
+            Node& tgt = best[start + mblen];
+            const double cand = base + unk_score_;
+            if (!tgt.set || cand > tgt.score) tgt = {unk_id_, start, cand, true};
+        }
+        start += mblen;
+    }
+
+    // Backtrack, fusing runs of unknowns.
+    thread_local std::vector<std::pair<size_t, size_t>> spans; // [start, end) per token
+    thread_local std::vector<int32_t> ids;
+    spans.clear();
+    ids.clear();
+    for (size_t end = n; end > 0; ) {
+        const Node& node = best[end];
+        const bool unk = (node.id == unk_id_);
+        if (unk && !ids.empty() && ids.back() == unk_id_) {
+            spans.back().first = node.start;
+        } else {
+            spans.emplace_back(node.start, end);
+            ids.push_back(node.id);
+        }
+        end = node.start;
+    }
+    for (size_t k = ids.size(); k-- > 0; ) {
+        if (ids[k] == unk_id_ || ids[k] < 0) {
+            emit_unknown(w.substr(spans[k].first, spans[k].second - spans[k].first), out);
+        } else {
+            out.push_back(ids[k]);
+        }
+    }
+}
+
+std::vector<int32_t> Tokenizer::encode(const std::string& text) const {
+    std::string s = normalize(text);
+    // HF's prepend is a no-op on an empty string, so "" has no tokens at all.
+    if (s.empty()) return {};
+
+    if (metaspace_) {
+        std::string m;
+        m.reserve(s.size() + replacement_.size() * 4);
+        if (prepend_ && s.compare(0, 1, " ") != 0 && s.compare(0, replacement_.size(), replacement_) != 0) {
+            m += replacement_;
+        }
+        for (char c : s) {
+            if (c == ' ') m += replacement_;
+            else m.push_back(c);
+        }
+        s.swap(m);
+    }
+
+    std::vector<int32_t> out;
+    out.reserve(s.size() / 3 + 4);
+    if (!metaspace_ || !split_) {
+        unigram_word(s, out);
+        return out;
+    }
+
+    // Split before every replacement character (MergedWithNext).
+    const std::string_view sv(s);
+    size_t word = 0;
+    size_t pos = sv.find(replacement_, 1);
+    while (pos != std::string_view::npos) {
+        unigram_word(sv.substr(word, pos - word), out);
+        word = pos;
+        pos = sv.find(replacement_, pos + replacement_.size());
+    }
+    unigram_word(sv.substr(word), out);
+    return out;
+}
+
+/* ===================== pair / single encoding ===================== */
+
+size_t Tokenizer::pair_special_count() const {
+    size_t n = 0;
+    for (auto& ti : pair_template_) if (ti.special_id >= 0) n++;
+    return n;
+}
+
+int32_t Tokenizer::sequence_type_id(int seq) const {
+    for (auto& ti : pair_template_) if (ti.special_id < 0 && ti.seq == seq) return ti.type_id;
+    return 0;
+}
+
+void Tokenizer::encode_pair(const std::vector<int32_t>& a, const std::vector<int32_t>& b, size_t max_length,
+                            std::vector<int32_t>& ids, std::vector<int32_t>& type_ids) const {
+    // HF TruncationStrategy::LongestFirst (tokenizers truncation.rs): the
+    // shorter input keeps its length if the longer one can absorb the cut;
+    // otherwise each gets budget/2 and the longer one (b on ties) the odd token.
+    const size_t specials = pair_special_count();
+    const size_t budget = max_length > specials ? max_length - specials : 0;
+    size_t na = a.size(), nb = b.size();
+    if (na + nb > budget) {
+        const bool swap = na > nb;
+        size_t n1 = swap ? nb : na; // shorter
+        size_t n2 = n1 > budget ? n1 : std::max(n1, budget - n1);
+        if (n1 + n2 > budget) {
+            n1 = budget / 2;
+            n2 = n1 + budget % 2;
+        }
+        if (swap) std::swap(n1, n2);
+        na = std::min(na, n1);
+        nb = std::min(nb, n2);
+    }
+
+    ids.clear();
+    type_ids.clear();
+    ids.reserve(na + nb + specials);
+    type_ids.reserve(na + nb + specials);
+    for (auto& ti : pair_template_) {
+        if (ti.special_id >= 0) {
+            ids.push_back(ti.special_id);
+            type_ids.push_back(ti.type_id);
+            continue;
+        }
+        const std::vector<int32_t>& src = ti.seq == 0 ? a : b;
+        const size_t len = ti.seq == 0 ? na : nb;
+        ids.insert(ids.end(), src.begin(), src.begin() + (ptrdiff_t)len);
+        type_ids.insert(type_ids.end(), len, ti.type_id);
+    }
+}
+
+void Tokenizer::encode_single(const std::vector<int32_t>& a, size_t max_length,
+                              std::vector<int32_t>& ids, std::vector<int32_t>& type_ids) const {
+    size_t specials = 0;
+    for (auto& ti : single_template_) if (ti.special_id >= 0) specials++;
+    const size_t na = std::min(a.size(), max_length > specials ? max_length - specials : 0);
+
+    ids.clear();
+    type_ids.clear();
+    ids.reserve(na + specials);
+    type_ids.reserve(na + specials);
+    for (auto& ti : single_template_) {
+        if (ti.special_id >= 0) {
+            ids.push_back(ti.special_id);
+            type_ids.push_back(ti.type_id);
+        } else {
+            ids.insert(ids.end(), a.begin(), a.begin() + (ptrdiff_t)na);
+            type_ids.insert(type_ids.end(), na, ti.type_id);
+        }
+    }
+}
@@ -0,0 +1,105 @@
+// rerank_http/tokenizer.hpp
+// Native loader for HuggingFace tokenizer.json files using a Unigram
+// (SentencePiece) model, e.g. XLM-RoBERTa / bge-reranker-v2-m3.
+//
+// Supported pipeline pieces:
+// - normalizer: Precompiled (sentencepiece charsmap), Replace, Sequence, null
+// - pre_tokenizer: Metaspace, null
+// - model: Unigram (Viterbi, unknown pieces fused like HF)
+// - post_processor: TemplateProcessing, RobertaProcessing, BertProcessing, null
+// Anything else is rejected at load time rather than tokenized differently.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Tokenizer {
+public:
+    // Throws std::runtime_error on unreadable files or unsupported components.
+    // Heap-allocated and pinned: the vocab index holds views into its pieces.
+    static std::unique_ptr<Tokenizer> load(const std::string& path);
+
+    Tokenizer(const Tokenizer&) = delete;
+    Tokenizer& operator=(const Tokenizer&) = delete;
+
+    // Token ids for one text, without special tokens.
+    std::vector<int32_t> encode(const std::string& text) const;
+
+    // Pair row `<special...> a <special...> b <special...>` per the post
+    // processor, truncated longest-first so the row fits max_length.
+    void encode_pair(const std::vector<int32_t>& a, const std::vector<int32_t>& b, size_t max_length,
+                     std::vector<int32_t>& ids, std::vector<int32_t>& type_ids) const;
+
+    // Number of special tokens the pair template adds around a and b.
+    size_t pair_special_count() const;
+
+    // Single row `<special...> a <special...>` per the post processor's single
+    // template (bi-encoder input), with a truncated to fit max_length.
+    void encode_single(const std::vector<int32_t>& a, size_t max_length,
+                       std::vector<int32_t>& ids, std::vector<int32_t>& type_ids) const;
+
+    // token_type_id the pair template gives sequence 0 (A) or 1 (B).
+    int32_t sequence_type_id(int seq) const;
+
+    int32_t pad_id() const { return pad_id_; }
+    size_t vocab_size() const { return pieces_.size(); }
+    const std::string& model_type() const { return model_type_; }
+
+private:
+    Tokenizer() = default;
+
+    struct Piece {
+        std::string text;
+        double score = 0;
+    };
+
+    // One element of a post-processor template: a special token or sequence A/B.
+    struct TemplateItem {
+        int32_t special_id = -1; // -1: a sequence slot
+        int seq = 0;             // 0 = A, 1 = B (when special_id < 0)
+        int32_t type_id = 0;
+    };
+
+    struct ReplaceRule {
+        bool is_regex = false;
+        std::string literal;
+        std::regex re;
+        std::string content;
+    };
+
+    std::string normalize(const std::string& text) const;
+    void precompiled_normalize(const std::string& in, std::string& out) const;
+    void unigram_word(std::string_view word, std::vector<int32_t>& out) const;
+    void emit_unknown(std::string_view piece, std::vector<int32_t>& out) const;
+
+    std::string model_type_;
+    std::vector<Piece> pieces_;
+    std::unordered_map<std::string_view, int32_t> piece_ids_; // views into pieces_[i].text
+    size_t max_piece_bytes_ = 0;
+    int32_t unk_id_ = -1;
+    double unk_score_ = 0;
+    int32_t pad_id_ = 0;
+    bool byte_fallback_ = false;
+
+    // Normalizer steps, applied in order.
+    enum class Step { Precompiled, Replace };
+    std::vector<Step> steps_;
+    std::vector<ReplaceRule> replaces_; // consumed in order by Step::Replace
+    std::vector<uint32_t> charsmap_trie_; // darts-clone double array
+    std::string charsmap_normalized_;   // NUL-separated replacement strings
+
+    // Metaspace
+    bool metaspace_ = false;
+    std::string replacement_ = "\xE2\x96\x81"; // U+2581
+    bool prepend_ = true;
+    bool split_ = true;
+
+    std::vector<TemplateItem> pair_template_;
+    std::vector<TemplateItem> single_template_;
+};
@@ -1,10 +1,17 @@
 import os
+import socket
+import struct
+import sys
+import threading
 import time
 import inspect
+import json
+import mmap
+from array import array
 from typing import List, Optional, Dict, Any
 
 import requests
-from fastapi import FastAPI, HTTPException
+from fastapi import FastAPI, Header, HTTPException
 from pydantic import BaseModel, Field
 from transformers import AutoTokenizer
 
@@ -24,6 +31,12 @@ CPP_RERANK_URL = os.environ.get(
 PROXY_HOST = os.environ.get("RERANK_PROXY_HOST", "127.0.0.1")
 PROXY_PORT = int(os.environ.get("RERANK_PROXY_PORT", "8090"))
 
+# json | tensor (application/x-rerank-tensor) | frame (tensor bodies over a
+# persistent Unix socket) | shm (frame socket + per-thread memfd region, Linux);
+# see tools/rerank-http/README.md
+CPP_RERANK_FORMAT = os.environ.get("CPP_RERANK_FORMAT", "json").strip().lower()
+CPP_RERANK_SOCKET = os.environ.get("CPP_RERANK_SOCKET", "/tmp/rerank-http.frame.sock")
+
 DEFAULT_MAX_LEN = int(os.environ.get("RERANK_MAX_LEN", "512"))
 HTTP_TIMEOUT = float(os.environ.get("RERANK_HTTP_TIMEOUT", "10"))
 
@@ -37,6 +50,10 @@ FIX_MISTRAL_REGEX = os.environ.get("RERANK_FIX_MISTRAL_REGEX", "0").strip() in (
 # ----------------------------
 _http = requests.Session()
 
+# One framed connection (and, for shm, one memfd region) per worker thread;
+# rerank-http answers frames on a connection in order, so threads must not share one.
+_frame_local = threading.local()
+
 # ----------------------------
 # Load tokenizer (once)
 # ----------------------------
@@ -79,6 +96,7 @@ class RerankTextRequest(BaseModel):
     documents: List[str] = Field(..., description="Candidate documents", min_length=1)
     top_k: Optional[int] = Field(None, description="Return top_k results (default all)")
     max_length: Optional[int] = Field(None, description="Tokenizer max_length override")
+    priority: Optional[str] = Field(None, description="interactive (default) | batch")
 
 
 class RerankTextResponse(BaseModel):
@@ -97,14 +115,31 @@ def health():
         "tokenizer_type": tokenizer.__class__.__name__,
         "model_max_length": int(model_max_len),
         "cpp_rerank_url": CPP_RERANK_URL,
+        "cpp_rerank_format": CPP_RERANK_FORMAT,
+        "cpp_rerank_socket": CPP_RERANK_SOCKET if CPP_RERANK_FORMAT in ("frame", "shm") else None,
         "http_timeout_sec": HTTP_TIMEOUT,
         "listening": f"http://{PROXY_HOST}:{PROXY_PORT}",
     }
 
 
-def _call_cpp_reranker(payload: dict) -> List[float]:
+def _encode_tensor_body(input_ids, attention_mask, token_type_ids) -> bytes:
+    B = len(input_ids)
+    S = len(input_ids[0])
+    flags = 1 | (2 if token_type_ids is not None else 0)
+    planes = [input_ids, attention_mask] + ([token_type_ids] if token_type_ids is not None else [])
+    buf = array("i")
+    for plane in planes:
+        for row in plane:
+            buf.extend(row)
+    if sys.byteorder != "little":
+        buf.byteswap()
+    header = b"RRT1" + bytes([1, flags, 0, 0]) + B.to_bytes(4, "little") + S.to_bytes(4, "little")
+    return header + buf.tobytes()
+
+
+def _cpp_post(**kwargs):
     try:
-        r = _http.post(CPP_RERANK_URL, json=payload, timeout=HTTP_TIMEOUT)
+        r = _http.post(CPP_RERANK_URL, timeout=HTTP_TIMEOUT, **kwargs)
     except requests.RequestException as e:
         raise HTTPException(status_code=502, detail=f"cpp reranker request failed: {e}")
 
@@ -114,6 +149,168 @@ def _call_cpp_reranker(payload: dict) -> List[float]:
         except Exception:
             err = {"error": r.text.strip()}
         raise HTTPException(status_code=502, detail={"cpp_status": r.status_code, "cpp_error": err})
+    return r
+
+
+def _call_cpp_reranker_tensor(input_ids, attention_mask, token_type_ids, priority: str) -> List[float]:
+    r = _cpp_post(
+        data=_encode_tensor_body(input_ids, attention_mask, token_type_ids),
+        headers={
+            "Content-Type": "application/x-rerank-tensor",
+            "Accept": "application/octet-stream",
+            "X-Rerank-Priority": priority,
+        },
+    )
+    scores = array("f")
+    try:
+        scores.frombytes(r.content)
+    except ValueError:
+        raise HTTPException(status_code=502, detail="cpp reranker returned a malformed float32 body")
+    if sys.byteorder != "little":
+        scores.byteswap()
+    return scores.tolist()
+
+
+def _frame_close():
+    s = getattr(_frame_local, "sock", None)
+    _frame_local.sock = None
+    if s is not None:
+        try:
+            s.close()
+        except OSError:
+            pass
+
+
+def _recv_exact(s, n: int) -> bytes:
+    buf = bytearray(n)
+    view = memoryview(buf)
+    got = 0
+    while got < n:
+        k = s.recv_into(view[got:])
+        if not k:
+            raise ConnectionError("connection closed by rerank-http")
+        got += k
+    return bytes(buf)
+
+
+def _frame_conn():
+    s = getattr(_frame_local, "sock", None)
+    if s is None:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(HTTP_TIMEOUT)
+        try:
+            s.connect(CPP_RERANK_SOCKET)
+        except OSError:
+            s.close()
+            raise
+        _frame_local.sock = s
+        _frame_local.next_id = 0
+    return s
+
+
+def _frame_roundtrip(op: int, body: bytes, fds=None, flags: int = 0):
+    s = _frame_conn()
+    _frame_local.next_id = (_frame_local.next_id + 1) & 0xFFFFFFFF
+    rid = _frame_local.next_id
+    msg = b"RRF1" + struct.pack("<IIHH", len(body), rid, op, flags) + body
+    if fds:
+        socket.send_fds(s, [msg], fds)
+    else:
+        s.sendall(msg)
+    header = _recv_exact(s, 16)
+    n, got_id, status, _ = struct.unpack("<IIHH", header[4:])
+    if header[:4] != b"RRF1" or got_id != rid:
+        raise ConnectionError("framed response out of sync")
+    return status, _recv_exact(s, n)
+
+
+def _shm_region(need: int) -> mmap.mmap:
+    """This thread's memfd region, attached to its current frame connection."""
+    m = getattr(_frame_local, "shm", None)
+    if m is None or len(m) < need:
+        old_fd = getattr(_frame_local, "shm_fd", None)
+        if old_fd is not None:
+            m.close()
+            os.close(old_fd)
+        size = max(1 << 20, 1 << (need - 1).bit_length())
+        fd = os.memfd_create("rerank-proxy", os.MFD_ALLOW_SEALING)
+        os.ftruncate(fd, size)
+        _frame_local.shm, _frame_local.shm_fd = mmap.mmap(fd, size), fd
+        _frame_local.shm_conn = None
+    s = _frame_conn()
+    # rerank-http unmaps the region when the connection closes; re-attach after a reconnect.
+    if _frame_local.shm_conn is not s:
+        status, payload = _frame_roundtrip(2, b"", [_frame_local.shm_fd])
+        if status != 200:
+            raise HTTPException(status_code=502, detail={"cpp_status": status, "cpp_error": _frame_error(payload)})
+        _frame_local.shm_conn = s
+    return _frame_local.shm
+
+
+def _frame_error(payload: bytes):
+    try:
+        return json.loads(payload)
+    except ValueError:
+        return {"error": payload.decode("utf-8", "replace").strip()}
+
+
+def _frame_call(send):
+    # Retry once on a fresh connection: rerank-http may have restarted since
+    # this thread last used its socket. Timeouts are not retried.
+    for attempt in (0, 1):
+        try:
+            status, payload = send()
+            break
+        except socket.timeout:
+            _frame_close()
+            raise HTTPException(status_code=502, detail="cpp reranker frame request timed out")
+        except (OSError, ConnectionError) as e:
+            _frame_close()
+            if attempt:
+                raise HTTPException(status_code=502, detail=f"cpp reranker frame request failed: {e}")
+    if status != 200:
+        raise HTTPException(status_code=502, detail={"cpp_status": status, "cpp_error": _frame_error(payload)})
+    return payload
+
+
+def _decode_scores(raw) -> List[float]:
+    scores = array("f")
+    try:
+        scores.frombytes(raw)
+    except ValueError:
+        raise HTTPException(status_code=502, detail="cpp reranker returned a malformed float32 body")
+    if sys.byteorder != "little":
+        scores.byteswap()
+    return scores.tolist()
+
+
+def _frame_flags(priority: str) -> int:
+    return 1 if priority == "batch" else 0
+
+
+def _call_cpp_reranker_frame(input_ids, attention_mask, token_type_ids, priority: str) -> List[float]:
+    body = _encode_tensor_body(input_ids, attention_mask, token_type_ids)
+    return _decode_scores(_frame_call(lambda: _frame_roundtrip(1, body, flags=_frame_flags(priority))))
+
+
+def _call_cpp_reranker_shm(input_ids, attention_mask, token_type_ids, priority: str) -> List[float]:
+    # Tensor at offset 0, scores after it (64-byte aligned); rerank-http reads
+    # the tensor in place and writes the scores back into the region.
+    body = _encode_tensor_body(input_ids, attention_mask, token_type_ids)
+    B = len(input_ids)
+    scores_off = (len(body) + 63) & ~63
+
+    def send():
+        m = _shm_region(scores_off + 4 * B)
+        m[0:len(body)] = body
+        return _frame_roundtrip(3, struct.pack("<QQQ", 0, len(body), scores_off), flags=_frame_flags(priority))
+
+    _frame_call(send)
+    return _decode_scores(_frame_local.shm[scores_off:scores_off + 4 * B])
+
+
+def _call_cpp_reranker(payload: dict) -> List[float]:
+    r = _cpp_post(json=payload)
 
     try:
         data = r.json()
@@ -131,7 +328,7 @@ def _call_cpp_reranker(payload: dict) -> List[float]:
 
 
 @app.post("/v1/rerank_text", response_model=RerankTextResponse)
-def rerank_text(req: RerankTextRequest):
+def rerank_text(req: RerankTextRequest, x_rerank_priority: Optional[str] = Header(None)):
     query = (req.query or "").strip()
     docs = [d.strip() for d in (req.documents or []) if d is not None and d.strip()]
 
@@ -142,6 +339,12 @@ def rerank_text(req: RerankTextRequest):
 
     batch_size = len(docs)
 
+    # Same rule as rerank-http: batch if either the body or the header asks for it.
+    priorities = {(p or "interactive").strip().lower() for p in (req.priority, x_rerank_priority)}
+    if not priorities <= {"interactive", "batch"}:
+        raise HTTPException(status_code=400, detail='priority must be "interactive" or "batch"')
+    priority = "batch" if "batch" in priorities else "interactive"
+
     max_len = req.max_length or model_max_len
     if max_len <= 0:
         max_len = 1
@@ -174,16 +377,23 @@ def rerank_text(req: RerankTextRequest):
     if B != batch_size or S <= 0:
         raise HTTPException(status_code=500, detail=f"unexpected tokenized shape: B={B}, S={S}")
 
-    payload = {
-        "shape": [B, S],
-        "input_ids": input_ids,
-        "attention_mask": attention_mask,
-    }
-    if token_type_ids is not None:
-        payload["token_type_ids"] = token_type_ids
-
     t2 = time.time()
-    scores = _call_cpp_reranker(payload)
+    if CPP_RERANK_FORMAT == "tensor":
+        scores = _call_cpp_reranker_tensor(input_ids, attention_mask, token_type_ids, priority)
+    elif CPP_RERANK_FORMAT == "frame":
+        scores = _call_cpp_reranker_frame(input_ids, attention_mask, token_type_ids, priority)
+    elif CPP_RERANK_FORMAT == "shm":
+        scores = _call_cpp_reranker_shm(input_ids, attention_mask, token_type_ids, priority)
+    else:
+        payload = {
+            "shape": [B, S],
+            "input_ids": input_ids,
+            "attention_mask": attention_mask,
+            "priority": priority,
+        }
+        if token_type_ids is not None:
+            payload["token_type_ids"] = token_type_ids
+        scores = _call_cpp_reranker(payload)
     cpp_cost = time.time() - t2
 
     if len(scores) != B:
@@ -207,6 +417,7 @@ def rerank_text(req: RerankTextRequest):
             "B": B,
             "S": S,
             "max_length": int(max_len),
+            "priority": priority,
             "tokenizer_dir": TOKENIZER_DIR,
             "cpp_rerank_url": CPP_RERANK_URL,
             "timing_sec": {